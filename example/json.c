@@ -60,7 +60,7 @@ int add_item_route(struct http_request *req, struct http_response *res) {
         return 0;
     }
 
-    const char *new_item = map_get(req->data, "item");
+    const char *new_item = map_get(http_get_data(req), "item");
     if (new_item && strlen(new_item) < 256) {
         list[list_count++] = strdup(new_item); /* uses malloc */
     }
@@ -8,19 +8,24 @@ static int security_check(const char *path) {
     return 1;
 }
 
-static int read_file(const char *path, char *body, int size) {
+/* Stream the file into the response, no size limit */
+static int read_file(const char *path, struct http_response *res) {
     FILE *fp = fopen(path, "rb");
     if (fp == NULL) {
         return -1;
     }
-    int ret = fread(body, 1, size, fp);
-    if (ret < 0) {
-        fclose(fp);
-        return -1;
+
+    char buffer[8*1024];
+    size_t ret;
+    while ((ret = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        if (http_write(res, buffer, ret) != 0) {
+            fclose(fp);
+            return -1;
+        }
     }
 
     fclose(fp);
-    return ret;
+    return 0;
 }
 
 static void set_content_type(struct http_response *res, const char *path) {
@@ -54,7 +59,7 @@ static int download(struct http_request *req, struct http_response *res) {
     }
 
     /* Read file */
-    ret = read_file(path, res->body, HTTP_RESPONSE_SIZE);
+    ret = read_file(path, res);
     if (ret < 0) {
         printf("File not found\n");
         res->status = HTTP_404_NOT_FOUND;
@@ -62,7 +67,6 @@ static int download(struct http_request *req, struct http_response *res) {
     }
 
     /* Set content options */
-    res->content_length = ret;
     set_content_type(res, req->path);
 
     res->status = HTTP_200_OK;
@@ -0,0 +1,20 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+
+typedef enum {
+    ADMISSION_ADMIT = 0,
+    ADMISSION_SHED
+} admission_t;
+
+/**
+ * CoDel-style admission control on connection queue delay.
+ * While the minimum queue delay over an interval stays above the target the
+ * server is overloaded and work that waited longer than the target is shed,
+ * otherwise only work that waited longer than a full interval is shed.
+ */
+void admission_init(int target_ms, int interval_ms);
+admission_t admission_check(uint64_t queue_delay_ns);
+
+#endif // ADMISSION_H
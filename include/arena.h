@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE 16*1024
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+/**
+ * Bump allocator for request scoped memory.
+ * Allocations are never freed individually, arena_reset releases
+ * everything at once and keeps the first block for the next request.
+ */
+struct arena {
+    struct arena_block *first;
+    struct arena_block *current;
+};
+
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+char *arena_strndup(struct arena *arena, const char *str, size_t length);
+void arena_reset(struct arena *arena);
+void arena_destroy(struct arena *arena);
+
+#endif // ARENA_H
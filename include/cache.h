@@ -0,0 +1,32 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <http.h>
+
+#define CACHE_SIZE 64*1024*1024      /* Default memory cap, --cache-size */
+#define CACHE_ENTRY_MAX 1024*1024    /* Larger responses are not kept */
+#define CACHE_DEFAULT_TTL 10         /* Seconds, for CACHE routes without a max-age */
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256            /* Per shard */
+#define CACHE_VARY_MAX 4
+
+/* cache_serve results */
+#define CACHE_MISS 0
+#define CACHE_HIT 1
+
+/* Memory cap in bytes, 0 disables the cache. Set before serving */
+void cache_set_size(size_t size);
+
+/* Answer a GET or HEAD from a stored response, the body is shared with the cache until the response is done */
+int cache_serve(struct http_request *req, struct http_response *res);
+
+/**
+ * Keep a handler's response if the route opted in or its Cache-Control allows it.
+ * owner identifies the module, its entries are dropped by cache_invalidate.
+ */
+void cache_store(struct http_request *req, struct http_response *res, int opt_in, const void *owner);
+
+/* Drop every response stored for a module, called when its code is swapped */
+void cache_invalidate(const void *owner);
+
+#endif // CACHE_H
@@ -0,0 +1,40 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <stddef.h>
+
+/* Chunk size and trailer lines longer than this are rejected */
+#define CHUNKED_LINE_MAX 1024
+
+/* Chunked request body decoder states */
+enum {
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER,
+    CHUNK_DONE,
+    CHUNK_ERROR
+};
+
+/* Where a chunked body stopped, framing may be split anywhere between reads */
+struct chunked_decoder {
+    int state;
+    size_t remaining; /* Data bytes left in the current chunk */
+};
+
+static inline void chunked_init(struct chunked_decoder *decoder) {
+    decoder->state = CHUNK_SIZE;
+    decoder->remaining = 0;
+}
+
+/**
+ * Decode the framing in in[0, length). Chunk data is moved to out, which may
+ * overlap in as long as it does not start after it, so a body can be decoded in place.
+ * Extensions and trailer fields are skipped.
+ * @param consumed Bytes of in decoded, the rest is a line that has not fully arrived
+ * @param decoded Bytes of chunk data written to out
+ * @return 1 once the last chunk and trailers are in, 0 for more, -1 on bad framing
+ */
+int chunked_decode(struct chunked_decoder *decoder, const char *in, size_t length, size_t *consumed, char *out, size_t *decoded);
+
+#endif // CHUNKED_H
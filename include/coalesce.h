@@ -0,0 +1,23 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <http.h>
+#include <router.h>
+
+#define COALESCE_TIMEOUT 5000  /* Milliseconds a request waits on another's handler, --coalesce-timeout */
+#define COALESCE_SHARDS 16
+#define COALESCE_BUCKETS 64    /* Per shard */
+
+void coalesce_set_timeout(int ms);
+
+/**
+ * Run handler for a COALESCE route. Identical requests arriving while it runs
+ * (same method, path, query, Accept, Authorization and Cookie) wait for it
+ * and get a copy of its response instead of running the handler again.
+ * Responses with Set-Cookie or Cache-Control private or no-store are not
+ * shared, the waiting requests run the handler themselves.
+ * A request that waits past the timeout or its deadline runs the handler itself.
+ */
+void coalesce_execute(handler_t handler, struct http_request *req, struct http_response *res);
+
+#endif // COALESCE_H
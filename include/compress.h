@@ -0,0 +1,47 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <time.h>
+#include <http.h>
+
+#define COMPRESS_MIN_SIZE 1024           /* Smaller bodies are sent as is */
+#define COMPRESS_MAX_SIZE 8*1024*1024    /* Larger bodies are not compressed in memory */
+#define COMPRESS_LEVEL 5                 /* Default for responses compressed on every hit */
+#define COMPRESS_CACHE_ENTRIES 256       /* Compressed variants of cacheable responses */
+#define COMPRESS_CACHE_ENTRY_MAX 256*1024
+#define COMPRESS_ROUTE_SLOTS 64          /* Per thread cache of route metrics */
+#define COMPRESS_ROUTE_LABEL 24          /* Longest route in a metric name */
+
+typedef enum {
+    COMPRESS_IDENTITY,
+    COMPRESS_DEFLATE,
+    COMPRESS_GZIP,
+    COMPRESS_BROTLI,
+    COMPRESS_ENCODING_COUNT
+} compress_encoding_t;
+
+/* Content-Encoding value for each encoding */
+extern const char *compress_encodings[];
+
+void compress_set_level(int level);
+
+/* Best encoding the client accepts, COMPRESS_IDENTITY if none */
+compress_encoding_t compress_negotiate(const struct http_request *req);
+int compress_content_type_allowed(const char *content_type);
+
+/**
+ * Compress in into a malloc'd buffer, variants that are kept get the highest level.
+ * @return Compressed length, 0 if it would not be smaller or failed
+ */
+size_t compress_buffer(compress_encoding_t encoding, int cached, const void *in, size_t length, char **out);
+
+/* Track what compression saved and the thread cpu time spent since cpu_start for a route or mount */
+void compress_account(const char *route, size_t in, size_t out, const struct timespec *cpu_start);
+
+/**
+ * Compress a handler's response after it returns, if the client and content type allow it.
+ * Responses with a public or max-age Cache-Control keep their compressed variants.
+ */
+void compress_response(struct http_request *req, struct http_response *res, const char *route);
+
+#endif // COMPRESS_H
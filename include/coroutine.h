@@ -0,0 +1,49 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define COROUTINE_STACK_SIZE 256*1024   /* Default, --coroutine-stack. Pages are only used when touched */
+#define COROUTINE_MAX 1024              /* Stacks in use at once, --coroutines. Handlers past it run on their worker */
+#define COROUTINE_OFFLOAD_THREADS 4     /* Run library calls that cannot park, e.g. SQLite */
+#define COROUTINE_ALTSTACK 64*1024      /* Per worker signal stack, a handler that overflowed cannot take the signal on its own */
+
+/**
+ * Blocking calls for handlers. On COROUTINE routes they park the handler and
+ * free its worker until the call can go on, anywhere else they simply block.
+ * Socket calls fall back to blocking for descriptors that are not sockets.
+ */
+struct blocking {
+    int (*sleep)(long ms);
+    ssize_t (*read)(int fd, void *buffer, size_t length);
+    ssize_t (*write)(int fd, const void *buffer, size_t length);
+    int (*connect)(int fd, const struct sockaddr *address, socklen_t length);
+};
+
+extern struct blocking* exposed_blocking;
+
+struct thread_pool;
+struct http_request;
+struct http_response;
+
+void coroutine_set_stack_size(size_t size);
+void coroutine_set_limit(int limit);
+
+/* Start the timer and offload threads, parked coroutines are resumed on pool */
+void coroutine_init(struct thread_pool *pool);
+
+/**
+ * Run handler on a pooled coroutine stack. The request is deferred and the
+ * module stays pinned until its response has been sent, maybe from another worker.
+ * The caller's read lock on the module is released before this returns.
+ * @return 0 if a coroutine took the request, -1 if it cannot and the caller runs it as usual, still holding the lock
+ */
+int coroutine_execute(int (*handler)(struct http_request *, struct http_response *), struct http_request *req, struct http_response *res, pthread_rwlock_t *lock);
+
+/* Call fn(arg), which may block. A coroutine parks while an offload thread runs it */
+void coroutine_offload(void (*fn)(void *), void *arg);
+
+#endif // COROUTINE_H
@@ -6,6 +6,8 @@
 #include <container.h>
 #include <scheduler.h>
 #include <db.h>
+#include <sse.h>
+#include <coroutine.h>
 
 /* Third party json parser */
 #include <jansson.h>
@@ -16,6 +18,13 @@
 typedef int (*entry_t)(struct http_request *, struct http_response *);
 typedef enum {
     NONE = 0,
+    PRIORITY = 1 << 0, /* Never shed under overload, e.g. health checks */
+    STREAM_BODY = 1 << 1, /* Body is not buffered, read it with http_read or http_get_data */
+    CACHE = 1 << 2, /* GET responses are kept for their max-age, or CACHE_DEFAULT_TTL seconds without one */
+    COALESCE = 1 << 3, /* Identical concurrent requests share one handler run and its response */
+    ETAG = 1 << 4, /* 200 responses get an ETag from their body, If-None-Match is answered with 304 */
+    COROUTINE = 1 << 5, /* Handler runs on its own stack, blocking-> calls and database->exec park it instead of its worker. Not with COALESCE or CACHE */
+    LAZY_PARAMS = 1 << 6, /* req->params, req->headers and req->data stay NULL until http_get_params, http_get_headers or http_get_data */
 } cweb_feature_flag_t;
 
 /* Websocket information */
@@ -26,12 +35,19 @@ typedef struct ws_info {
     void (*on_close)(struct websocket *); 
 } websocket_info_t;
 
+/* Server-Sent Events stream, events are sent with sse->publish on the same path */
+typedef struct sse_info {
+    const char *path;
+    int (*on_subscribe)(struct http_request *); /* Optional, non-zero refuses the client with 403 */
+} sse_info_t;
+
 /* Route information */
 typedef struct route_info {
     const char *path;
     const char *method;
     entry_t handler;
     int flags;
+    int timeout; /* Milliseconds from accept until the handler is skipped, 0 for none */
 } route_info_t;
 
 /* Module information */
@@ -42,6 +58,8 @@ typedef struct module {
     int size;
     websocket_info_t websockets[10];
     int ws_size;
+    sse_info_t sse[10];
+    int sse_size;
     
     void (*onload)(void);
     void (*unload)(void);
@@ -51,6 +69,8 @@ typedef struct module {
 extern struct container* cache;
 extern struct scheduler* scheduler;
 extern struct sqldb* database;
+extern struct sse* sse;
+extern struct blocking* blocking;
 // KeyValue store
 // Queues
 // Authentication/Sessions.
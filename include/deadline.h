@@ -0,0 +1,42 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <time.h>
+
+#define DEADLINE_NONE (-1)
+
+/* Deadlines are absolute CLOCK_MONOTONIC times, all zero means no deadline */
+static inline int deadline_is_set(const struct timespec *deadline) {
+    return deadline->tv_sec != 0 || deadline->tv_nsec != 0;
+}
+
+/* Milliseconds left before the deadline, 0 once expired or DEADLINE_NONE */
+static inline long deadline_remaining_ms(const struct timespec *deadline) {
+    if (!deadline_is_set(deadline)) {
+        return DEADLINE_NONE;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long remaining = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return remaining > 0 ? remaining : 0;
+}
+
+static inline int deadline_expired(const struct timespec *deadline) {
+    return deadline_remaining_ms(deadline) == 0;
+}
+
+static inline void deadline_after_ms(struct timespec *deadline, const struct timespec *start, long ms) {
+    deadline->tv_sec = start->tv_sec + ms / 1000;
+    deadline->tv_nsec = start->tv_nsec + (ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Deadline of the handler or job running on the calling thread, NULL if none */
+void deadline_set_current(const struct timespec *deadline);
+const struct timespec *deadline_current(void);
+
+#endif // DEADLINE_H
@@ -0,0 +1,36 @@
+#ifndef DEFER_H
+#define DEFER_H
+
+#include <http.h>
+
+/* What finish is asked to do with a parked response */
+typedef enum {
+    DEFERRED_SEND,    /* Completed, send it */
+    DEFERRED_EXPIRE,  /* Deadline passed first, answer 503. The handler still holds the token */
+    DEFERRED_RELEASE, /* Completed after it expired, only free what the request held */
+} deferred_outcome_t;
+
+/**
+ * Runs on the event loop thread once a parked response is completed or its deadline passes,
+ * so it must not block. With DEFERRED_SEND and DEFERRED_RELEASE it owns the token and
+ * frees it with deferred_free, after DEFERRED_EXPIRE the handler still holds it.
+ */
+typedef void (*deferred_finish_t)(struct http_deferred *deferred, void *owner, deferred_outcome_t outcome);
+
+void deferred_set_finish(deferred_finish_t finish);
+
+/* Installed as res->defer, moves req and res into a new token */
+struct http_deferred *deferred_create(struct http_request *req, struct http_response *res);
+
+/**
+ * The handler has returned and owner (the connection) waits for the response.
+ * Completion may already have happened on another thread, either way finish runs
+ * exactly once with DEFERRED_SEND, or with DEFERRED_EXPIRE once req.deadline passes
+ * and DEFERRED_RELEASE when the late completion comes.
+ */
+void deferred_park(struct http_deferred *deferred, void *owner);
+
+/* Once the response has been sent or released */
+void deferred_free(struct http_deferred *deferred);
+
+#endif // DEFER_H
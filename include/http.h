@@ -6,9 +6,14 @@
 #include <string.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <sys/types.h>
+#include <deadline.h>
+#include <arena.h>
 
 #define HTTP_VERSION "HTTP/1.1"
 #define HTTP_RESPONSE_SIZE 8*1024
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_LINE 8*1024
 
 typedef enum http_method {
     HTTP_ERR = -1,
@@ -16,6 +21,9 @@ typedef enum http_method {
     HTTP_POST,
     HTTP_PUT,
     HTTP_DELETE,
+    HTTP_HEAD,
+    HTTP_OPTIONS,
+    HTTP_PATCH,
 } http_method_t;
 extern const char *http_methods[];
 
@@ -26,30 +34,187 @@ typedef enum http_error {
     HTTP_400_BAD_REQUEST,
     HTTP_403_FORBIDDEN,
     HTTP_404_NOT_FOUND,
-    HTTP_500_INTERNAL_SERVER_ERROR
+    HTTP_500_INTERNAL_SERVER_ERROR,
+    HTTP_503_SERVICE_UNAVAILABLE,
+    HTTP_413_PAYLOAD_TOO_LARGE,
+    HTTP_206_PARTIAL_CONTENT,
+    HTTP_304_NOT_MODIFIED,
+    HTTP_416_RANGE_NOT_SATISFIABLE,
+    HTTP_204_NO_CONTENT,
+    HTTP_405_METHOD_NOT_ALLOWED,
+    HTTP_STATUS_COUNT /* Not a status, keep last */
 } http_error_t;
 extern const char *http_errors[];
 
+/* Well-known headers, resolved once at parse time and accessed by slot */
+typedef enum http_header_id {
+    HTTP_HEADER_UNKNOWN = -1,
+    HTTP_HEADER_ACCEPT,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_AUTHORIZATION,
+    HTTP_HEADER_CACHE_CONTROL,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_COOKIE,
+    HTTP_HEADER_EXPECT,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_LAST_EVENT_ID,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_SEC_WEBSOCKET_KEY,
+    HTTP_HEADER_SEC_WEBSOCKET_VERSION,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_UPGRADE,
+    HTTP_HEADER_USER_AGENT,
+    HTTP_HEADER_X_REQUEST_TIMEOUT,
+    HTTP_HEADER_COUNT
+} http_header_id_t;
+
+#define HTTP_HEADER_SLOTS 128 /* Power of two, at least twice HTTP_MAX_HEADERS */
+
+/**
+ * Request headers, names and values point into the connection buffer.
+ * Every header is in the case-insensitive open addressed table,
+ * well-known ones are also reachable directly through their slot.
+ */
+struct http_headers {
+    const char *known[HTTP_HEADER_COUNT];
+    struct http_header {
+        const char *name;
+        const char *value;
+        uint32_t hash;
+    } table[HTTP_HEADER_SLOTS];
+    int count;
+};
+
+/* Part of the connection buffer, offsets stay valid if the buffer is moved */
+struct http_slice {
+    uint32_t offset;
+    uint32_t length;
+};
+
+typedef enum {
+    HTTP_PARSE_ERROR = -1,
+    HTTP_PARSE_OK = 0,
+    HTTP_PARSE_INCOMPLETE = 1
+} http_parse_status_t;
+
+typedef enum {
+    HTTP_PARSER_REQUEST_LINE,
+    HTTP_PARSER_HEADERS,
+    HTTP_PARSER_DONE
+} http_parser_state_t;
+
+/* Resumable request parser, works in place on the connection buffer */
+struct http_parser {
+    http_parser_state_t state;
+    size_t offset; /* Start of the line being parsed */
+    size_t scan;   /* Where to continue looking for the end of the line */
+    size_t body;   /* Offset of the body once headers are done */
+    struct http_slice method;
+    struct http_slice target;
+    struct http_slice query;
+    struct http_slice version;
+    struct http_header_slice {
+        struct http_slice name;
+        struct http_slice value;
+    } headers[HTTP_MAX_HEADERS];
+    int num_headers;
+};
+
+/* Temporary file holding a spilled upload, removed when the request ends */
+struct http_upload {
+    char *path;
+    struct http_upload *next;
+};
+
 struct http_request {
     http_method_t method;
     char *path;
+    char *query; /* Raw query string without '?', NULL if none */
     char *body;
-    int content_length;
+    int content_length; /* -1 while the length of a chunked body is not known */
     char keep_alive;
     char close;
+    char http10; /* HTTP/1.0 client */
     pthread_t tid;
-    struct map *params;
-    struct map *headers;
-    struct map *data;
+    struct map *params; /* Parsed before the handler runs, on LAZY_PARAMS routes use http_get_params */
+    struct map *headers; /* Exact names as sent, as params. Prefer http_get_header or http_header */
+    struct map *data; /* As params, use http_get_data on LAZY_PARAMS and STREAM_BODY routes */
 
     int websocket;
+
+    struct arena *arena; /* Request scoped memory, released after the response is sent */
+
+    /* Body reader, installed by the server. body is NULL for STREAM_BODY routes */
+    long (*read)(struct http_request *req, void *buffer, size_t length);
+    void *connection;
+    struct http_upload *uploads;
+
+    struct timespec received; /* When the request was accepted or read */
+    struct timespec deadline; /* Absolute, from route timeout or client header */
+
+    struct http_headers header_index; /* Always built, backs the header lookups */
 };
 
+typedef enum {
+    HTTP_RESPONSE_CLOSE = 1 << 0,        /* Connection closes after this response */
+    HTTP_RESPONSE_KEEP_ALIVE = 1 << 1,   /* HTTP/1.0 client asked for keep-alive, confirm it */
+    HTTP_RESPONSE_HTTP10 = 1 << 2,       /* Client cannot decode chunked bodies */
+    HTTP_RESPONSE_HEADERS_SENT = 1 << 3,
+    HTTP_RESPONSE_CHUNKED = 1 << 4,
+    HTTP_RESPONSE_CANNED = 1 << 5,       /* Pre-rendered error, headers and body are ignored */
+    HTTP_RESPONSE_NO_BODY = 1 << 6,      /* HEAD, headers go out as for GET but the body does not. Handlers may skip rendering it */
+    HTTP_RESPONSE_ABORTED = 1 << 7,      /* Handler failed after its headers were sent, the body is cut off by closing */
+} http_response_flags_t;
+
+/**
+ * Response to a request.
+ * Handlers either fill body (at least HTTP_RESPONSE_SIZE bytes) directly and
+ * set content_length for binary data, or stream with http_write/http_flush.
+ */
 struct http_response {
     http_error_t status;
     struct map *headers;
     char *body;
     int content_length;
+
+    /* Writer, installed by the server */
+    int (*write)(struct http_response *res, const void *data, size_t length);
+    int (*flush)(struct http_response *res);
+    size_t length; /* Bytes written to body through write */
+    size_t capacity;
+    struct arena *arena;
+    struct response_batch *batch; /* Earlier pipelined responses, written ahead of this one */
+
+    /* Body taken from a file or shared buffer instead of body, set by the static file engine */
+    struct http_response_file {
+        int fd; /* Sent with sendfile when data is NULL, -1 if unused */
+        const char *data;
+        off_t offset;
+        size_t length;
+        void (*release)(void *arg); /* Called once the response is done */
+        void *arg;
+    } file;
+    int fd;
+    int flags;
+
+    /* Installed by the server where handlers may answer later, see http_defer */
+    struct http_deferred *(*defer)(struct http_request *req, struct http_response *res);
+    struct http_deferred *deferred; /* Set once the handler deferred */
+};
+
+/**
+ * Response finished outside the handler, see http_defer.
+ * The request and response are moved here, these are the ones to use from then on.
+ */
+struct http_deferred {
+    struct http_request req;
+    struct http_response res;
+    void (*complete)(struct http_deferred *deferred);
 };
 
 struct websocket {
@@ -59,8 +224,73 @@ struct websocket {
     int (*close)(struct websocket* ws);
 };
 
-int http_parse(const char *request, struct http_request *req);
-int http_parse_data(struct http_request *req);  
+void http_parser_init(struct http_parser *parser);
+int http_parser_execute(struct http_parser *parser, char *buffer, size_t length);
+const char *http_parser_get_header(const struct http_parser *parser, const char *buffer, const char *name);
+int http_request_init(struct http_request *req, struct http_parser *parser, char *buffer);
 int http_is_websocket_upgrade(struct http_request *req);
+void http_set_deadline(struct http_request *req, int route_timeout_ms);
+
+/* Case-insensitive header lookup, NULL if the header is not present */
+const char *http_get_header(const struct http_request *req, const char *name);
+/* Every header in a map keyed by its name as sent, built on first use and cached on the request */
+struct map *http_get_headers(struct http_request *req);
+http_header_id_t http_header_lookup(const char *name, size_t length);
+int http_headers_add(struct http_headers *headers, const char *name, const char *value);
+/* Does a comma separated header value contain token, e.g. Connection: keep-alive, Upgrade */
+int http_header_has_token(const char *value, const char *token);
+
+static inline const char *http_header(const struct http_request *req, http_header_id_t id) {
+    return req->header_index.known[id];
+}
+
+/* Does an If-None-Match list match the entity tag, using weak comparison */
+int http_etag_match(const char *list, const char *etag);
+
+/**
+ * Validator for handlers that can tell their version cheaply, e.g. from a row's updated_at.
+ * Sets the ETag, quotes included, and answers 304 if the client has it.
+ * @return 1 if the handler can return without rendering
+ */
+int http_not_modified(struct http_request *req, struct http_response *res, const char *etag);
+
+/* Query parameters and form fields, parsed and percent-decoded on first use and cached on the request */
+struct map *http_get_params(struct http_request *req);
+struct map *http_get_data(struct http_request *req);
+
+/* Read up to length bytes of the body, 0 once it has been consumed, -1 on error */
+static inline long http_read(struct http_request *req, void *buffer, size_t length) {
+    return req->read(req, buffer, length);
+}
+
+/* Append to the response body, the buffer grows as needed */
+static inline int http_write(struct http_response *res, const void *data, size_t length) {
+    return res->write(res, data, length);
+}
+
+/* Send the response so far, the rest of the body follows chunked if its length is unknown */
+static inline int http_flush(struct http_response *res) {
+    return res->flush(res);
+}
+
+/**
+ * Answer later without holding a worker thread. The handler returns right after
+ * this, then any thread fills deferred->res and calls http_complete, which has
+ * the server send it from a worker. req and res must not be used again.
+ * @return NULL if this request cannot be deferred, answer it as usual
+ */
+static inline struct http_deferred *http_defer(struct http_request *req, struct http_response *res) {
+    return res->defer ? res->defer(req, res) : NULL;
+}
+
+/* Send a deferred response, exactly once per http_defer */
+static inline void http_complete(struct http_deferred *deferred) {
+    deferred->complete(deferred);
+}
+
+/* Milliseconds a handler has left before its deadline, 0 if expired, DEADLINE_NONE if unbounded */
+static inline long http_remaining_ms(const struct http_request *req) {
+    return deadline_remaining_ms(&req->deadline);
+}
 
 #endif // HTTP_H
\ No newline at end of file
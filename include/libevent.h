@@ -10,6 +10,10 @@ extern "C" {
 struct event;
 typedef void (*event_callback_t)(struct event *event, void *arg);
 
+/* Interest passed to event_new, 0 is the same as EVENT_READ */
+#define EVENT_READ  0x1
+#define EVENT_WRITE 0x2
+
 struct event {
     int fd;
     short events;
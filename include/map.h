@@ -11,6 +11,19 @@ typedef enum map_error {
     MAP_KEY_NOT_FOUND = 3,
 } map_error_t;
 
+struct arena;
+
+#define MAP_INLINE_KEY 20 /* Keys shorter than this are stored in the entry, no malloc */
+
+/**
+ * Growable hash map with string keys.
+ * Entries are kept dense in insertion order so they can be iterated with
+ * entries[0..size), removing a key moves the last entry into its place.
+ * Lookups go through a Swiss table style index: one control byte per
+ * bucket holding 7 bits of the hash, probed 16 buckets at a time.
+ * The first three fields and map_entry keep their original layout,
+ * modules built against older headers iterate entries directly.
+ */
 struct map {
     struct map_entry {
         char *key;
@@ -18,13 +31,29 @@ struct map {
     } *entries;
     size_t size;
     size_t capacity;
+
+    /* Parallel to entries, the hash and storage for short keys */
+    struct map_key {
+        uint32_t hash;
+        char small[MAP_INLINE_KEY];
+    } *keys;
+
+    /* Index over entries */
+    uint8_t *ctrl;
+    uint32_t *slots;
+    size_t buckets;
+    size_t tombstones;
+
+    struct arena *arena; /* Set by map_create_arena, NULL if the map is on the heap */
 };
 
 struct map *map_create(size_t initial_capacity);
+/* Everything, long keys included, lives in the arena, map_destroy is a no-op and the arena frees it */
+struct map *map_create_arena(struct arena *arena, size_t initial_capacity);
 void map_destroy(struct map *map);
 int map_insert(struct map *map, const char *key, void *value);
 void *map_get(const struct map *map, const char *key);
 int map_remove(struct map *map, const char *key);
 size_t map_size(const struct map *map);
 
-#endif // MAP_H
\ No newline at end of file
+#endif // MAP_H
@@ -0,0 +1,31 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define METRIC_NAME_MAX 64
+#define METRICS_MAX 256
+
+/* Named counter or gauge, lives for the lifetime of the server */
+struct metric {
+    char name[METRIC_NAME_MAX];
+    atomic_long value;
+};
+
+/**
+ * Find or register a metric by name.
+ * The returned pointer is stable, callers should look it up once and keep it.
+ */
+struct metric *metric_get(const char *name);
+int metrics_render(char *buffer, size_t size);
+
+static inline void metric_add(struct metric *m, long delta) {
+    if (m) atomic_fetch_add(&m->value, delta);
+}
+
+static inline void metric_set(struct metric *m, long value) {
+    if (m) atomic_store(&m->value, value);
+}
+
+#endif // METRICS_H
@@ -6,32 +6,74 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <stdatomic.h>
 
 /* Task structure */
 struct task {
     void (*function)(void *);
     void *arg;
+    uint64_t enqueued; /* Monotonic ns, used to measure queue wait */
+    int node; /* NUMA node the task belongs to, -1 if any */
     struct task *next;
 };
 
-/* Thread pool structure */
-struct thread_pool {
+typedef enum {
+    QUEUE_UNUSED = 0,
+    QUEUE_RUNNING,
+    QUEUE_RETIRING, /* Worker drains its queue and exits */
+    QUEUE_EXITED    /* Worker is done, waiting to be joined by the monitor */
+} task_queue_state_t;
+
+/**
+ * Per-worker run queue, each worker owns one.
+ * Aligned to a cache line so workers dont bounce each others locks.
+ */
+struct task_queue {
     pthread_mutex_t lock;
     pthread_cond_t cond;
+    struct task *head;
+    struct task *tail;
+    atomic_int length;
+    atomic_int sleeping;
+    atomic_int state;
+    int cpu;  /* Pinned cpu and its node in topology-aware mode, else -1 */
+    int node;
+} __attribute__((aligned(64)));
+
+/* Thread pool structure */
+struct thread_pool {
     pthread_t *threads;
-    int *thread_active;
-    struct task *task_queue;
+    struct task_queue *queues; /* Allocated for max_threads, only num_threads are live */
     atomic_int num_threads;
+    int min_threads;
     int max_threads;
-    int queue_length;
+    int num_cores;
+    atomic_int queue_length;
+    atomic_uint next_queue; /* Round robin index for tasks submitted outside the pool */
     volatile int stop;
     atomic_int active_threads; /* Number of threads actively processing */
+    atomic_int blocked_threads; /* Number of threads waiting in blocking calls */
+
+    /* Queue wait statistics, reset by the monitor every interval */
+    atomic_ullong wait_total_ns;
+    atomic_uint wait_samples;
+
+    pthread_t monitor;
+    pthread_mutex_t resize_lock;
 };
 
-struct thread_pool *thread_pool_init(int num_threads);
+struct thread_pool *thread_pool_init(int min_threads, int max_threads);
 void thread_pool_add_task(struct thread_pool *pool, void (*function)(void *), void *arg);
+void thread_pool_add_task_node(struct thread_pool *pool, void (*function)(void *), void *arg, int node);
 void thread_pool_destroy(struct thread_pool *pool);
 int thread_pool_is_full(struct thread_pool *pool);
 
+/* How long the task running on the calling worker waited in the queue */
+uint64_t thread_pool_task_wait_ns(void);
+
+/* Mark the calling worker as blocked (I/O, database, sleep), no-op outside the pool */
+void thread_pool_blocking_begin(void);
+void thread_pool_blocking_end(void);
+
 #endif /* POOL_H */
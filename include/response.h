@@ -0,0 +1,43 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <http.h>
+
+#define RESPONSE_HEADER_SIZE 8*1024
+#define RESPONSE_BATCH_SIZE 64*1024 /* Most bytes of pipelined responses held back */
+
+/* Responses to pipelined requests, held back and written together in one writev */
+struct response_batch {
+    char *buffer;
+    size_t length;
+    size_t capacity;
+};
+
+int http_response_init(struct http_response *res, int fd, struct arena *arena, struct response_batch *batch, int flags);
+/**
+ * Send the response, or what is left of it if it has been flushed before.
+ * With more set another request is already waiting, so a small response is
+ * added to the batch and goes out with a later one.
+ */
+int http_response_send(struct http_response *res, int more);
+
+/* Length of the body held in res->body */
+size_t http_response_body_length(const struct http_response *res);
+
+/**
+ * Give a 200 response an ETag from a hash of its body, unless the handler set one,
+ * and turn it into a 304 if it matches If-None-Match.
+ */
+void http_response_etag(struct http_request *req, struct http_response *res);
+
+/* Add name to the Vary header, keeping what is already listed */
+void http_response_vary(struct http_response *res, const char *name);
+
+/* Answer with the pre-rendered response for status, e.g. a plain 404 */
+void http_response_error(struct http_response *res, http_error_t status);
+
+/* Write out anything held back, must be called before waiting on the client */
+int response_batch_flush(struct response_batch *batch, int fd);
+void response_batch_destroy(struct response_batch *batch);
+
+#endif // RESPONSE_H
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <setjmp.h>
 #include <cweb.h>
 
 #define SO_PATH_MAX_LEN 256
@@ -15,6 +16,8 @@ struct gateway_entry {
     char so_path[SO_PATH_MAX_LEN];
     struct module *module;
     pthread_rwlock_t rwlock;
+    int pins;     /* Handlers still running without the lock, see route_pin */
+    int draining; /* A reload waits for pins to drop, no new ones are taken */
 };
 
 struct route {
@@ -27,14 +30,38 @@ struct ws_route {
     pthread_rwlock_t* rwlock;
 };
 
+struct sse_route {
+    struct sse_info *info;
+    pthread_rwlock_t* rwlock;
+};
+
 int route_register_module(char* so_path);
 struct route route_find(char *route, char *method);
 struct ws_route ws_route_find(char *route);
+struct sse_route sse_route_find(char *route);
+
+/**
+ * Methods routed for a path as an Allow header value, e.g. "GET, HEAD, OPTIONS".
+ * @return Number of matching routes, 0 if the path is unknown
+ */
+int route_allowed_methods(char *route, char *allow, size_t size);
+
+/**
+ * Keep the module behind a route loaded after its read lock is released,
+ * for handlers that outlive the call that found them. Caller holds the lock.
+ * @return 0 if pinned, -1 while the module is being replaced
+ */
+int route_pin(pthread_rwlock_t *lock);
+void route_unpin(pthread_rwlock_t *lock);
 
 /* TODO: Move... */
 int mgnt_parse_request(struct http_request *req, struct http_response *res);
 void safe_execute_handler(handler_t handler, struct http_request *req, struct http_response *res);
 
+/* Where a fault in the running handler jumps to, switched along with coroutines */
+sigjmp_buf *fault_jump_get(void);
+void fault_jump_set(sigjmp_buf *jump);
+
 #define dbgprint(fmt, ...) \
     do { fprintf(stderr, fmt, __VA_ARGS__); } while (0)
 
@@ -0,0 +1,24 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/**
+ * Byte scanners used by the HTTP parser.
+ * The implementation is picked once at startup from what the cpu supports,
+ * the scalar versions are always available and give identical results.
+ */
+struct scanner {
+    const char *name;
+    /* Length of the leading run of RFC 7230 token characters */
+    size_t (*token)(const char *data, size_t length);
+    /* First occurrence of needle in data, NULL if not found. Not NUL-terminated */
+    const char *(*find)(const char *data, size_t length, const char *needle, size_t needle_length);
+};
+
+extern struct scanner scan;
+
+size_t scan_token_scalar(const char *data, size_t length);
+const char *scan_find_scalar(const char *data, size_t length, const char *needle, size_t needle_length);
+
+#endif // SCAN_H
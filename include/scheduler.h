@@ -2,6 +2,7 @@
 #define SCHEDULER_H
 
 #include <pthread.h>
+#include <time.h>
 
 typedef void (*work_t)(void *);
 typedef enum {
@@ -13,6 +14,7 @@ struct work {
     work_t work;
     void *data;
     struct work *next;
+    struct timespec deadline; /* Inherited from the request for SYNC work */
 }; 
 
 struct scheduler {
@@ -0,0 +1,33 @@
+#ifndef SSE_H
+#define SSE_H
+
+#include <stddef.h>
+
+#define SSE_REPLAY_MAX 128        /* Events kept per path for Last-Event-ID resume */
+#define SSE_CLIENT_BACKLOG 256    /* Events queued for a slow subscriber before it is dropped */
+#define SSE_HEARTBEAT 15          /* Seconds of silence before a comment line keeps proxies from timing out */
+#define SSE_RETRY_MS 3000         /* Reconnect delay suggested to clients */
+#define SSE_PATH_MAX 128
+
+/* Server-Sent Events hub, modules publish to the paths listed in their sse routes */
+struct sse {
+    /**
+     * Send an event to every subscriber of path, event may be NULL for the default "message".
+     * Multi-line data is split into data: lines. Safe from handlers, scheduler jobs and any thread.
+     * @return Id of the event, -1 on error
+     */
+    long (*publish)(const char *path, const char *event, const char *data);
+    /* Number of open subscriptions on path */
+    int (*subscribers)(const char *path);
+};
+
+extern struct sse* exposed_sse;
+
+/**
+ * Answer a GET on an SSE route and park the socket in the event loop.
+ * Events after last_event_id still in the replay ring are sent first.
+ * @return 0 when the hub owns fd, -1 if nothing was written and the caller still does
+ */
+int sse_subscribe(int fd, const char *path, const char *last_event_id);
+
+#endif // SSE_H
@@ -0,0 +1,24 @@
+#ifndef STATIC_H
+#define STATIC_H
+
+#include <http.h>
+
+#define STATIC_MAX_MOUNTS 8
+#define STATIC_CACHE_MAX 1024        /* Open files kept per mount */
+#define STATIC_MEMORY_MAX 16*1024    /* Files up to this are kept in memory and sent with the headers */
+#define STATIC_INDEX "index.html"
+
+/* static_serve results */
+#define STATIC_NO_MOUNT 0
+#define STATIC_SERVED 1
+
+/**
+ * Serve files under dir at the URL prefix, e.g. static_mount("/static", "static").
+ * Open descriptors and metadata are cached and invalidated through inotify.
+ */
+int static_mount(const char *prefix, const char *dir);
+
+/* Answer GET and HEAD requests under a mount, STATIC_NO_MOUNT leaves the request to the routes */
+int static_serve(struct http_request *req, struct http_response *res);
+
+#endif // STATIC_H
@@ -0,0 +1,18 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <pthread.h>
+
+/**
+ * CPU and NUMA topology used by the optional topology-aware mode.
+ * When disabled every lookup returns -1 and nothing is pinned.
+ */
+int topology_init(void);
+int topology_enabled(void);
+int topology_num_nodes(void);
+int topology_cpu_node(int cpu);
+int topology_worker_cpu(int index);
+int topology_pin_thread(pthread_t thread, int cpu);
+int topology_socket_node(int fd);
+
+#endif // TOPOLOGY_H
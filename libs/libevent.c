@@ -138,7 +138,7 @@ int event_add(struct event *ev) {
     pthread_once(&kqueue_init_once, initialize_kqueue);
 
     struct kevent ke;
-    EV_SET(&ke, ev->fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, ev);
+    EV_SET(&ke, ev->fd, ev->events == EVENT_WRITE ? EVFILT_WRITE : EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, ev);
     if (kevent(kq, &ke, 1, NULL, 0, NULL) == -1) {
         perror("kevent add failed");
         unlock();
@@ -148,7 +148,9 @@ int event_add(struct event *ev) {
     pthread_once(&epoll_init_once, initialize_epoll);
 
     struct epoll_event ep;
-    ep.events = EPOLLIN | EPOLLET; /* Edge-triggered */
+    ep.events = EPOLLET; /* Edge-triggered */
+    ep.events |= ev->events & EVENT_WRITE ? EPOLLOUT : 0;
+    ep.events |= ev->events == EVENT_WRITE ? 0 : EPOLLIN;
     ep.data.ptr = ev;
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev->fd, &ep) == -1) {
         perror("epoll_ctl add failed");
@@ -180,7 +182,7 @@ int event_del(struct event *ev) {
 
 #ifdef __APPLE__
     struct kevent ke;
-    EV_SET(&ke, ev->fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&ke, ev->fd, ev->events == EVENT_WRITE ? EVFILT_WRITE : EVFILT_READ, EV_DELETE, 0, 0, NULL);
     if (kevent(kq, &ke, 1, NULL, 0, NULL) == -1) {
         perror("kevent delete failed");
         unlock();
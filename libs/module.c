@@ -4,6 +4,8 @@
 #include <container.h>
 #include <scheduler.h>
 #include <db.h>
+#include <sse.h>
+#include <coroutine.h>
 
 /* Macro loads a symbol from the "parent" and exposes it as given variable. */
 #define LOAD_SYMBOL(handle, symbol, type, var) \
@@ -23,6 +25,8 @@
 struct scheduler* scheduler = NULL;
 struct sqldb *database = NULL;
 struct container* cache = NULL;
+struct sse* sse = NULL;
+struct blocking* blocking = NULL;
 /* Global handle to access server symbols */
 static void *dlhandle = NULL;
 
@@ -36,4 +40,6 @@ __attribute__((constructor)) void module_constructor() {
     LOAD_SYMBOL(dlhandle, "exposed_container", struct container, cache);
     LOAD_SYMBOL(dlhandle, "exposed_scheduler", struct scheduler, scheduler);
     LOAD_SYMBOL(dlhandle, "exposed_sqldb", struct sqldb, database);
+    LOAD_SYMBOL(dlhandle, "exposed_sse", struct sse, sse);
+    LOAD_SYMBOL(dlhandle, "exposed_blocking", struct blocking, blocking);
 }
\ No newline at end of file
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include <admission.h>
+#include <metrics.h>
+
+#define NS_PER_MS 1000000ULL
+
+static struct admission {
+    uint64_t target_ns;
+    uint64_t interval_ns;
+    atomic_ullong interval_start;
+    atomic_ullong interval_min;
+    atomic_int overloaded;
+} admission = {
+    .target_ns = 5 * NS_PER_MS,
+    .interval_ns = 100 * NS_PER_MS,
+    .interval_start = 0,
+    .interval_min = UINT64_MAX,
+    .overloaded = 0,
+};
+
+static struct metric *metric_overloaded;
+
+void admission_init(int target_ms, int interval_ms) {
+    if (target_ms > 0) admission.target_ns = target_ms * NS_PER_MS;
+    if (interval_ms > 0) admission.interval_ns = interval_ms * NS_PER_MS;
+
+    metric_overloaded = metric_get("admission_overloaded");
+}
+
+/* Called by every worker for every request, so no lock, only atomics */
+admission_t admission_check(uint64_t queue_delay_ns) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    /* At the end of each interval, overloaded if not even the fastest task met the target */
+    unsigned long long start = atomic_load(&admission.interval_start);
+    if (now - start >= admission.interval_ns
+        && atomic_compare_exchange_strong(&admission.interval_start, &start, now)) {
+        /* Only the worker that moved the interval on gets here */
+        unsigned long long min = atomic_exchange(&admission.interval_min, UINT64_MAX);
+        int overloaded = min != UINT64_MAX && min > admission.target_ns;
+        atomic_store(&admission.overloaded, overloaded);
+        metric_set(metric_overloaded, overloaded);
+    }
+
+    /* Only write when the minimum drops, so the cache line stays shared */
+    unsigned long long min = atomic_load(&admission.interval_min);
+    while (queue_delay_ns < min && !atomic_compare_exchange_weak(&admission.interval_min, &min, queue_delay_ns)) {
+    }
+
+    uint64_t limit = atomic_load(&admission.overloaded) ? admission.target_ns : admission.interval_ns;
+    return queue_delay_ns > limit ? ADMISSION_SHED : ADMISSION_ADMIT;
+}
@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <arena.h>
+
+static struct arena_block *arena_block_new(size_t size) {
+    struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+    if (block == NULL) {
+        perror("[ERROR] Failed to allocate arena block");
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    if (arena == NULL) return NULL;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    struct arena_block *block = arena->current;
+    if (block == NULL || block->used + size > block->size) {
+        /* Large allocations get a block of their own */
+        block = arena_block_new(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+        if (block == NULL) return NULL;
+
+        if (arena->current) {
+            arena->current->next = block;
+        } else {
+            arena->first = block;
+        }
+        arena->current = block;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t length) {
+    char *copy = arena_alloc(arena, length + 1);
+    if (copy == NULL) return NULL;
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+char *arena_strdup(struct arena *arena, const char *str) {
+    return arena_strndup(arena, str, strlen(str));
+}
+
+/* Free overflow blocks, the first one is kept so a typical request does not touch malloc */
+void arena_reset(struct arena *arena) {
+    if (arena->first == NULL) return;
+
+    /* Dont hold on to a large first allocation between requests */
+    if (arena->first->size > ARENA_BLOCK_SIZE) {
+        struct arena_block *first = arena->first;
+        arena->first = first->next;
+        free(first);
+        arena->current = arena->first;
+        arena_reset(arena);
+        return;
+    }
+
+    struct arena_block *block = arena->first->next;
+    while (block) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+}
+
+void arena_destroy(struct arena *arena) {
+    arena_reset(arena);
+    free(arena->first);
+    arena->first = NULL;
+    arena->current = NULL;
+}
@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <cache.h>
+#include <map.h>
+#include <response.h>
+#include <compress.h>
+#include <metrics.h>
+
+struct cache_header {
+    const char *name;
+    const char *value;
+};
+
+/**
+ * Stored response, immutable once it is in the table. The shard holds one
+ * reference and every response served from it another, so it can be
+ * evicted while a hit is still being sent.
+ */
+struct cache_entry {
+    uint64_t hash;
+    const char *key; /* path?query */
+    const void *owner;
+    time_t stored;   /* Monotonic seconds */
+    time_t expires;
+    struct cache_header vary[CACHE_VARY_MAX]; /* Request header values the response was made for */
+    int vary_count;
+    struct cache_header *headers;
+    int header_count;
+    const char *body;
+    size_t length;
+    size_t size;     /* Accounted against the cap */
+    int refs;
+    char referenced; /* Second chance for the clock hand */
+    struct cache_entry *next; /* Bucket chain */
+    struct cache_entry *clock_prev, *clock_next;
+    char data[];
+};
+
+/* Shards keep hits on different paths off each other's locks, each evicts on its own with a clock hand */
+static struct cache_shard {
+    pthread_rwlock_t lock;
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    struct cache_entry *hand;
+    size_t bytes;
+} shards[CACHE_SHARDS];
+
+static size_t cache_capacity = CACHE_SIZE / CACHE_SHARDS; /* Per shard */
+
+static struct metric *metric_hits;
+static struct metric *metric_misses;
+static struct metric *metric_evictions;
+static struct metric *metric_bytes;
+
+void cache_set_size(size_t size) {
+    cache_capacity = size / CACHE_SHARDS;
+}
+
+static time_t cache_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/* FNV-1a over path, '?' and query, the same bytes the stored key holds */
+static uint64_t cache_hash(const char *path, const char *query) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *p = path; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+    }
+    if (query) {
+        hash = (hash ^ '?') * 1099511628211ull;
+        for (const char *p = query; *p; p++) {
+            hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+static int cache_key_equal(const char *key, const char *path, const char *query) {
+    size_t length = strlen(path);
+    if (strncmp(key, path, length) != 0) {
+        return 0;
+    }
+    key += length;
+    if (query == NULL) {
+        return *key == '\0';
+    }
+    return *key == '?' && strcmp(key + 1, query) == 0;
+}
+
+/* Value a Vary header is matched on. Accept-Encoding only matters through the encoding it selects */
+static const char *cache_vary_value(const struct http_request *req, const char *name) {
+    if (strcasecmp(name, "Accept-Encoding") == 0) {
+        return compress_encodings[compress_negotiate(req)];
+    }
+    const char *value = http_get_header(req, name);
+    return value ? value : "";
+}
+
+static int cache_vary_match(const struct cache_entry *entry, const struct http_request *req) {
+    for (int i = 0; i < entry->vary_count; i++) {
+        if (strcmp(entry->vary[i].value, cache_vary_value(req, entry->vary[i].name)) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void cache_entry_release(void *arg) {
+    struct cache_entry *entry = arg;
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(entry);
+    }
+}
+
+/* Unlink from the bucket chain and the clock, caller holds the shard write lock */
+static void cache_remove(struct cache_shard *shard, struct cache_entry *entry) {
+    struct cache_entry **link = &shard->buckets[entry->hash % CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    if (entry->clock_next == entry) {
+        shard->hand = NULL;
+    } else {
+        entry->clock_prev->clock_next = entry->clock_next;
+        entry->clock_next->clock_prev = entry->clock_prev;
+        if (shard->hand == entry) {
+            shard->hand = entry->clock_next;
+        }
+    }
+
+    shard->bytes -= entry->size;
+    metric_add(metric_bytes, -(long)entry->size);
+    cache_entry_release(entry);
+}
+
+/* Free room for size bytes. Expired entries go first, recently hit ones get another round */
+static void cache_evict(struct cache_shard *shard, size_t size, time_t now) {
+    while (shard->hand && shard->bytes + size > cache_capacity) {
+        struct cache_entry *entry = shard->hand;
+        if (entry->referenced && entry->expires > now) {
+            entry->referenced = 0;
+            shard->hand = entry->clock_next;
+            continue;
+        }
+        cache_remove(shard, entry);
+        metric_add(metric_evictions, 1);
+    }
+}
+
+/* Shared caches must not answer these from a stored response */
+static int cache_request_allowed(const struct http_request *req) {
+    if ((req->method != HTTP_GET && req->method != HTTP_HEAD) || http_header(req, HTTP_HEADER_AUTHORIZATION)) {
+        return 0;
+    }
+    const char *cache_control = http_header(req, HTTP_HEADER_CACHE_CONTROL);
+    return cache_control == NULL || (!strstr(cache_control, "no-cache") && !strstr(cache_control, "no-store"));
+}
+
+int cache_serve(struct http_request *req, struct http_response *res) {
+    if (cache_capacity == 0 || !cache_request_allowed(req)) {
+        return CACHE_MISS;
+    }
+
+    uint64_t hash = cache_hash(req->path, req->query);
+    struct cache_shard *shard = &shards[hash % CACHE_SHARDS];
+    time_t now = cache_now();
+    struct cache_entry *found = NULL;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    for (struct cache_entry *entry = shard->buckets[hash % CACHE_BUCKETS]; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->expires > now && cache_key_equal(entry->key, req->path, req->query)
+                && cache_vary_match(entry, req)) {
+            __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+            found = entry;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (found == NULL) {
+        metric_add(metric_misses, 1);
+        return CACHE_MISS;
+    }
+    metric_add(metric_hits, 1);
+
+    /* Header values stay in the entry, which lives until the response is done */
+    res->status = HTTP_200_OK;
+    const char *if_none_match = http_header(req, HTTP_HEADER_IF_NONE_MATCH);
+    for (int i = 0; i < found->header_count; i++) {
+        map_insert(res->headers, found->headers[i].name, (char *)found->headers[i].value);
+        if (if_none_match && strcasecmp(found->headers[i].name, "ETag") == 0 && http_etag_match(if_none_match, found->headers[i].value)) {
+            res->status = HTTP_304_NOT_MODIFIED;
+        }
+    }
+    char *age = arena_alloc(req->arena, 24);
+    if (age) {
+        snprintf(age, 24, "%ld", (long)(now - found->stored));
+        map_insert(res->headers, "Age", age);
+    }
+
+    res->file.data = found->body;
+    res->file.offset = 0;
+    res->file.length = res->status == HTTP_304_NOT_MODIFIED ? 0 : found->length;
+    res->file.release = cache_entry_release;
+    res->file.arg = found;
+    return CACHE_HIT;
+}
+
+/* Seconds a response may be kept, 0 if it may not */
+static long cache_ttl(const struct http_response *res, int opt_in) {
+    const char *cache_control = map_get(res->headers, "Cache-Control");
+    if (cache_control == NULL) {
+        return opt_in ? CACHE_DEFAULT_TTL : 0;
+    }
+    if (strstr(cache_control, "no-store") || strstr(cache_control, "no-cache") || strstr(cache_control, "private")) {
+        return 0;
+    }
+
+    /* s-maxage is meant for shared caches like this one */
+    const char *max_age = strstr(cache_control, "s-maxage=");
+    if (max_age) {
+        return strtol(max_age + 9, NULL, 10);
+    }
+    max_age = strstr(cache_control, "max-age=");
+    if (max_age) {
+        return strtol(max_age + 8, NULL, 10);
+    }
+    return opt_in ? CACHE_DEFAULT_TTL : 0;
+}
+
+/* Headers that belong to a single response, not to what is stored */
+static int cache_header_skipped(const char *name) {
+    return strcasecmp(name, "Connection") == 0 || strcasecmp(name, "Date") == 0 || strcasecmp(name, "Age") == 0
+        || strcasecmp(name, "Content-Length") == 0 || strcasecmp(name, "Transfer-Encoding") == 0;
+}
+
+/* Split a Vary value into entry->vary, -1 for Vary: * or too many names */
+static int cache_parse_vary(struct cache_header *vary, char *names, const struct http_request *req) {
+    int count = 0;
+    for (char *save = NULL, *name = strtok_r(names, ", ", &save); name; name = strtok_r(NULL, ", ", &save)) {
+        if (strcmp(name, "*") == 0 || count == CACHE_VARY_MAX) {
+            return -1;
+        }
+        vary[count].name = name;
+        vary[count].value = cache_vary_value(req, name);
+        count++;
+    }
+    return count;
+}
+
+static char *cache_copy(char **cursor, const char *data, size_t length) {
+    char *copy = *cursor;
+    memcpy(copy, data, length);
+    copy[length] = '\0';
+    *cursor += length + 1;
+    return copy;
+}
+
+void cache_store(struct http_request *req, struct http_response *res, int opt_in, const void *owner) {
+    if (cache_capacity == 0 || req->method != HTTP_GET || http_header(req, HTTP_HEADER_AUTHORIZATION)
+            || res->status != HTTP_200_OK || res->flags & (HTTP_RESPONSE_HEADERS_SENT | HTTP_RESPONSE_CANNED)
+            || res->file.fd >= 0 || res->file.data || map_get(res->headers, "Set-Cookie")) {
+        return;
+    }
+
+    long ttl = cache_ttl(res, opt_in);
+    size_t length = http_response_body_length(res);
+    if (ttl <= 0 || length > CACHE_ENTRY_MAX) {
+        return;
+    }
+
+    struct cache_header vary[CACHE_VARY_MAX];
+    int vary_count = 0;
+    char vary_names[256] = "";
+    const char *vary_header = map_get(res->headers, "Vary");
+    if (vary_header) {
+        snprintf(vary_names, sizeof(vary_names), "%s", vary_header);
+        vary_count = cache_parse_vary(vary, vary_names, req);
+        if (vary_count < 0) {
+            return;
+        }
+    }
+
+    /* One allocation: entry, header table, then key, vary and header strings and the body */
+    size_t header_count = 0;
+    size_t size = sizeof(struct cache_entry) + strlen(req->path) + 1 + (req->query ? strlen(req->query) + 1 : 0) + length + 1;
+    for (size_t i = 0; i < map_size(res->headers); i++) {
+        const char *name = res->headers->entries[i].key;
+        if (!cache_header_skipped(name)) {
+            size += sizeof(struct cache_header) + strlen(name) + strlen(res->headers->entries[i].value) + 2;
+            header_count++;
+        }
+    }
+    for (int i = 0; i < vary_count; i++) {
+        size += strlen(vary[i].name) + strlen(vary[i].value) + 2;
+    }
+    if (size > cache_capacity) {
+        return;
+    }
+
+    struct cache_entry *entry = malloc(size);
+    if (entry == NULL) {
+        return;
+    }
+    time_t now = cache_now();
+    *entry = (struct cache_entry){
+        .hash = cache_hash(req->path, req->query),
+        .owner = owner,
+        .stored = now,
+        .expires = now + ttl,
+        .vary_count = vary_count,
+        .headers = (struct cache_header *)entry->data,
+        .header_count = header_count,
+        .length = length,
+        .size = size,
+        .refs = 1,
+    };
+
+    char *cursor = entry->data + header_count * sizeof(struct cache_header);
+    entry->key = cursor;
+    cursor = stpcpy(cursor, req->path);
+    if (req->query) {
+        *cursor++ = '?';
+        cursor = stpcpy(cursor, req->query);
+    }
+    cursor++;
+
+    for (int i = 0; i < vary_count; i++) {
+        entry->vary[i].name = cache_copy(&cursor, vary[i].name, strlen(vary[i].name));
+        entry->vary[i].value = cache_copy(&cursor, vary[i].value, strlen(vary[i].value));
+    }
+    for (size_t i = 0, j = 0; i < map_size(res->headers); i++) {
+        const char *name = res->headers->entries[i].key;
+        const char *value = res->headers->entries[i].value;
+        if (!cache_header_skipped(name)) {
+            entry->headers[j].name = cache_copy(&cursor, name, strlen(name));
+            entry->headers[j].value = cache_copy(&cursor, value, strlen(value));
+            j++;
+        }
+    }
+    entry->body = cache_copy(&cursor, res->body, length);
+
+    struct cache_shard *shard = &shards[entry->hash % CACHE_SHARDS];
+    pthread_rwlock_wrlock(&shard->lock);
+
+    /* Replace what was stored for the same request */
+    for (struct cache_entry *old = shard->buckets[entry->hash % CACHE_BUCKETS]; old; old = old->next) {
+        if (old->hash == entry->hash && strcmp(old->key, entry->key) == 0 && cache_vary_match(old, req)) {
+            cache_remove(shard, old);
+            break;
+        }
+    }
+    cache_evict(shard, size, now);
+
+    entry->next = shard->buckets[entry->hash % CACHE_BUCKETS];
+    shard->buckets[entry->hash % CACHE_BUCKETS] = entry;
+
+    /* New entries go behind the hand, they are looked at last */
+    if (shard->hand == NULL) {
+        entry->clock_prev = entry->clock_next = entry;
+        shard->hand = entry;
+    } else {
+        entry->clock_next = shard->hand;
+        entry->clock_prev = shard->hand->clock_prev;
+        entry->clock_prev->clock_next = entry;
+        shard->hand->clock_prev = entry;
+    }
+    shard->bytes += size;
+    metric_add(metric_bytes, size);
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+void cache_invalidate(const void *owner) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &shards[i];
+        pthread_rwlock_wrlock(&shard->lock);
+        for (int j = 0; j < CACHE_BUCKETS; j++) {
+            struct cache_entry *entry = shard->buckets[j];
+            while (entry) {
+                struct cache_entry *next = entry->next;
+                if (entry->owner == owner) {
+                    cache_remove(shard, entry);
+                }
+                entry = next;
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+__attribute__((constructor)) static void cache_init(void) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_init(&shards[i].lock, NULL);
+    }
+    metric_hits = metric_get("cache_hits_total");
+    metric_misses = metric_get("cache_misses_total");
+    metric_evictions = metric_get("cache_evictions_total");
+    metric_bytes = metric_get("cache_bytes");
+}
+
+__attribute__((destructor)) static void cache_destroy(void) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        while (shards[i].hand) {
+            cache_remove(&shards[i], shards[i].hand);
+        }
+        pthread_rwlock_destroy(&shards[i].lock);
+    }
+}
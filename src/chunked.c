@@ -0,0 +1,88 @@
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include <chunked.h>
+
+/* End of the line starting at p, -1 if it is too long, 0 if it has not arrived yet */
+static int chunked_line(const char *p, const char *end, const char **eol) {
+    *eol = memchr(p, '\n', end - p);
+    if (*eol == NULL) {
+        return end - p > CHUNKED_LINE_MAX ? -1 : 0;
+    }
+    return *eol - p > CHUNKED_LINE_MAX ? -1 : 1;
+}
+
+/* Hex size up to the extensions, -1 if it is missing, malformed or does not fit */
+static int chunked_size(const char *p, size_t *size) {
+    const char *digit = p;
+    *size = 0;
+    for (; isxdigit((unsigned char)*digit); digit++) {
+        if (*size > (SIZE_MAX >> 4)) {
+            return -1;
+        }
+        *size = *size * 16 + (isdigit((unsigned char)*digit) ? *digit - '0' : (tolower((unsigned char)*digit) - 'a' + 10));
+    }
+    return digit == p || (*digit != ';' && *digit != '\r' && *digit != '\n') ? -1 : 0;
+}
+
+int chunked_decode(struct chunked_decoder *decoder, const char *in, size_t length, size_t *consumed, char *out, size_t *decoded) {
+    const char *p = in;
+    const char *end = in + length;
+    const char *eol;
+    *decoded = 0;
+
+    while (p < end && decoder->state < CHUNK_DONE) {
+        /* Only CRLF may follow the data, no need to wait for the line to tell */
+        if (decoder->state == CHUNK_DATA_END && *p != '\r' && *p != '\n') {
+            decoder->state = CHUNK_ERROR;
+            break;
+        }
+
+        int line = decoder->state == CHUNK_DATA ? 1 : chunked_line(p, end, &eol);
+        if (line <= 0) {
+            decoder->state = line < 0 ? CHUNK_ERROR : decoder->state;
+            break;
+        }
+
+        switch (decoder->state) {
+            case CHUNK_SIZE:
+                if (chunked_size(p, &decoder->remaining) != 0) {
+                    decoder->state = CHUNK_ERROR;
+                    break;
+                }
+                decoder->state = decoder->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                p = eol + 1;
+                break;
+            case CHUNK_DATA: {
+                size_t data = (size_t)(end - p) < decoder->remaining ? (size_t)(end - p) : decoder->remaining;
+                memmove(out + *decoded, p, data);
+                *decoded += data;
+                decoder->remaining -= data;
+                p += data;
+                if (decoder->remaining == 0) {
+                    decoder->state = CHUNK_DATA_END;
+                }
+                break;
+            }
+            case CHUNK_DATA_END:
+                if (eol != p && !(eol == p + 1 && *p == '\r')) {
+                    decoder->state = CHUNK_ERROR;
+                    break;
+                }
+                decoder->state = CHUNK_SIZE;
+                p = eol + 1;
+                break;
+            case CHUNK_TRAILER:
+                /* Trailer fields are skipped, an empty line ends the body */
+                if (eol == p || (eol == p + 1 && *p == '\r')) {
+                    decoder->state = CHUNK_DONE;
+                }
+                p = eol + 1;
+                break;
+        }
+    }
+
+    *consumed = p - in;
+    return decoder->state == CHUNK_ERROR ? -1 : decoder->state == CHUNK_DONE;
+}
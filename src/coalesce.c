@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <coalesce.h>
+#include <map.h>
+#include <response.h>
+#include <metrics.h>
+
+/* Header fields that can change what a handler answers, part of the key */
+static const http_header_id_t coalesce_headers[] = {
+    HTTP_HEADER_ACCEPT,
+    HTTP_HEADER_AUTHORIZATION,
+    HTTP_HEADER_COOKIE,
+};
+
+/**
+ * Handler execution shared by identical requests. The leader runs the handler
+ * and copies its response in, followers copy it out. Whoever drops the last
+ * reference frees it.
+ */
+struct coalesce_flight {
+    uint64_t hash;
+    char *key;
+    pthread_cond_t done;
+    int finished;
+    int shared;        /* Response below is valid, 0 if the leader streamed it */
+    int refs;          /* Leader and waiting followers, under the shard lock */
+    http_error_t status;
+    char **headers;    /* name, value pairs */
+    size_t header_count;
+    char *body;
+    size_t length;
+    struct coalesce_flight *next;
+};
+
+static struct coalesce_shard {
+    pthread_mutex_t lock;
+    struct coalesce_flight *buckets[COALESCE_BUCKETS];
+} shards[COALESCE_SHARDS];
+
+static int coalesce_timeout = COALESCE_TIMEOUT;
+
+static struct metric *metric_coalesced;
+static struct metric *metric_timeouts;
+
+void coalesce_set_timeout(int ms) {
+    coalesce_timeout = ms < 0 ? 0 : ms;
+}
+
+/* Method, path, query and the key headers, one per line */
+static char *coalesce_key(struct http_request *req, uint64_t *hash) {
+    const char *parts[3 + sizeof(coalesce_headers) / sizeof(coalesce_headers[0])];
+    size_t count = 0;
+    parts[count++] = http_methods[req->method];
+    parts[count++] = req->path;
+    parts[count++] = req->query ? req->query : "";
+    for (size_t i = 0; i < sizeof(coalesce_headers) / sizeof(coalesce_headers[0]); i++) {
+        const char *value = http_header(req, coalesce_headers[i]);
+        parts[count++] = value ? value : "";
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += strlen(parts[i]) + 1;
+    }
+    char *key = malloc(size);
+    if (key == NULL) {
+        return NULL;
+    }
+
+    char *cursor = key;
+    for (size_t i = 0; i < count; i++) {
+        cursor = stpcpy(cursor, parts[i]);
+        *cursor++ = '\n';
+    }
+    cursor[-1] = '\0';
+
+    /* FNV-1a */
+    *hash = 14695981039346656037ull;
+    for (const char *p = key; *p; p++) {
+        *hash = (*hash ^ (unsigned char)*p) * 1099511628211ull;
+    }
+    return key;
+}
+
+static void coalesce_free(struct coalesce_flight *flight) {
+    for (size_t i = 0; i < flight->header_count * 2; i++) {
+        free(flight->headers[i]);
+    }
+    free(flight->headers);
+    free(flight->body);
+    free(flight->key);
+    pthread_cond_destroy(&flight->done);
+    free(flight);
+}
+
+/* Drop a reference, caller holds the shard lock */
+static void coalesce_put(struct coalesce_flight *flight) {
+    if (--flight->refs == 0) {
+        coalesce_free(flight);
+    }
+}
+
+/* Responses meant for one client only, e.g. a new session cookie */
+static int coalesce_private(const struct http_response *res) {
+    const char *cache_control = map_get(res->headers, "Cache-Control");
+    return map_get(res->headers, "Set-Cookie")
+        || (cache_control && (strstr(cache_control, "private") || strstr(cache_control, "no-store")));
+}
+
+/* Snapshot the leader's response, streamed or file responses are already on the leader's socket and deferred ones do not exist yet */
+static int coalesce_copy_in(struct coalesce_flight *flight, struct http_response *res) {
+    if (res->flags & (HTTP_RESPONSE_HEADERS_SENT | HTTP_RESPONSE_CANNED) || res->file.fd >= 0 || res->file.data || res->deferred
+            || coalesce_private(res)) {
+        return -1;
+    }
+
+    size_t count = map_size(res->headers);
+    flight->headers = calloc(count * 2 + 1, sizeof(char *));
+    flight->length = http_response_body_length(res);
+    flight->body = malloc(flight->length + 1);
+    if (flight->headers == NULL || flight->body == NULL) {
+        return -1;
+    }
+    memcpy(flight->body, res->body, flight->length);
+
+    for (size_t i = 0; i < count; i++) {
+        flight->headers[i * 2] = strdup(res->headers->entries[i].key);
+        flight->headers[i * 2 + 1] = strdup(res->headers->entries[i].value);
+        flight->header_count++;
+        if (flight->headers[i * 2] == NULL || flight->headers[i * 2 + 1] == NULL) {
+            return -1;
+        }
+    }
+    flight->status = res->status;
+    return 0;
+}
+
+/* Give a follower its own copy, header strings go to its arena since the flight is freed first */
+static int coalesce_copy_out(struct coalesce_flight *flight, struct http_response *res) {
+    for (size_t i = 0; i < flight->header_count; i++) {
+        char *value = arena_strdup(res->arena, flight->headers[i * 2 + 1]);
+        if (value == NULL) {
+            return -1;
+        }
+        map_insert(res->headers, flight->headers[i * 2], value);
+    }
+    res->status = flight->status;
+    return http_write(res, flight->body, flight->length);
+}
+
+static void coalesce_deadline(struct http_request *req, struct timespec *until) {
+    long wait = coalesce_timeout;
+    long remaining = http_remaining_ms(req);
+    if (remaining != DEADLINE_NONE && remaining < wait) {
+        wait = remaining;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, until);
+    until->tv_sec += wait / 1000;
+    until->tv_nsec += (wait % 1000) * 1000000L;
+    if (until->tv_nsec >= 1000000000L) {
+        until->tv_sec++;
+        until->tv_nsec -= 1000000000L;
+    }
+}
+
+void coalesce_execute(handler_t handler, struct http_request *req, struct http_response *res) {
+    /* Bodies make requests different even with the same key */
+    uint64_t hash;
+    char *key = req->content_length != 0 ? NULL : coalesce_key(req, &hash);
+    if (key == NULL) {
+        safe_execute_handler(handler, req, res);
+        return;
+    }
+
+    struct coalesce_shard *shard = &shards[hash % COALESCE_SHARDS];
+    struct coalesce_flight **bucket = &shard->buckets[(hash / COALESCE_SHARDS) % COALESCE_BUCKETS];
+
+    pthread_mutex_lock(&shard->lock);
+    struct coalesce_flight *flight = *bucket;
+    while (flight && (flight->hash != hash || strcmp(flight->key, key) != 0)) {
+        flight = flight->next;
+    }
+
+    if (flight) {
+        /* Follower, wait for the leader */
+        free(key);
+        flight->refs++;
+        struct timespec until;
+        coalesce_deadline(req, &until);
+        int ret = 0;
+        while (!flight->finished && ret != ETIMEDOUT) {
+            ret = pthread_cond_timedwait(&flight->done, &shard->lock, &until);
+        }
+        int finished = flight->finished;
+        int shared = finished && flight->shared && coalesce_copy_out(flight, res) == 0;
+        coalesce_put(flight);
+        pthread_mutex_unlock(&shard->lock);
+
+        if (shared) {
+            metric_add(metric_coalesced, 1);
+            return;
+        }
+        if (!finished) {
+            metric_add(metric_timeouts, 1);
+        }
+        safe_execute_handler(handler, req, res);
+        return;
+    }
+
+    /* Leader, later requests with the same key wait on this flight */
+    flight = calloc(1, sizeof(struct coalesce_flight));
+    if (flight == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        free(key);
+        safe_execute_handler(handler, req, res);
+        return;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flight->done, &attr);
+    pthread_condattr_destroy(&attr);
+    flight->hash = hash;
+    flight->key = key;
+    flight->refs = 1;
+    flight->next = *bucket;
+    *bucket = flight;
+    pthread_mutex_unlock(&shard->lock);
+
+    safe_execute_handler(handler, req, res);
+
+    /* Copy outside the lock, followers only look at it once finished is set */
+    int shared = coalesce_copy_in(flight, res) == 0;
+
+    pthread_mutex_lock(&shard->lock);
+    struct coalesce_flight **link = bucket;
+    while (*link != flight) {
+        link = &(*link)->next;
+    }
+    *link = flight->next;
+    flight->shared = shared;
+    flight->finished = 1;
+    pthread_cond_broadcast(&flight->done);
+    coalesce_put(flight);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+__attribute__((constructor)) static void coalesce_init(void) {
+    for (int i = 0; i < COALESCE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+    metric_coalesced = metric_get("coalesced_requests_total");
+    metric_timeouts = metric_get("coalesce_timeouts_total");
+}
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include <compress.h>
+#include <response.h>
+#include <metrics.h>
+#include <map.h>
+
+const char *compress_encodings[] = {"identity", "deflate", "gzip", "br"};
+
+static int compress_level = COMPRESS_LEVEL;
+
+/* Types worth compressing, images and archives already are */
+static const char *compress_types[] = {
+    "text/",
+    "application/json",
+    "application/javascript",
+    "application/xml",
+    "image/svg+xml",
+};
+
+/* Compressed variants of cacheable responses, keyed by a hash of the uncompressed body */
+static struct compress_cache_entry {
+    uint64_t hash;
+    size_t length;
+    compress_encoding_t encoding;
+    char *data;
+    size_t compressed;
+} compress_cache[COMPRESS_CACHE_ENTRIES];
+static pthread_mutex_t compress_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void compress_set_level(int level) {
+    compress_level = level < 1 ? 1 : level > 9 ? 9 : level;
+}
+
+int compress_content_type_allowed(const char *content_type) {
+    if (content_type == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(compress_types) / sizeof(compress_types[0]); i++) {
+        if (strncasecmp(content_type, compress_types[i], strlen(compress_types[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* q-value of a coding in Accept-Encoding, -1 if not listed */
+static double compress_accepts(const char *accept, const char *coding) {
+    size_t coding_length = strlen(coding);
+    double wildcard = -1;
+
+    for (const char *p = accept; *p; ) {
+        while (*p == ' ' || *p == ',') p++;
+        const char *name = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ') p++;
+        size_t name_length = p - name;
+
+        double q = 1;
+        while (*p && *p != ',') {
+            if (strncmp(p, "q=", 2) == 0) {
+                q = strtod(p + 2, NULL);
+            }
+            p++;
+        }
+
+        if (name_length == coding_length && strncasecmp(name, coding, coding_length) == 0) {
+            return q;
+        }
+        if (name_length == 1 && *name == '*') {
+            wildcard = q;
+        }
+    }
+    return wildcard;
+}
+
+compress_encoding_t compress_negotiate(const struct http_request *req) {
+    const char *accept = http_header(req, HTTP_HEADER_ACCEPT_ENCODING);
+    if (accept == NULL) {
+        return COMPRESS_IDENTITY;
+    }
+
+    /* Highest q wins, ties go to the better compressor */
+    compress_encoding_t best = COMPRESS_IDENTITY;
+    double best_q = 0;
+    for (int encoding = COMPRESS_BROTLI; encoding > COMPRESS_IDENTITY; encoding--) {
+#ifndef HAVE_BROTLI
+        if (encoding == COMPRESS_BROTLI) continue;
+#endif
+        double q = compress_accepts(accept, compress_encodings[encoding]);
+        if (q > best_q) {
+            best = encoding;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+static size_t compress_zlib(int window_bits, int level, const void *in, size_t length, char *out, size_t capacity) {
+    z_stream stream = {0};
+    if (deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+
+    stream.next_in = (Bytef *)in;
+    stream.avail_in = length;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = capacity;
+    int ret = deflate(&stream, Z_FINISH);
+    size_t written = stream.total_out;
+    deflateEnd(&stream);
+    return ret == Z_STREAM_END ? written : 0;
+}
+
+size_t compress_buffer(compress_encoding_t encoding, int cached, const void *in, size_t length, char **out) {
+    /* Kept variants are compressed once, so they get the best ratio */
+    size_t capacity = compressBound(length) + 32;
+    *out = malloc(capacity);
+    if (*out == NULL) {
+        return 0;
+    }
+
+    size_t written = 0;
+    switch (encoding) {
+        case COMPRESS_DEFLATE:
+            written = compress_zlib(15, cached ? 9 : compress_level, in, length, *out, capacity);
+            break;
+        case COMPRESS_GZIP:
+            written = compress_zlib(15 + 16, cached ? 9 : compress_level, in, length, *out, capacity);
+            break;
+#ifdef HAVE_BROTLI
+        case COMPRESS_BROTLI: {
+            size_t brotli_length = capacity;
+            /* Top quality is slow enough to matter on large files even once */
+            int quality = cached ? (length > 1024*1024 ? 9 : BROTLI_MAX_QUALITY) : compress_level;
+            if (BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC,
+                    length, in, &brotli_length, (uint8_t *)*out)) {
+                written = brotli_length;
+            }
+            break;
+        }
+#endif
+        default:
+            break;
+    }
+
+    if (written == 0 || written >= length) {
+        free(*out);
+        *out = NULL;
+        return 0;
+    }
+    return written;
+}
+
+/* FNV-1a, only has to tell bodies of a cacheable response apart */
+static uint64_t compress_hash(const char *data, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/* Per thread, so the metrics of a route are only looked up by name once per worker */
+static __thread struct compress_route_metrics {
+    char route[COMPRESS_ROUTE_LABEL + 1];
+    struct metric *in;
+    struct metric *out;
+    struct metric *cpu_us;
+} compress_route_metrics[COMPRESS_ROUTE_SLOTS];
+
+static struct compress_route_metrics *compress_route_metrics_get(const char *route) {
+    size_t length = strnlen(route, COMPRESS_ROUTE_LABEL);
+    struct compress_route_metrics *slot = &compress_route_metrics[compress_hash(route, length) % COMPRESS_ROUTE_SLOTS];
+    if (slot->in && strncmp(slot->route, route, length) == 0 && slot->route[length] == '\0') {
+        return slot;
+    }
+
+    char name[METRIC_NAME_MAX];
+    snprintf(slot->route, sizeof(slot->route), "%.*s", (int)length, route);
+    snprintf(name, sizeof(name), "compress_in_bytes{route=\"%s\"}", slot->route);
+    slot->in = metric_get(name);
+    snprintf(name, sizeof(name), "compress_out_bytes{route=\"%s\"}", slot->route);
+    slot->out = metric_get(name);
+    snprintf(name, sizeof(name), "compress_cpu_us{route=\"%s\"}", slot->route);
+    slot->cpu_us = metric_get(name);
+    return slot;
+}
+
+void compress_account(const char *route, size_t in, size_t out, const struct timespec *cpu_start) {
+    struct timespec end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    long cpu_us = (end.tv_sec - cpu_start->tv_sec) * 1000000L + (end.tv_nsec - cpu_start->tv_nsec) / 1000;
+
+    struct compress_route_metrics *metrics = compress_route_metrics_get(route);
+    metric_add(metrics->in, in);
+    metric_add(metrics->out, out);
+    metric_add(metrics->cpu_us, cpu_us);
+}
+
+static int compress_cacheable(const struct http_response *res) {
+    const char *cache_control = map_get(res->headers, "Cache-Control");
+    return cache_control && !strstr(cache_control, "no-store") && !strstr(cache_control, "private")
+        && (strstr(cache_control, "public") || strstr(cache_control, "max-age"));
+}
+
+/* Copy a kept variant into the arena with room for a terminator, as on a miss. 0 on a miss */
+static size_t compress_cache_get(struct arena *arena, uint64_t hash, size_t length, compress_encoding_t encoding, char **out) {
+    struct compress_cache_entry *entry = &compress_cache[(hash ^ encoding) % COMPRESS_CACHE_ENTRIES];
+    size_t compressed = 0;
+
+    pthread_mutex_lock(&compress_cache_lock);
+    if (entry->data && entry->hash == hash && entry->length == length && entry->encoding == encoding) {
+        *out = arena_alloc(arena, entry->compressed + 1);
+        if (*out) {
+            memcpy(*out, entry->data, entry->compressed);
+            compressed = entry->compressed;
+        }
+    }
+    pthread_mutex_unlock(&compress_cache_lock);
+    return compressed;
+}
+
+/* Keep a variant, it replaces whatever shared its slot */
+static void compress_cache_put(uint64_t hash, size_t length, compress_encoding_t encoding, const char *data, size_t compressed) {
+    if (compressed > COMPRESS_CACHE_ENTRY_MAX) {
+        return;
+    }
+    char *copy = malloc(compressed);
+    if (copy == NULL) {
+        return;
+    }
+    memcpy(copy, data, compressed);
+
+    struct compress_cache_entry *entry = &compress_cache[(hash ^ encoding) % COMPRESS_CACHE_ENTRIES];
+    pthread_mutex_lock(&compress_cache_lock);
+    char *old = entry->data;
+    *entry = (struct compress_cache_entry){ hash, length, encoding, copy, compressed };
+    pthread_mutex_unlock(&compress_cache_lock);
+    free(old);
+}
+
+void compress_response(struct http_request *req, struct http_response *res, const char *route) {
+    if (res->status != HTTP_200_OK || res->flags & (HTTP_RESPONSE_HEADERS_SENT | HTTP_RESPONSE_CANNED) || res->file.fd >= 0 || res->file.data) {
+        return;
+    }
+
+    const char *content_type = map_get(res->headers, "Content-Type");
+    if (!compress_content_type_allowed(content_type) || map_get(res->headers, "Content-Encoding")) {
+        return;
+    }
+
+    /* Caches must not hand a compressed body to a client that cannot read it */
+    http_response_vary(res, "Accept-Encoding");
+
+    size_t length = http_response_body_length(res);
+    compress_encoding_t encoding = compress_negotiate(req);
+    if (length < COMPRESS_MIN_SIZE || length > COMPRESS_MAX_SIZE || encoding == COMPRESS_IDENTITY) {
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+    int cacheable = compress_cacheable(res);
+    uint64_t hash = cacheable ? compress_hash(res->body, length) : 0;
+    char *out = NULL;
+    size_t compressed = cacheable ? compress_cache_get(res->arena, hash, length, encoding, &out) : 0;
+
+    if (compressed == 0) {
+        char *buffer;
+        compressed = compress_buffer(encoding, cacheable, res->body, length, &buffer);
+        if (compressed == 0) {
+            return;
+        }
+        if (cacheable) {
+            compress_cache_put(hash, length, encoding, buffer, compressed);
+        }
+        out = arena_alloc(res->arena, compressed + 1);
+        if (out) {
+            memcpy(out, buffer, compressed);
+        }
+        free(buffer);
+        if (out == NULL) {
+            return;
+        }
+    }
+
+    res->body = out;
+    res->length = compressed;
+    res->capacity = compressed + 1;
+    map_insert(res->headers, "Content-Encoding", (char *)compress_encodings[encoding]);
+
+    /* The entity tag was for the identity body, the compressed one only matches it weakly */
+    const char *etag = map_get(res->headers, "ETag");
+    if (etag && strncmp(etag, "W/", 2) != 0) {
+        char *weak = arena_alloc(res->arena, strlen(etag) + 3);
+        if (weak) {
+            sprintf(weak, "W/%s", etag);
+            map_remove(res->headers, "ETag");
+            map_insert(res->headers, "ETag", weak);
+        }
+    }
+    compress_account(route, length, compressed, &start);
+}
+
+__attribute__((destructor)) static void compress_destroy(void) {
+    for (int i = 0; i < COMPRESS_CACHE_ENTRIES; i++) {
+        free(compress_cache[i].data);
+    }
+}
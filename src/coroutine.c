@@ -0,0 +1,540 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include <coroutine.h>
+#include <http.h>
+#include <router.h>
+#include <pool.h>
+#include <deadline.h>
+#include <libevent.h>
+#include <metrics.h>
+
+typedef enum {
+    PARK_TIMER,    /* Until park.until */
+    PARK_FD,       /* Until park.fd is ready for park.events */
+    PARK_OFFLOAD,  /* Until an offload thread ran park.fn */
+} park_t;
+
+/**
+ * Handler running on its own stack. It only ever runs on one worker at a time,
+ * a worker switches to it and back, then does what it asked for while parked.
+ */
+struct coroutine {
+    ucontext_t context;
+    char *stack;           /* Guard page, then the stack */
+    handler_t handler;
+    struct http_deferred *deferred;
+    int finished;
+
+    /* Thread state of the handler, moved along when it changes workers */
+    const struct timespec *deadline;
+    sigjmp_buf *jump;
+
+    struct {
+        park_t kind;
+        struct timespec until;
+        int fd;
+        short events;
+        int failed;        /* Could not wait, the call blocks instead */
+        void (*fn)(void *);
+        void *arg;
+    } park;
+
+    struct coroutine *next; /* Free list, timer list or offload queue */
+};
+
+static int blocking_sleep(long ms);
+static ssize_t blocking_read(int fd, void *buffer, size_t length);
+static ssize_t blocking_write(int fd, const void *buffer, size_t length);
+static int blocking_connect(int fd, const struct sockaddr *address, socklen_t length);
+
+static struct blocking internal_blocking = {
+    .sleep = blocking_sleep,
+    .read = blocking_read,
+    .write = blocking_write,
+    .connect = blocking_connect,
+};
+__attribute__((visibility("default"))) struct blocking* exposed_blocking = &internal_blocking;
+
+static struct thread_pool *coroutine_pool = NULL;
+static size_t stack_size = COROUTINE_STACK_SIZE;
+static size_t page_size = 4096;
+static int limit = COROUTINE_MAX;
+
+/* Stacks are kept for reuse, allocated counts those handed out and those on the free list */
+static pthread_mutex_t stacks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct coroutine *free_list = NULL;
+static int allocated = 0;
+
+/* Sleeping coroutines, soonest first */
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static struct coroutine *timers = NULL;
+
+static pthread_mutex_t offload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t offload_cond = PTHREAD_COND_INITIALIZER;
+static struct coroutine *offload_head = NULL;
+static struct coroutine *offload_tail = NULL;
+
+/**
+ * Per worker. Code running on a coroutine may continue on another thread after
+ * a switch, so it reaches these only through the noinline accessors below and
+ * never keeps their addresses across a switch.
+ */
+static __thread ucontext_t worker_context;
+static __thread struct coroutine *current = NULL;
+static pthread_key_t altstack_key;
+
+static struct metric *metric_active;
+static struct metric *metric_parks;
+static struct metric *metric_fallback;
+
+void coroutine_set_stack_size(size_t size) {
+    stack_size = size < 16*1024 ? 16*1024 : size;
+}
+
+void coroutine_set_limit(int n) {
+    limit = n < 0 ? 0 : n;
+}
+
+__attribute__((noinline)) static struct coroutine *coroutine_self(void) {
+    return current;
+}
+
+__attribute__((noinline)) static ucontext_t *coroutine_worker_context(void) {
+    return &worker_context;
+}
+
+/* Errno of the thread the caller is on now, not of the one it started on */
+__attribute__((noinline)) static int coroutine_errno(void) {
+    return errno;
+}
+
+__attribute__((noinline)) static void coroutine_set_errno(int error) {
+    errno = error;
+}
+
+/* Back to the worker that resumed co, returns once co is resumed again */
+static void coroutine_yield(struct coroutine *co) {
+    swapcontext(&co->context, coroutine_worker_context());
+}
+
+static void coroutine_entry(void) {
+    struct coroutine *co = coroutine_self();
+    safe_execute_handler(co->handler, &co->deferred->req, &co->deferred->res);
+    co->finished = 1;
+    coroutine_yield(co);
+}
+
+static struct coroutine *coroutine_get(void) {
+    pthread_mutex_lock(&stacks_lock);
+    struct coroutine *co = free_list;
+    if (co) {
+        free_list = co->next;
+    } else if (allocated < limit) {
+        allocated++;
+    } else {
+        pthread_mutex_unlock(&stacks_lock);
+        return NULL;
+    }
+    pthread_mutex_unlock(&stacks_lock);
+    if (co) {
+        return co;
+    }
+
+    /* The lowest page stays inaccessible, running into it faults instead of overwriting the heap */
+    co = calloc(1, sizeof(struct coroutine));
+    void *stack = co ? mmap(NULL, stack_size + page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0) : MAP_FAILED;
+    if (stack == MAP_FAILED || mprotect(stack, page_size, PROT_NONE) != 0) {
+        perror("[ERROR] Error allocating coroutine stack");
+        if (stack != MAP_FAILED) {
+            munmap(stack, stack_size + page_size);
+        }
+        free(co);
+        pthread_mutex_lock(&stacks_lock);
+        allocated--;
+        pthread_mutex_unlock(&stacks_lock);
+        return NULL;
+    }
+    co->stack = stack;
+    return co;
+}
+
+static void coroutine_put(struct coroutine *co) {
+    pthread_mutex_lock(&stacks_lock);
+    co->next = free_list;
+    free_list = co;
+    pthread_mutex_unlock(&stacks_lock);
+    metric_add(metric_active, -1);
+}
+
+static void coroutine_altstack_free(void *stack) {
+    stack_t disable = { .ss_flags = SS_DISABLE };
+    sigaltstack(&disable, NULL);
+    free(stack);
+}
+
+/* Workers get their signal stack the first time they run a coroutine, it goes with the thread */
+static void coroutine_altstack(void) {
+    if (pthread_getspecific(altstack_key)) {
+        return;
+    }
+    stack_t ss = { .ss_size = COROUTINE_ALTSTACK, .ss_flags = 0 };
+    ss.ss_sp = malloc(COROUTINE_ALTSTACK);
+    if (ss.ss_sp == NULL || sigaltstack(&ss, NULL) != 0) {
+        free(ss.ss_sp);
+        return;
+    }
+    pthread_setspecific(altstack_key, ss.ss_sp);
+}
+
+static void coroutine_run(struct coroutine *co);
+
+static void coroutine_resume(void *arg) {
+    coroutine_run(arg);
+}
+
+static void coroutine_schedule(struct coroutine *co) {
+    thread_pool_add_task(coroutine_pool, coroutine_resume, co);
+}
+
+/* Event loop thread, the descriptor is ready */
+static void coroutine_event_callback(struct event *ev, void *arg) {
+    event_del(ev);
+    event_free(ev);
+    coroutine_schedule(arg);
+}
+
+static void coroutine_timer_add(struct coroutine *co) {
+    pthread_mutex_lock(&timer_lock);
+    struct coroutine **link = &timers;
+    while (*link && ((*link)->park.until.tv_sec < co->park.until.tv_sec ||
+           ((*link)->park.until.tv_sec == co->park.until.tv_sec && (*link)->park.until.tv_nsec <= co->park.until.tv_nsec))) {
+        link = &(*link)->next;
+    }
+    co->next = *link;
+    *link = co;
+    if (timers == co) {
+        pthread_cond_signal(&timer_cond);
+    }
+    pthread_mutex_unlock(&timer_lock);
+}
+
+static void coroutine_offload_add(struct coroutine *co) {
+    pthread_mutex_lock(&offload_lock);
+    co->next = NULL;
+    if (offload_tail) {
+        offload_tail->next = co;
+    } else {
+        offload_head = co;
+    }
+    offload_tail = co;
+    pthread_cond_signal(&offload_cond);
+    pthread_mutex_unlock(&offload_lock);
+}
+
+/* Run co on this worker until it finishes or parks. Parking is set up here, after co is off its stack */
+static void coroutine_run(struct coroutine *co) {
+    coroutine_altstack();
+
+    current = co;
+    deadline_set_current(co->deadline);
+    fault_jump_set(co->jump);
+    swapcontext(&worker_context, &co->context);
+    co->deadline = deadline_current();
+    co->jump = fault_jump_get();
+    deadline_set_current(NULL);
+    fault_jump_set(NULL);
+    current = NULL;
+
+    if (co->finished) {
+        http_complete(co->deferred);
+        coroutine_put(co);
+        return;
+    }
+
+    metric_add(metric_parks, 1);
+    switch (co->park.kind) {
+        case PARK_TIMER:
+            coroutine_timer_add(co);
+            break;
+        case PARK_FD: {
+            struct event *ev = event_new(co->park.fd, co->park.events, coroutine_event_callback, co);
+            if (ev == NULL || event_add(ev) < 0) {
+                event_free(ev);
+                co->park.failed = 1;
+                coroutine_schedule(co);
+            }
+            break;
+        }
+        case PARK_OFFLOAD:
+            coroutine_offload_add(co);
+            break;
+    }
+}
+
+/* Kept out of line, getcontext returns twice and no caller's locals should be live across it */
+__attribute__((noinline)) static void coroutine_prepare(struct coroutine *co) {
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp = co->stack + page_size;
+    co->context.uc_stack.ss_size = stack_size;
+    co->context.uc_link = NULL;
+    makecontext(&co->context, coroutine_entry, 0);
+}
+
+int coroutine_execute(handler_t handler, struct http_request *req, struct http_response *res, pthread_rwlock_t *lock) {
+    struct coroutine *co = coroutine_pool ? coroutine_get() : NULL;
+    if (co == NULL) {
+        metric_add(metric_fallback, 1);
+        return -1;
+    }
+    metric_add(metric_active, 1);
+
+    /**
+     * Deferring pins the module until the response has been sent. A module being
+     * replaced takes no new pins, its handlers run on the worker under the lock as usual.
+     */
+    struct http_deferred *deferred = http_defer(req, res);
+    if (deferred == NULL) {
+        coroutine_put(co);
+        metric_add(metric_fallback, 1);
+        return -1;
+    }
+
+    co->handler = handler;
+    co->deferred = deferred;
+    co->finished = 0;
+    co->deadline = NULL;
+    co->jump = NULL;
+
+    coroutine_prepare(co);
+    coroutine_run(co);
+
+    /* Released by the thread that took it, before a parked handler could stall a reload. The pin keeps the module */
+    pthread_rwlock_unlock(lock);
+    return 0;
+}
+
+/* Park co until fd is ready, -1 if the event loop would not take it */
+static int coroutine_wait(struct coroutine *co, int fd, short events) {
+    co->park.kind = PARK_FD;
+    co->park.fd = fd;
+    co->park.events = events;
+    co->park.failed = 0;
+    coroutine_yield(co);
+    return co->park.failed ? -1 : 0;
+}
+
+void coroutine_offload(void (*fn)(void *), void *arg) {
+    struct coroutine *co = coroutine_self();
+    if (co == NULL) {
+        thread_pool_blocking_begin();
+        fn(arg);
+        thread_pool_blocking_end();
+        return;
+    }
+    co->park.kind = PARK_OFFLOAD;
+    co->park.fn = fn;
+    co->park.arg = arg;
+    coroutine_yield(co);
+}
+
+static int blocking_sleep(long ms) {
+    struct coroutine *co = coroutine_self();
+    if (ms <= 0) {
+        return 0;
+    }
+    if (co == NULL) {
+        struct timespec duration = { ms / 1000, (ms % 1000) * 1000000L };
+        thread_pool_blocking_begin();
+        while (nanosleep(&duration, &duration) != 0 && errno == EINTR);
+        thread_pool_blocking_end();
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &co->park.until);
+    co->park.until.tv_sec += ms / 1000;
+    co->park.until.tv_nsec += (ms % 1000) * 1000000L;
+    if (co->park.until.tv_nsec >= 1000000000L) {
+        co->park.until.tv_sec++;
+        co->park.until.tv_nsec -= 1000000000L;
+    }
+    co->park.kind = PARK_TIMER;
+    coroutine_yield(co);
+    return 0;
+}
+
+/* One non-blocking attempt, errno is read on the thread that made the call */
+__attribute__((noinline)) static ssize_t blocking_try(int fd, void *buffer, size_t length, int out, int *error) {
+    ssize_t n = out ? send(fd, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL) : recv(fd, buffer, length, MSG_DONTWAIT);
+    *error = n < 0 ? errno : 0;
+    return n;
+}
+
+static ssize_t blocking_io(int fd, void *buffer, size_t length, int out) {
+    struct coroutine *co = coroutine_self();
+    int error = 0;
+    while (co) {
+        ssize_t n = blocking_try(fd, buffer, length, out, &error);
+        if (n >= 0) {
+            return n;
+        }
+        if (error == ENOTSOCK) {
+            break;
+        }
+        if (error != EAGAIN && error != EWOULDBLOCK && error != EINTR) {
+            coroutine_set_errno(error);
+            return -1;
+        }
+        if (error != EINTR && coroutine_wait(co, fd, out ? EVENT_WRITE : EVENT_READ) != 0) {
+            break;
+        }
+    }
+
+    /* Not a socket, not on a coroutine or the event loop would not watch it */
+    thread_pool_blocking_begin();
+    ssize_t n = out ? send(fd, buffer, length, MSG_NOSIGNAL) : recv(fd, buffer, length, 0);
+    if (n < 0 && coroutine_errno() == ENOTSOCK) {
+        n = out ? write(fd, buffer, length) : read(fd, buffer, length);
+    }
+    thread_pool_blocking_end();
+    return n;
+}
+
+static ssize_t blocking_read(int fd, void *buffer, size_t length) {
+    return blocking_io(fd, buffer, length, 0);
+}
+
+static ssize_t blocking_write(int fd, const void *buffer, size_t length) {
+    return blocking_io(fd, (void *)buffer, length, 1);
+}
+
+__attribute__((noinline)) static int blocking_try_connect(int fd, const struct sockaddr *address, socklen_t length) {
+    return connect(fd, address, length) == 0 ? 0 : errno;
+}
+
+static int blocking_connect(int fd, const struct sockaddr *address, socklen_t length) {
+    struct coroutine *co = coroutine_self();
+    if (co == NULL) {
+        thread_pool_blocking_begin();
+        int ret = connect(fd, address, length);
+        thread_pool_blocking_end();
+        return ret;
+    }
+
+    /* Connect in the background and park until the socket turns writable */
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int error = blocking_try_connect(fd, address, length);
+    if (error == EINPROGRESS) {
+        if (coroutine_wait(co, fd, EVENT_WRITE) != 0) {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            thread_pool_blocking_begin();
+            poll(&pfd, 1, -1);
+            thread_pool_blocking_end();
+        }
+        socklen_t size = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) != 0) {
+            error = coroutine_errno();
+        }
+    }
+    fcntl(fd, F_SETFL, flags);
+
+    if (error != 0) {
+        coroutine_set_errno(error);
+        return -1;
+    }
+    return 0;
+}
+
+static void *coroutine_timer_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&timer_lock);
+    while (1) {
+        if (timers == NULL) {
+            pthread_cond_wait(&timer_cond, &timer_lock);
+            continue;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct coroutine *co = timers;
+        if (co->park.until.tv_sec > now.tv_sec || (co->park.until.tv_sec == now.tv_sec && co->park.until.tv_nsec > now.tv_nsec)) {
+            pthread_cond_timedwait(&timer_cond, &timer_lock, &co->park.until);
+            continue;
+        }
+
+        timers = co->next;
+        pthread_mutex_unlock(&timer_lock);
+        coroutine_schedule(co);
+        pthread_mutex_lock(&timer_lock);
+    }
+    return NULL;
+}
+
+/* Runs library calls for parked coroutines, with the deadline of the handler that made them */
+static void *coroutine_offload_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&offload_lock);
+        while (offload_head == NULL) {
+            pthread_cond_wait(&offload_cond, &offload_lock);
+        }
+        struct coroutine *co = offload_head;
+        offload_head = co->next;
+        if (offload_head == NULL) {
+            offload_tail = NULL;
+        }
+        pthread_mutex_unlock(&offload_lock);
+
+        deadline_set_current(co->deadline);
+        co->park.fn(co->park.arg);
+        deadline_set_current(NULL);
+        coroutine_schedule(co);
+    }
+    return NULL;
+}
+
+void coroutine_init(struct thread_pool *pool) {
+    coroutine_pool = pool;
+    page_size = sysconf(_SC_PAGESIZE);
+    stack_size = (stack_size + page_size - 1) / page_size * page_size;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, coroutine_timer_thread, NULL) != 0) {
+        perror("Error creating coroutine timer thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+
+    for (int i = 0; i < COROUTINE_OFFLOAD_THREADS; i++) {
+        if (pthread_create(&thread, NULL, coroutine_offload_thread, NULL) != 0) {
+            perror("Error creating coroutine offload thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+}
+
+__attribute__((constructor)) static void coroutine_constructor(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_key_create(&altstack_key, coroutine_altstack_free);
+
+    metric_active = metric_get("coroutines_active");
+    metric_parks = metric_get("coroutine_parks_total");
+    metric_fallback = metric_get("coroutine_fallback_total");
+}
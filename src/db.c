@@ -2,6 +2,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <db.h>
+#include <coroutine.h>
+#include <deadline.h>
+
+/* Number of virtual machine instructions between deadline checks */
+#define DB_PROGRESS_INTERVAL 1000
 
 #define DB_FILE "db.sqlite3"
 
@@ -11,14 +16,43 @@ struct sqldb sql_db = {
 };
 __attribute__((visibility("default"))) struct sqldb *exposed_sqldb = &sql_db;
 
+struct db_call {
+    const char *sql;
+    int (*callback)(void *, int, char **, char **);
+    void *data;
+    char *err_msg;
+    int rc;
+};
+
+static void db_call_run(void *arg) {
+    struct db_call *call = arg;
+    call->rc = sqlite3_exec(sql_db.db, call->sql, call->callback, call->data, &call->err_msg);
+}
+
 static int db_exec(const char *sql, int (*callback)(void *, int, char **, char **), void *data) {
-    char *err_msg = 0;
-    int rc = sqlite3_exec(sql_db.db, sql, callback, data, &err_msg);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
+
+    /* No point in starting a query the caller no longer has time for */
+    const struct timespec *deadline = deadline_current();
+    if (deadline && deadline_expired(deadline)) {
+        fprintf(stderr, "SQL error: deadline exceeded\n");
+        return SQLITE_INTERRUPT;
     }
-    return rc;
+
+    /* The connection is serialized, workers waiting here are not using a core and coroutines let go of theirs */
+    struct db_call call = { .sql = sql, .callback = callback, .data = data, .err_msg = NULL, .rc = SQLITE_OK };
+    coroutine_offload(db_call_run, &call);
+    if (call.rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", call.err_msg);
+        sqlite3_free(call.err_msg);
+    }
+    return call.rc;
+}
+
+/* Runs on the thread executing the statement, interrupts it once its deadline passed */
+static int db_progress(void *arg) {
+    (void)arg;
+    const struct timespec *deadline = deadline_current();
+    return deadline && deadline_expired(deadline);
 }
 
 __attribute__((constructor)) void db_init() {
@@ -29,6 +63,8 @@ __attribute__((constructor)) void db_init() {
         fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(sql_db.db));
         exit(1);
     }
+
+    sqlite3_progress_handler(sql_db.db, DB_PROGRESS_INTERVAL, db_progress, NULL);
 }
 
 __attribute__((destructor)) void db_close() {
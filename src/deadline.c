@@ -0,0 +1,14 @@
+#include <stddef.h>
+#include <deadline.h>
+
+/* Set around handlers and scheduled work so shared primitives can bail out early */
+static __thread const struct timespec *current_deadline = NULL;
+
+/* Out of line for the same reason as fault_jump_get, handlers may switch threads between calls */
+__attribute__((noinline)) void deadline_set_current(const struct timespec *deadline) {
+    current_deadline = (deadline && deadline_is_set(deadline)) ? deadline : NULL;
+}
+
+__attribute__((noinline)) const struct timespec *deadline_current(void) {
+    return current_deadline;
+}
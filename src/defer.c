@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <defer.h>
+#include <libevent.h>
+#include <metrics.h>
+
+typedef enum {
+    DEFERRED_RUNNING,   /* Handler has not returned yet */
+    DEFERRED_COMPLETED, /* Completed before the handler returned */
+    DEFERRED_PARKED,    /* Waiting for http_complete */
+    DEFERRED_EXPIRED,   /* Deadline passed while parked, still waiting for http_complete */
+} deferred_state_t;
+
+struct deferred {
+    struct http_deferred public; /* First, tokens handed out are cast back */
+    deferred_state_t state;
+    deferred_outcome_t outcome; /* What finish is asked to do once the token is ready */
+    int queued;                 /* Expired and not finished yet */
+    int completed;              /* http_complete came after the deadline */
+    void *owner;
+    struct deferred *next;
+    struct deferred *timer_next;
+};
+
+/* Completed responses waiting for the event loop, and the pipe that wakes it */
+static pthread_mutex_t deferred_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct deferred *ready = NULL;
+static int notify[2] = {-1, -1};
+static struct event *notify_event = NULL;
+static deferred_finish_t deferred_finish = NULL;
+
+/* Parked tokens with a deadline, soonest first, under deferred_lock */
+static struct deferred *timers = NULL;
+static pthread_cond_t timer_cond;
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+
+static struct metric *metric_pending;
+static struct metric *metric_deferred;
+
+void deferred_set_finish(deferred_finish_t finish) {
+    deferred_finish = finish;
+}
+
+/* Caller holds deferred_lock. Only an empty list needs a wakeup, the loop takes the whole list at once */
+static void deferred_ready(struct deferred *d) {
+    d->next = ready;
+    if (ready == NULL && write(notify[1], "1", 1) < 0 && errno != EAGAIN) {
+        perror("[ERROR] Error waking event loop");
+    }
+    ready = d;
+}
+
+/* Caller holds deferred_lock */
+static void deferred_timer_remove(struct deferred *d) {
+    struct deferred **link = &timers;
+    while (*link && *link != d) {
+        link = &(*link)->timer_next;
+    }
+    if (*link) {
+        *link = d->timer_next;
+    }
+}
+
+static void deferred_complete(struct http_deferred *deferred) {
+    struct deferred *d = (struct deferred *)deferred;
+    pthread_mutex_lock(&deferred_lock);
+    if (d->state == DEFERRED_PARKED) {
+        deferred_timer_remove(d);
+        d->outcome = DEFERRED_SEND;
+        deferred_ready(d);
+    } else if (d->state == DEFERRED_EXPIRED) {
+        /* The client already got its 503, only the request's memory is left to free */
+        d->completed = 1;
+        if (!d->queued) {
+            d->outcome = DEFERRED_RELEASE;
+            deferred_ready(d);
+        }
+    } else {
+        d->state = DEFERRED_COMPLETED;
+    }
+    pthread_mutex_unlock(&deferred_lock);
+}
+
+static int deferred_due(const struct timespec *deadline, const struct timespec *now) {
+    return deadline->tv_sec < now->tv_sec || (deadline->tv_sec == now->tv_sec && deadline->tv_nsec <= now->tv_nsec);
+}
+
+/* Hands parked tokens whose deadline passed to the event loop, which answers 503 */
+static void *deferred_timer_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&deferred_lock);
+    while (1) {
+        if (timers == NULL) {
+            pthread_cond_wait(&timer_cond, &deferred_lock);
+            continue;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct deferred *d = timers;
+        if (!deferred_due(&d->public.req.deadline, &now)) {
+            pthread_cond_timedwait(&timer_cond, &deferred_lock, &d->public.req.deadline);
+            continue;
+        }
+
+        timers = d->timer_next;
+        d->state = DEFERRED_EXPIRED;
+        d->outcome = DEFERRED_EXPIRE;
+        d->queued = 1;
+        deferred_ready(d);
+    }
+    return NULL;
+}
+
+static void deferred_timer_start(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, deferred_timer_thread, NULL) != 0) {
+        perror("[ERROR] Error creating deferred response timer thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+/* Caller holds deferred_lock */
+static void deferred_timer_add(struct deferred *d) {
+    const struct timespec *deadline = &d->public.req.deadline;
+    struct deferred **link = &timers;
+    while (*link && deferred_due(&(*link)->public.req.deadline, deadline)) {
+        link = &(*link)->timer_next;
+    }
+    d->timer_next = *link;
+    *link = d;
+    if (timers == d) {
+        pthread_cond_signal(&timer_cond);
+    }
+}
+
+struct http_deferred *deferred_create(struct http_request *req, struct http_response *res) {
+    if (res->deferred) {
+        return res->deferred;
+    }
+
+    struct deferred *d = calloc(1, sizeof(struct deferred));
+    if (d == NULL) {
+        return NULL;
+    }
+    d->public.req = *req;
+    d->public.res = *res;
+    d->public.res.defer = NULL;
+    d->public.complete = deferred_complete;
+    d->state = DEFERRED_RUNNING;
+
+    res->deferred = &d->public;
+    metric_add(metric_pending, 1);
+    metric_add(metric_deferred, 1);
+    return &d->public;
+}
+
+void deferred_park(struct http_deferred *deferred, void *owner) {
+    struct deferred *d = (struct deferred *)deferred;
+    if (deadline_is_set(&d->public.req.deadline)) {
+        pthread_once(&timer_once, deferred_timer_start);
+    }
+
+    pthread_mutex_lock(&deferred_lock);
+    d->owner = owner;
+    if (d->state == DEFERRED_COMPLETED) {
+        d->outcome = DEFERRED_SEND;
+        deferred_ready(d);
+    } else {
+        d->state = DEFERRED_PARKED;
+        if (deadline_is_set(&d->public.req.deadline)) {
+            deferred_timer_add(d);
+        }
+    }
+    pthread_mutex_unlock(&deferred_lock);
+}
+
+/* Oldest first, the list is built newest first */
+static void deferred_event_callback(struct event *ev, void *arg) {
+    (void)ev;
+    (void)arg;
+    char scratch[64];
+    while (read(notify[0], scratch, sizeof(scratch)) > 0);
+
+    pthread_mutex_lock(&deferred_lock);
+    struct deferred *list = ready;
+    ready = NULL;
+    pthread_mutex_unlock(&deferred_lock);
+
+    struct deferred *ordered = NULL;
+    while (list) {
+        struct deferred *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    /* Sent and released tokens belong to finish, it may already have freed them when it returns */
+    while (ordered) {
+        struct deferred *next = ordered->next;
+        deferred_finish(&ordered->public, ordered->owner, ordered->outcome);
+
+        /* An expired token lives on until the handler completes it, which may have happened meanwhile */
+        if (ordered->outcome == DEFERRED_EXPIRE) {
+            pthread_mutex_lock(&deferred_lock);
+            ordered->queued = 0;
+            int completed = ordered->completed;
+            pthread_mutex_unlock(&deferred_lock);
+            if (completed) {
+                deferred_finish(&ordered->public, ordered->owner, DEFERRED_RELEASE);
+            }
+        }
+        ordered = next;
+    }
+}
+
+void deferred_free(struct http_deferred *deferred) {
+    metric_add(metric_pending, -1);
+    free(deferred);
+}
+
+__attribute__((constructor)) static void deferred_init(void) {
+    metric_pending = metric_get("deferred_pending");
+    metric_deferred = metric_get("deferred_total");
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pipe(notify) != 0) {
+        perror("[ERROR] Error creating deferred response pipe");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(notify[i], F_SETFL, fcntl(notify[i], F_GETFL) | O_NONBLOCK);
+        fcntl(notify[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    notify_event = event_new(notify[0], 0, deferred_event_callback, NULL);
+    if (notify_event == NULL || event_add(notify_event) < 0) {
+        fprintf(stderr, "[ERROR] Failed to add deferred responses to event loop\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+__attribute__((destructor)) static void deferred_destroy(void) {
+    event_del(notify_event);
+    event_free(notify_event);
+    close(notify[0]);
+    close(notify[1]);
+}
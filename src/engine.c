@@ -9,9 +9,22 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <setjmp.h>
+#include <deadline.h>
 
-/* Thread-local storage for sigjmp_buf */
-static __thread sigjmp_buf jump_buffer;
+/**
+ * Innermost safe_execute_handler on this thread, a coroutine carries its own between workers.
+ * Handlers may resume on another thread, so code around them goes through the noinline
+ * accessors, which look the variable up again instead of reusing an address from before.
+ */
+static __thread sigjmp_buf *jump_buffer = NULL;
+
+__attribute__((noinline)) sigjmp_buf *fault_jump_get(void) {
+    return jump_buffer;
+}
+
+__attribute__((noinline)) void fault_jump_set(sigjmp_buf *jump) {
+    jump_buffer = jump;
+}
 
 /* Signal handler for fatal errors */
 static void fault_handler(int sig, siginfo_t *info, void *ucontext) {
@@ -26,9 +39,15 @@ static void fault_handler(int sig, siginfo_t *info, void *ucontext) {
         default:      signal_name = "Unknown signal"; break;
     }
 
+    /* Outside a handler there is nothing to recover, fault again with the default action */
+    if (jump_buffer == NULL) {
+        signal(sig, SIG_DFL);
+        return;
+    }
+
     fprintf(stderr, "%s detected in handler execution. Signal %d received at address %p.\n",
             signal_name, sig, info->si_addr);
-    siglongjmp(jump_buffer, 1);
+    siglongjmp(*jump_buffer, 1);
 }
 
 /* Setup signal handlers for the process */
@@ -37,7 +56,8 @@ __attribute__((constructor)) void global_signal_setup() {
     memset(&sa, 0, sizeof(sa));
     sa.sa_sigaction = fault_handler;
     sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_SIGINFO;
+    /* Threads running coroutines have an alternate stack, an overflowed one cannot run the handler */
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
 
     if (sigaction(SIGSEGV, &sa, NULL) == -1 ||
         sigaction(SIGBUS, &sa, NULL) == -1 ||
@@ -82,10 +102,27 @@ void setup_thread_signals() {
 void safe_execute_handler(handler_t handler, struct http_request *req, struct http_response *res) {
     setup_thread_signals();
 
-    if (sigsetjmp(jump_buffer, 1) == 0) {
+    /* Let database and scheduler calls made by the handler see its deadline */
+    deadline_set_current(&req->deadline);
+
+    sigjmp_buf jump;
+    sigjmp_buf *outer = fault_jump_get();
+    fault_jump_set(&jump);
+    if (sigsetjmp(jump, 1) == 0) {
         handler(req, res);
     } else {
-        snprintf(res->body, HTTP_RESPONSE_SIZE, "Handler execution failed: Fatal signal detected.\n");
+        /* Drop what the handler wrote, once its headers are out all that is left is to close the connection */
         res->status = HTTP_500_INTERNAL_SERVER_ERROR;
+        res->length = 0;
+        res->content_length = 0;
+        if (res->flags & HTTP_RESPONSE_HEADERS_SENT) {
+            res->flags |= HTTP_RESPONSE_ABORTED | HTTP_RESPONSE_CLOSE;
+        } else {
+            snprintf(res->body, res->capacity, "Handler execution failed: Fatal signal detected.\n");
+        }
     }
+
+    /* A COROUTINE handler may have moved, this is the state of the thread it returned on */
+    fault_jump_set(outer);
+    deadline_set_current(NULL);
 }
\ No newline at end of file
@@ -0,0 +1,498 @@
+#include "http.h"
+#include "map.h"
+#include "scan.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* Streamed bodies are parsed through a window of this size */
+#define FORM_WINDOW_SIZE 64*1024
+/* Largest field kept in memory when streaming, files are spilled to disk instead */
+#define FORM_FIELD_MAX 1024*1024
+
+/**
+ * Query string and form body parsing.
+ * Nothing here runs until a handler asks for the data, the result is
+ * cached on the request and maps and values live in the request arena. Also built into libmodule so
+ * modules can call the accessors.
+ */
+
+
+/* Helper function to trim trailing whitespace */
+static void trim_trailing_whitespace(char *str) {
+    int len = strlen(str);
+    while (len > 0 && (str[len - 1] == '\r' || str[len - 1] == '\n' || isspace((unsigned char)str[len - 1]))) {
+        str[--len] = '\0';
+    }
+}
+
+/* Tries to get boundary if multipart data is present. */
+static int http_parse_content_type(const struct http_request *req, char **boundary) {
+    const char *content_type = http_header(req, HTTP_HEADER_CONTENT_TYPE);
+    if (content_type == NULL) {
+        fprintf(stderr, "[ERROR] Content-Type header not found\n");
+        return -1;
+    }
+
+
+    const char *boundary_prefix = "boundary=";
+    *boundary = strstr(content_type, boundary_prefix);
+    if (*boundary == NULL) {
+        fprintf(stderr, "[ERROR] Boundary not found in Content-Type header\n");
+        return -1;
+    }
+
+    *boundary += strlen(boundary_prefix);
+    if (**boundary == '\0') {
+        fprintf(stderr, "[ERROR] Boundary value is empty\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Extract form data from body
+ * Multiple form fields are separated by boundary
+ * @param body Request body
+ * @param boundary Boundary string
+ * @param form_data Map to store form data   
+ */
+static int http_extract_multipart_form_data(struct arena *arena, const char *body, size_t length, const char *boundary, struct map *form_data) {
+    static const char disposition[] = "Content-Disposition: form-data; name=\"";
+    const char *end = body + length;
+    size_t boundary_length = strlen(boundary);
+
+    const char *boundary_start = scan.find(body, length, boundary, boundary_length);
+    if (boundary_start == NULL) {
+        fprintf(stderr, "[ERROR] Boundary not found in body\n");
+        return -1;
+    }
+
+    while (boundary_start != NULL) {
+        boundary_start += boundary_length;
+        if (end - boundary_start >= 2 && strncmp(boundary_start, "--", 2) == 0) break;
+
+        /* Find Content-Disposition */
+        const char *content_disposition = scan.find(boundary_start, end - boundary_start, disposition, sizeof(disposition) - 1);
+        if (content_disposition == NULL) break;
+
+        /* Extract field name */
+        content_disposition += sizeof(disposition) - 1;
+        char field_name[50];
+        sscanf(content_disposition, "%49[^\"]", field_name);
+
+        /* Extract value */
+        const char *value_start = scan.find(content_disposition, end - content_disposition, "\r\n\r\n", 4);
+        if (value_start == NULL) break;
+        value_start += 4;
+
+        const char *value_end = scan.find(value_start, end - value_start, boundary, boundary_length);
+        if (value_end == NULL || value_end - value_start < 2) break;
+        value_end -= 2;
+
+        char *value = arena_strndup(arena, value_start, value_end - value_start);
+        if (value == NULL) {
+            return -1;
+        }
+
+        trim_trailing_whitespace(value);
+
+        if (map_get(form_data, field_name) == NULL) {
+            map_insert(form_data, field_name, value);
+        }
+
+        boundary_start = scan.find(value_end, end - value_end, boundary, boundary_length);
+    }
+
+    return 0;
+}
+
+/* Sliding window over a streamed body, unconsumed bytes are buffer[start, length) */
+struct form_stream {
+    struct http_request *req;
+    char *buffer;
+    size_t start;
+    size_t length;
+    int eof;
+};
+
+/* Move unconsumed bytes to the front and read more, -1 on read error */
+static int form_stream_fill(struct form_stream *s) {
+    memmove(s->buffer, s->buffer + s->start, s->length - s->start);
+    s->length -= s->start;
+    s->start = 0;
+
+    if (s->eof || s->length == FORM_WINDOW_SIZE) {
+        return 0;
+    }
+
+    long ret = http_read(s->req, s->buffer + s->length, FORM_WINDOW_SIZE - s->length);
+    if (ret < 0) {
+        return -1;
+    }
+    if (ret == 0) {
+        s->eof = 1;
+    }
+    s->length += ret;
+    return 0;
+}
+
+/* Make at least count bytes available, -1 if the body ends first */
+static int form_stream_need(struct form_stream *s, size_t count) {
+    while (s->length - s->start < count) {
+        if (s->eof || form_stream_fill(s) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Where part data goes, a file descriptor for uploads or a growing field value */
+struct form_sink {
+    int fd;
+    char *data;
+    size_t length;
+};
+
+static int form_sink_write(struct form_sink *sink, const char *data, size_t length) {
+    if (sink->fd >= 0) {
+        while (length > 0) {
+            ssize_t ret = write(sink->fd, data, length);
+            if (ret < 0) {
+                perror("[ERROR] Error writing upload");
+                return -1;
+            }
+            data += ret;
+            length -= ret;
+        }
+        return 0;
+    }
+
+    if (sink->length + length > FORM_FIELD_MAX) {
+        fprintf(stderr, "[ERROR] Form field too large\n");
+        return -1;
+    }
+    char *data_new = realloc(sink->data, sink->length + length + 1);
+    if (data_new == NULL) {
+        return -1;
+    }
+    sink->data = data_new;
+    memcpy(sink->data + sink->length, data, length);
+    sink->length += length;
+    sink->data[sink->length] = '\0';
+    return 0;
+}
+
+/* Spill file parts to a temporary file, removed by the server when the request ends */
+static int form_upload_open(struct http_request *req, char **path) {
+    const char *dir = getenv("TMPDIR");
+    size_t length = strlen(dir ? dir : "/tmp") + sizeof("/cweb-upload-XXXXXX");
+    char *template = arena_alloc(req->arena, length);
+    struct http_upload *upload = arena_alloc(req->arena, sizeof(struct http_upload));
+    if (template == NULL || upload == NULL) {
+        return -1;
+    }
+    snprintf(template, length, "%s/cweb-upload-XXXXXX", dir ? dir : "/tmp");
+
+    int fd = mkstemp(template);
+    if (fd < 0) {
+        perror("[ERROR] Error creating upload file");
+        return -1;
+    }
+
+    upload->path = template;
+    upload->next = req->uploads;
+    req->uploads = upload;
+    *path = template;
+    return fd;
+}
+
+/* Copy a quoted header parameter such as name="field", 0 if not present */
+static int form_part_param(const char *headers, size_t length, const char *param, char *value, size_t size) {
+    size_t param_length = strlen(param);
+    const char *p = headers, *end = headers + length;
+    while ((p = scan.find(p, end - p, param, param_length)) != NULL) {
+        /* Do not match name= inside filename= */
+        if (p == headers || p[-1] == ' ' || p[-1] == ';') {
+            p += param_length;
+            const char *quote = memchr(p, '"', end - p);
+            if (quote == NULL || (size_t)(quote - p) >= size) {
+                return 0;
+            }
+            memcpy(value, p, quote - p);
+            value[quote - p] = '\0';
+            return 1;
+        }
+        p += param_length;
+    }
+    return 0;
+}
+
+/**
+ * Multipart parser for streamed bodies, the streaming counterpart of
+ * http_extract_multipart_form_data. Parts are read through a fixed window:
+ * fields are kept in the arena and files are written to temporary files
+ * whose paths become the field values, so memory use does not depend on
+ * the size of the upload.
+ */
+static int http_stream_multipart_form_data(struct http_request *req, const char *boundary, struct map *form_data) {
+    struct form_stream s = {.req = req};
+    s.buffer = arena_alloc(req->arena, FORM_WINDOW_SIZE);
+
+    /* Parts are separated by CRLF--boundary, the first one has no CRLF */
+    size_t delimiter_length = strlen(boundary) + 4;
+    char *delimiter = arena_alloc(req->arena, delimiter_length + 1);
+    if (s.buffer == NULL || delimiter == NULL || delimiter_length > FORM_WINDOW_SIZE / 2) {
+        return -1;
+    }
+    snprintf(delimiter, delimiter_length + 1, "\r\n--%s", boundary);
+
+    const char *found;
+    while ((found = scan.find(s.buffer + s.start, s.length - s.start, delimiter + 2, delimiter_length - 2)) == NULL) {
+        if (s.eof || s.length == FORM_WINDOW_SIZE || form_stream_fill(&s) != 0) {
+            fprintf(stderr, "[ERROR] Boundary not found in body\n");
+            return -1;
+        }
+    }
+    s.start = found - s.buffer + delimiter_length - 2;
+
+    while (1) {
+        /* Boundary is followed by -- on the last part and CRLF otherwise */
+        if (form_stream_need(&s, 2) != 0) {
+            return -1;
+        }
+        if (strncmp(s.buffer + s.start, "--", 2) == 0) {
+            return 0;
+        }
+
+        /* Part headers have to fit in the window */
+        const char *headers_end;
+        while ((headers_end = scan.find(s.buffer + s.start, s.length - s.start, "\r\n\r\n", 4)) == NULL) {
+            if (s.eof || (s.start == 0 && s.length == FORM_WINDOW_SIZE) || form_stream_fill(&s) != 0) {
+                fprintf(stderr, "[ERROR] Multipart headers too large\n");
+                return -1;
+            }
+        }
+
+        const char *headers = s.buffer + s.start;
+        size_t headers_length = headers_end - headers;
+        char field_name[50], filename[256];
+        if (!form_part_param(headers, headers_length, "name=\"", field_name, sizeof(field_name))) {
+            return -1;
+        }
+        int file = form_part_param(headers, headers_length, "filename=\"", filename, sizeof(filename));
+        s.start = headers_end - s.buffer + 4;
+
+        struct form_sink sink = {.fd = -1};
+        char *path = NULL;
+        if (file && (sink.fd = form_upload_open(req, &path)) < 0) {
+            return -1;
+        }
+
+        /* Emit data up to the delimiter, holding back what could be the start of one */
+        int ret = 0;
+        while (1) {
+            found = scan.find(s.buffer + s.start, s.length - s.start, delimiter, delimiter_length);
+            if (found) {
+                ret = form_sink_write(&sink, s.buffer + s.start, found - (s.buffer + s.start));
+                s.start = found - s.buffer + delimiter_length;
+                break;
+            }
+            if (s.eof) {
+                fprintf(stderr, "[ERROR] Multipart body ended inside a part\n");
+                ret = -1;
+                break;
+            }
+
+            size_t available = s.length - s.start;
+            if (available >= delimiter_length) {
+                size_t safe = available - (delimiter_length - 1);
+                if ((ret = form_sink_write(&sink, s.buffer + s.start, safe)) != 0) {
+                    break;
+                }
+                s.start += safe;
+            }
+            if ((ret = form_stream_fill(&s)) != 0) {
+                break;
+            }
+        }
+
+        if (sink.fd >= 0) {
+            close(sink.fd);
+        }
+
+        char *value = ret == 0 ? (file ? path : arena_strndup(req->arena, sink.data ? sink.data : "", sink.length)) : NULL;
+        free(sink.data);
+        if (value == NULL) {
+            return -1;
+        }
+
+        if (!file) {
+            trim_trailing_whitespace(value);
+        }
+        if (map_get(form_data, field_name) == NULL) {
+            map_insert(form_data, field_name, value);
+        }
+    }
+}
+
+/**
+ * Read a streamed body into the arena, for formats that need all of it.
+ * A chunked body (length -1) is read to its end, growing the buffer as it comes.
+ */
+static char *form_read_body(struct http_request *req, long length, size_t *total) {
+    if (length > FORM_FIELD_MAX) {
+        fprintf(stderr, "[ERROR] Form body too large\n");
+        return NULL;
+    }
+
+    size_t capacity = length >= 0 ? (size_t)length + 1 : FORM_WINDOW_SIZE;
+    char *body = arena_alloc(req->arena, capacity);
+    *total = 0;
+
+    while (body && (length < 0 || *total < (size_t)length)) {
+        long ret = http_read(req, body + *total, capacity - *total - 1);
+        if (ret < 0 || (ret == 0 && length >= 0)) {
+            return NULL;
+        }
+        if (ret == 0) {
+            break;
+        }
+        *total += ret;
+        if (*total > FORM_FIELD_MAX) {
+            fprintf(stderr, "[ERROR] Form body too large\n");
+            return NULL;
+        }
+
+        if (*total + 1 == capacity && length < 0) {
+            char *grown = arena_alloc(req->arena, capacity * 2);
+            if (grown) {
+                memcpy(grown, body, *total);
+                capacity *= 2;
+            }
+            body = grown;
+        }
+    }
+    if (body) {
+        body[*total] = '\0';
+    }
+    return body;
+}
+
+static int form_hex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Copy and percent-decode, '+' is a space. Malformed escapes are kept as is */
+static char *form_decode(struct arena *arena, const char *src, size_t length) {
+    char *dst = arena_alloc(arena, length + 1);
+    if (dst == NULL) {
+        return NULL;
+    }
+
+    size_t j = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (src[i] == '+') {
+            dst[j++] = ' ';
+        } else if (src[i] == '%' && i + 2 < length && form_hex(src[i + 1]) >= 0 && form_hex(src[i + 2]) >= 0) {
+            dst[j++] = (char)(form_hex(src[i + 1]) << 4 | form_hex(src[i + 2]));
+            i += 2;
+        } else {
+            dst[j++] = src[i];
+        }
+    }
+    dst[j] = '\0';
+    return dst;
+}
+
+/* Parses key=value pairs separated by '&', the first occurrence of a key wins */
+static struct map *form_parse_urlencoded(struct arena *arena, const char *data, size_t length) {
+    const char *end = data + length;
+
+    size_t fields = 1;
+    for (const char *p = data; (p = memchr(p, '&', end - p)) != NULL; p++) {
+        fields++;
+    }
+
+    struct map *map = map_create_arena(arena, fields);
+    if (map == NULL) {
+        return NULL;
+    }
+
+    while (data < end) {
+        const char *field_end = memchr(data, '&', end - data);
+        if (field_end == NULL) field_end = end;
+
+        const char *key_end = memchr(data, '=', field_end - data);
+        if (key_end && key_end > data) {
+            char *key = form_decode(arena, data, key_end - data);
+            char *value = form_decode(arena, key_end + 1, field_end - key_end - 1);
+            if (key && value && map_get(map, key) == NULL) {
+                map_insert(map, key, value);
+            }
+        }
+        data = field_end + 1;
+    }
+    return map;
+}
+
+struct map *http_get_params(struct http_request *req) {
+    if (req->params == NULL) {
+        const char *query = req->query ? req->query : "";
+        req->params = form_parse_urlencoded(req->arena, query, strlen(query));
+    }
+    return req->params;
+}
+
+/**
+ * Parses the body if its either multipart or x-www-form-urlencoded, otherwise the map is empty.
+ * On STREAM_BODY routes the body is read here, uploaded files are spilled to temporary files.
+ */
+struct map *http_get_data(struct http_request *req) {
+    if (req->data) {
+        return req->data;
+    }
+
+    const char *content_type = http_header(req, HTTP_HEADER_CONTENT_TYPE);
+    int streamed = req->body == NULL && req->content_length != 0;
+    size_t length = req->body ? (size_t)req->content_length : 0;
+
+    if (content_type && strstr(content_type, "multipart/form-data")) {
+        char *boundary = NULL;
+        if (http_parse_content_type(req, &boundary) == 0 && streamed) {
+            req->data = map_create_arena(req->arena, 8);
+            if (req->data && http_stream_multipart_form_data(req, boundary, req->data) != 0) {
+                fprintf(stderr, "[ERROR] Failed to extract multipart form data\n");
+            }
+        } else if (boundary) {
+            /* At most one field per boundary */
+            size_t fields = 1, boundary_length = strlen(boundary);
+            const char *p = req->body, *end = req->body + length;
+            while ((p = scan.find(p, end - p, boundary, boundary_length)) != NULL) {
+                p += boundary_length;
+                fields++;
+            }
+
+            req->data = map_create_arena(req->arena, fields);
+            if (req->data && http_extract_multipart_form_data(req->arena, req->body, length, boundary, req->data) != 0) {
+                fprintf(stderr, "[ERROR] Failed to extract multipart form data\n");
+            }
+        }
+    } else if (content_type && strstr(content_type, "application/x-www-form-urlencoded")) {
+        const char *body = req->body ? req->body : "";
+        if (streamed) {
+            body = form_read_body(req, req->content_length, &length);
+        }
+        req->data = form_parse_urlencoded(req->arena, body ? body : "", body ? length : 0);
+    }
+
+    if (req->data == NULL) {
+        req->data = map_create_arena(req->arena, 1);
+    }
+    return req->data;
+}
@@ -0,0 +1,200 @@
+#include "http.h"
+#include "map.h"
+#include <string.h>
+#include <strings.h>
+
+/**
+ * Request header index.
+ * Header names are hashed once while the request is set up, the hash is
+ * used both to resolve well-known headers to their slot and to place the
+ * header in the per request table. Also built into libmodule.
+ */
+
+/* In the order of http_header_id_t */
+static const char *http_header_names[HTTP_HEADER_COUNT] = {
+    "Accept",
+    "Accept-Encoding",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Length",
+    "Content-Type",
+    "Cookie",
+    "Expect",
+    "Host",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "Last-Event-ID",
+    "Range",
+    "Sec-WebSocket-Key",
+    "Sec-WebSocket-Version",
+    "Transfer-Encoding",
+    "Upgrade",
+    "User-Agent",
+    "X-Request-Timeout",
+};
+
+#define KNOWN_SLOTS 64 /* Power of two, comfortably above HTTP_HEADER_COUNT */
+static signed char known_slots[KNOWN_SLOTS];
+static uint32_t known_hashes[HTTP_HEADER_COUNT];
+
+/* FNV-1a over the ASCII lowercased name */
+static uint32_t http_header_hash(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = name[i];
+        if (c >= 'A' && c <= 'Z') c |= 0x20;
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+static http_header_id_t http_header_find_known(const char *name, size_t length, uint32_t hash) {
+    for (uint32_t i = hash & (KNOWN_SLOTS - 1);; i = (i + 1) & (KNOWN_SLOTS - 1)) {
+        int id = known_slots[i];
+        if (id < 0) return HTTP_HEADER_UNKNOWN;
+        if (known_hashes[id] == hash && strlen(http_header_names[id]) == length
+            && strncasecmp(http_header_names[id], name, length) == 0) {
+            return id;
+        }
+    }
+}
+
+http_header_id_t http_header_lookup(const char *name, size_t length) {
+    return http_header_find_known(name, length, http_header_hash(name, length));
+}
+
+/* Returns the table slot holding name, or the empty slot where it would go */
+static struct http_header *http_headers_slot(const struct http_headers *headers, const char *name, uint32_t hash) {
+    for (uint32_t i = hash & (HTTP_HEADER_SLOTS - 1);; i = (i + 1) & (HTTP_HEADER_SLOTS - 1)) {
+        const struct http_header *h = &headers->table[i];
+        if (h->name == NULL || (h->hash == hash && strcasecmp(h->name, name) == 0)) {
+            return (struct http_header *)h;
+        }
+    }
+}
+
+/**
+ * Add a header, the first occurrence of a name wins.
+ * @return 0 on success, 1 if the header was already present, -1 if the table is full
+ */
+int http_headers_add(struct http_headers *headers, const char *name, const char *value) {
+    if (headers->count >= HTTP_MAX_HEADERS) {
+        return -1;
+    }
+
+    size_t length = strlen(name);
+    uint32_t hash = http_header_hash(name, length);
+    struct http_header *h = http_headers_slot(headers, name, hash);
+    if (h->name != NULL) {
+        return 1;
+    }
+
+    h->name = name;
+    h->value = value;
+    h->hash = hash;
+    headers->count++;
+
+    http_header_id_t id = http_header_find_known(name, length, hash);
+    if (id != HTTP_HEADER_UNKNOWN) {
+        headers->known[id] = value;
+    }
+    return 0;
+}
+
+const char *http_get_header(const struct http_request *req, const char *name) {
+    size_t length = strlen(name);
+    uint32_t hash = http_header_hash(name, length);
+
+    http_header_id_t id = http_header_find_known(name, length, hash);
+    if (id != HTTP_HEADER_UNKNOWN) {
+        return req->header_index.known[id];
+    }
+    return http_headers_slot(&req->header_index, name, hash)->value;
+}
+
+struct map *http_get_headers(struct http_request *req) {
+    if (req->headers) {
+        return req->headers;
+    }
+
+    const struct http_headers *index = &req->header_index;
+    req->headers = map_create_arena(req->arena, index->count > 0 ? index->count : 1);
+    if (req->headers == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < HTTP_HEADER_SLOTS; i++) {
+        if (index->table[i].name) {
+            map_insert(req->headers, index->table[i].name, (void *)index->table[i].value);
+        }
+    }
+    return req->headers;
+}
+
+int http_header_has_token(const char *value, const char *token) {
+    if (value == NULL) return 0;
+
+    size_t length = strlen(token);
+    while (*value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') value++;
+
+        const char *end = value;
+        while (*end && *end != ',') end++;
+
+        /* Trim trailing whitespace of the element */
+        const char *last = end;
+        while (last > value && (last[-1] == ' ' || last[-1] == '\t')) last--;
+
+        if ((size_t)(last - value) == length && strncasecmp(value, token, length) == 0) {
+            return 1;
+        }
+        value = end;
+    }
+    return 0;
+}
+
+int http_etag_match(const char *list, const char *etag) {
+    /* Weak comparison, W/ is ignored on both sides */
+    if (strncmp(etag, "W/", 2) == 0) etag += 2;
+    size_t etag_length = strlen(etag);
+    const char *p = list;
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        if (strncmp(p, etag, etag_length) == 0 && (p[etag_length] == '\0' || p[etag_length] == ',' || p[etag_length] == ' ')) {
+            return 1;
+        }
+        while (*p && *p != ',') p++;
+    }
+    return 0;
+}
+
+int http_not_modified(struct http_request *req, struct http_response *res, const char *etag) {
+    char *copy = arena_strdup(res->arena, etag);
+    if (copy) {
+        map_insert(res->headers, "ETag", copy);
+    }
+
+    const char *if_none_match = http_header(req, HTTP_HEADER_IF_NONE_MATCH);
+    if (if_none_match && http_etag_match(if_none_match, etag)) {
+        res->status = HTTP_304_NOT_MODIFIED;
+        return 1;
+    }
+    return 0;
+}
+
+__attribute__((constructor)) static void http_headers_init() {
+    memset(known_slots, -1, sizeof(known_slots));
+    for (int id = 0; id < HTTP_HEADER_COUNT; id++) {
+        const char *name = http_header_names[id];
+        known_hashes[id] = http_header_hash(name, strlen(name));
+
+        uint32_t i = known_hashes[id] & (KNOWN_SLOTS - 1);
+        while (known_slots[i] >= 0) {
+            i = (i + 1) & (KNOWN_SLOTS - 1);
+        }
+        known_slots[i] = id;
+    }
+}
@@ -1,23 +1,187 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <sys/mman.h>
 #include "map.h"
+#include "arena.h"
 
-/* Create a new map with shared memory allocation */
-struct map *map_create(size_t initial_capacity) {
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MAP_GROUP 16
+#define MAP_EMPTY 0x80
+#define MAP_DELETED 0xfe
+
+/* FNV-1a, the low 7 bits go in the control byte and the rest pick the group */
+static uint32_t map_hash(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+static inline uint8_t map_h2(uint32_t hash) {
+    return hash & 0x7f;
+}
+
+/* Bitmask of the buckets in a group whose control byte equals byte */
+static inline uint32_t map_group_match(const uint8_t *group, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < MAP_GROUP; i++) {
+        if (group[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+/* Bitmask of empty or deleted buckets, both have the high bit set */
+static inline uint32_t map_group_free(const uint8_t *group) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < MAP_GROUP; i++) {
+        if (group[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+/* Arena maps never free, their memory goes when the arena is reset */
+static void *map_alloc(const struct map *map, size_t size) {
+    return map->arena ? arena_alloc(map->arena, size) : malloc(size);
+}
+
+static void map_free(const struct map *map, void *ptr) {
+    if (!map->arena) {
+        free(ptr);
+    }
+}
+
+static void *map_realloc(const struct map *map, void *ptr, size_t old_size, size_t size) {
+    if (!map->arena) {
+        return realloc(ptr, size);
+    }
+    void *grown = arena_alloc(map->arena, size);
+    if (grown) {
+        memcpy(grown, ptr, old_size);
+    }
+    return grown;
+}
+
+/* The last byte of small is zero for inline keys and set for allocated ones */
+static inline int map_key_inline(const struct map_key *key) {
+    return key->small[MAP_INLINE_KEY - 1] == '\0';
+}
+
+/* Inline keys point into the keys array, fix entry index up after its key moved */
+static inline void map_key_moved(struct map *map, size_t index) {
+    if (map_key_inline(&map->keys[index])) {
+        map->entries[index].key = map->keys[index].small;
+    }
+}
+
+/* Bucket holding key, -1 if not present */
+static long map_find(const struct map *map, const char *key, uint32_t hash) {
+    size_t mask = map->buckets - 1;
+    size_t pos = (hash >> 7) & mask & ~(size_t)(MAP_GROUP - 1);
+
+    /* Triangular probing over groups visits every group once */
+    for (size_t probe = 1; probe <= map->buckets / MAP_GROUP; probe++) {
+        const uint8_t *group = map->ctrl + pos;
+
+        uint32_t match = map_group_match(group, map_h2(hash));
+        while (match) {
+            size_t bucket = pos + __builtin_ctz(match);
+            uint32_t index = map->slots[bucket];
+            if (map->keys[index].hash == hash && strcmp(map->entries[index].key, key) == 0) {
+                return bucket;
+            }
+            match &= match - 1;
+        }
+
+        if (map_group_match(group, MAP_EMPTY)) {
+            return -1;
+        }
+        pos = (pos + probe * MAP_GROUP) & mask;
+    }
+    return -1;
+}
+
+/* Place entry index in the first free bucket of its probe sequence */
+static void map_place(struct map *map, uint32_t hash, uint32_t index) {
+    size_t mask = map->buckets - 1;
+    size_t pos = (hash >> 7) & mask & ~(size_t)(MAP_GROUP - 1);
+
+    for (size_t probe = 1;; probe++) {
+        uint32_t free_mask = map_group_free(map->ctrl + pos);
+        if (free_mask) {
+            size_t bucket = pos + __builtin_ctz(free_mask);
+            if (map->ctrl[bucket] == MAP_DELETED) {
+                map->tombstones--;
+            }
+            map->ctrl[bucket] = map_h2(hash);
+            map->slots[bucket] = index;
+            return;
+        }
+        pos = (pos + probe * MAP_GROUP) & mask;
+    }
+}
+
+/* Rebuild the index with the given number of buckets, drops tombstones */
+static int map_rehash(struct map *map, size_t buckets) {
+    uint8_t *ctrl = map_alloc(map, buckets);
+    uint32_t *slots = map_alloc(map, buckets * sizeof(uint32_t));
+    if (!ctrl || !slots) {
+        map_free(map, ctrl);
+        map_free(map, slots);
+        return -MAP_ERR;
+    }
+
+    map_free(map, map->ctrl);
+    map_free(map, map->slots);
+    memset(ctrl, MAP_EMPTY, buckets);
+    map->ctrl = ctrl;
+    map->slots = slots;
+    map->buckets = buckets;
+    map->tombstones = 0;
+
+    for (size_t i = 0; i < map->size; i++) {
+        map_place(map, map->keys[i].hash, i);
+    }
+    return 0;
+}
+
+/* Smallest power of two number of buckets that keeps load under 7/8 */
+static size_t map_buckets_for(size_t entries) {
+    size_t buckets = MAP_GROUP;
+    while (buckets * 7 / 8 < entries + 1) {
+        buckets *= 2;
+    }
+    return buckets;
+}
+
+static struct map *map_create_in(struct arena *arena, size_t initial_capacity) {
     if (initial_capacity <= 0)
         return NULL;
 
-    /* Allocate memory for the map structure */
-    struct map *m = malloc(sizeof(struct map));
+    struct map *m = arena ? arena_alloc(arena, sizeof(struct map)) : malloc(sizeof(struct map));
     if (!m)
         return NULL;
+    memset(m, 0, sizeof(struct map));
+    m->arena = arena;
 
-    /* Allocate memory for the entries array */
-    m->entries = malloc(initial_capacity * sizeof(struct map_entry));
-    if (!m->entries) {
-        free(m);
+    m->entries = map_alloc(m, initial_capacity * sizeof(struct map_entry));
+    m->keys = map_alloc(m, initial_capacity * sizeof(struct map_key));
+    if (!m->entries || !m->keys || map_rehash(m, map_buckets_for(initial_capacity)) != 0) {
+        map_free(m, m->entries);
+        map_free(m, m->keys);
+        map_free(m, m);
         return NULL;
     }
 
@@ -26,85 +190,138 @@ struct map *map_create(size_t initial_capacity) {
     return m;
 }
 
-/* Destroy the map and free shared memory */
+/* Create a new map, it grows as needed so the capacity is only a hint */
+struct map *map_create(size_t initial_capacity) {
+    return map_create_in(NULL, initial_capacity);
+}
+
+/* Request scoped maps, a typical request then never calls malloc for them */
+struct map *map_create_arena(struct arena *arena, size_t initial_capacity) {
+    return map_create_in(arena, initial_capacity);
+}
+
+/* Destroy the map, values are owned by the caller */
 void map_destroy(struct map *map) {
-    if (!map)
+    if (!map || map->arena)
         return;
-    
-    /* Free each key's shared memory */
+
     for (size_t i = 0; i < map->size; ++i) {
-        if (map->entries[i].key) {
+        if (!map_key_inline(&map->keys[i])) {
             free(map->entries[i].key);
         }
     }
 
-    /* Free the entries array and the map structure */
     free(map->entries);
+    free(map->keys);
+    free(map->ctrl);
+    free(map->slots);
     free(map);
 }
 
-/* Insert a key-value pair into the map using shared memory for the key */
+/* Insert a key-value pair, an existing key keeps its value */
 int map_insert(struct map *map, const char *key, void *value) {
-    if (!map)
+    if (!map || !key)
         return -MAP_ERR;
 
-    /* Check if capacity is exceeded */
+    uint32_t hash = map_hash(key);
+    if (map_find(map, key, hash) >= 0) {
+        return 0; // Key already exists, no insertion
+    }
+
+    /* Grow the dense entries and their keys, inline keys move with the keys */
     if (map->size >= map->capacity) {
-        return -MAP_ERR;
+        size_t capacity = map->capacity * 2;
+        struct map_entry *entries = map_realloc(map, map->entries, map->capacity * sizeof(struct map_entry),
+                                                capacity * sizeof(struct map_entry));
+        if (!entries) {
+            return -MAP_ERR;
+        }
+        map->entries = entries;
+
+        struct map_key *keys = map_realloc(map, map->keys, map->capacity * sizeof(struct map_key),
+                                           capacity * sizeof(struct map_key));
+        if (!keys) {
+            return -MAP_ERR;
+        }
+        map->keys = keys;
+        map->capacity = capacity;
+        for (size_t i = 0; i < map->size; i++) {
+            map_key_moved(map, i);
+        }
     }
 
-    /* Check for existing key to avoid duplicates */
-    for (size_t i = 0; i < map->size; ++i) {
-        if (strcmp(map->entries[i].key, key) == 0) {
-            return 0; // Key already exists, no insertion
+    /* Keep the index under 7/8 full counting tombstones */
+    if ((map->size + map->tombstones + 1) * 8 > map->buckets * 7) {
+        size_t buckets = map_buckets_for(map->size + 1);
+        if (buckets < map->buckets) buckets = map->buckets;
+        if (map_rehash(map, buckets) != 0) {
+            return -MAP_ERR;
         }
     }
 
-    /* Allocate shared memory for the key string */
+    struct map_entry *entry = &map->entries[map->size];
+    struct map_key *entry_key = &map->keys[map->size];
     size_t key_len = strlen(key) + 1;
-    map->entries[map->size].key = malloc(key_len);
-    if (!map->entries[map->size].key) {
-        return -MAP_ERR;
+    if (key_len <= MAP_INLINE_KEY) {
+        memcpy(entry_key->small, key, key_len);
+        entry_key->small[MAP_INLINE_KEY - 1] = '\0';
+        entry->key = entry_key->small;
+    } else {
+        entry_key->small[MAP_INLINE_KEY - 1] = 1;
+        entry->key = map_alloc(map, key_len);
+        if (!entry->key) {
+            return -MAP_ERR;
+        }
+        memcpy(entry->key, key, key_len);
     }
+    entry->value = value;
+    entry_key->hash = hash;
 
-    /* Copy the key into shared memory */
-    strncpy(map->entries[map->size].key, key, key_len);
-
-    /* Assign the value and increment the size */
-    map->entries[map->size].value = value;
+    map_place(map, hash, map->size);
     map->size++;
     return 0;
 }
 
 /* Retrieve a value from the map by key */
 void *map_get(const struct map *map, const char *key) {
-    if (!map) return NULL;
+    if (!map || !key) return NULL;
 
-    for (size_t i = 0; i < map->size; ++i) {
-        if (strcmp(map->entries[i].key, key) == 0) {
-            return map->entries[i].value;
-        }
-    }
-    return NULL;
+    long bucket = map_find(map, key, map_hash(key));
+    return bucket >= 0 ? map->entries[map->slots[bucket]].value : NULL;
 }
 
 /* Remove a key-value pair from the map */
 int map_remove(struct map *map, const char *key) {
-    for (size_t i = 0; i < map->size; ++i) {
-        if (strcmp(map->entries[i].key, key) == 0) {
-            /* Free the shared memory for the key */
-            free(map->entries[i].key);
+    if (!map || !key)
+        return -MAP_KEY_NOT_FOUND;
 
-            /* Move the last entry to the current position to fill the gap */
-            map->entries[i] = map->entries[map->size - 1];
-            map->size--;
-            return 0;
-        }
+    long bucket = map_find(map, key, map_hash(key));
+    if (bucket < 0) {
+        return -MAP_KEY_NOT_FOUND;
+    }
+
+    uint32_t index = map->slots[bucket];
+    map->ctrl[bucket] = MAP_DELETED;
+    map->tombstones++;
+
+    if (!map_key_inline(&map->keys[index])) {
+        map_free(map, map->entries[index].key);
+    }
+
+    /* Move the last entry to the current position to fill the gap */
+    uint32_t last = map->size - 1;
+    if (index != last) {
+        long moved_bucket = map_find(map, map->entries[last].key, map->keys[last].hash);
+        map->entries[index] = map->entries[last];
+        map->keys[index] = map->keys[last];
+        map_key_moved(map, index);
+        map->slots[moved_bucket] = index;
     }
-    return -MAP_KEY_NOT_FOUND;
+    map->size--;
+    return 0;
 }
 
 /* Get the number of entries in the map */
 size_t map_size(const struct map *map) {
     return map->size;
-}
\ No newline at end of file
+}
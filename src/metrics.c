@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <metrics.h>
+
+/* Metrics are never removed, so lookups only need to lock on registration */
+static struct metric metrics[METRICS_MAX];
+static atomic_int metrics_count = 0;
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct metric *metric_find(const char *name, int count) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(metrics[i].name, name) == 0) {
+            return &metrics[i];
+        }
+    }
+    return NULL;
+}
+
+struct metric *metric_get(const char *name) {
+    struct metric *m = metric_find(name, atomic_load(&metrics_count));
+    if (m) return m;
+
+    pthread_mutex_lock(&metrics_mutex);
+    int count = atomic_load(&metrics_count);
+    m = metric_find(name, count);
+    if (m == NULL && count < METRICS_MAX) {
+        m = &metrics[count];
+        snprintf(m->name, sizeof(m->name), "%s", name);
+        atomic_store(&m->value, 0);
+        atomic_store(&metrics_count, count + 1);
+    } else if (m == NULL) {
+        fprintf(stderr, "[ERROR] Metrics are full, dropping %s\n", name);
+    }
+    pthread_mutex_unlock(&metrics_mutex);
+    return m;
+}
+
+/* Render all metrics as "name value" lines, returns bytes written */
+int metrics_render(char *buffer, size_t size) {
+    size_t len = 0;
+    int count = atomic_load(&metrics_count);
+
+    buffer[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        int written = snprintf(buffer + len, size - len, "%s %ld\n", metrics[i].name, atomic_load(&metrics[i].value));
+        if (written < 0 || (size_t)written >= size - len) {
+            break;
+        }
+        len += written;
+    }
+    return len;
+}
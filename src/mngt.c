@@ -2,6 +2,7 @@
 #include "router.h"
 #include "cweb.h"
 #include "map.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -141,5 +142,10 @@ int mgnt_parse_request(struct http_request *req, struct http_response *res) {
         return -1;
     }
 
-    return mgnt_register_module(res, map_get(req->data, "code"));;
+    if (req->method == HTTP_GET && strcmp(req->path, "/mgnt/metrics") == 0) {
+        metrics_render(res->body, HTTP_RESPONSE_SIZE);
+        return 0;
+    }
+
+    return mgnt_register_module(res, map_get(http_get_data(req), "code"));
 }
\ No newline at end of file
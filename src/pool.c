@@ -4,93 +4,470 @@
 #include <stdatomic.h>
 #include <time.h>
 #include "pool.h"
+#include "metrics.h"
+#include "topology.h"
 #include <errno.h>
 
+/* Resize policy, the monitor samples the pool every interval */
+#define POOL_MONITOR_INTERVAL_MS 100
+#define POOL_GROW_WAIT_US 2000      /* Average queue wait that triggers growth */
+#define POOL_RUNNABLE_PER_CORE 2    /* Unblocked workers allowed per core */
+#define POOL_SHRINK_IDLE_TICKS 30   /* Idle intervals before an idle worker is retired */
+
 /* Prototypes */
 static void *thread_pool_worker(void *arg);
+static void *thread_pool_monitor(void *arg);
+static void thread_pool_join_workers(struct thread_pool *pool);
+static void thread_pool_free(struct thread_pool *pool);
+
+/* Queue owned by the calling thread, NULL if not a pool worker */
+static __thread struct task_queue *local_queue = NULL;
+static __thread struct thread_pool *local_pool = NULL;
+static __thread int local_blocking = 0;
+static __thread uint64_t local_task_wait = 0;
+
+struct worker_arg {
+    struct thread_pool *pool;
+    int index;
+};
+
+/* Resize decisions, exported so the bounds can be tuned */
+static struct metric *metric_threads;
+static struct metric *metric_blocked;
+static struct metric *metric_queue_wait;
+static struct metric *metric_grow_wait;
+static struct metric *metric_grow_blocked;
+static struct metric *metric_shrink_idle;
+static struct metric *metric_shrink_oversubscribed;
+static struct metric *metric_node_local;
+static struct metric *metric_node_handoff;
+
+static uint64_t pool_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Start a worker on the given queue slot, caller holds the resize lock */
+static int thread_pool_spawn(struct thread_pool *pool, int index) {
+    struct worker_arg *warg = malloc(sizeof(struct worker_arg));
+    if (warg == NULL) {
+        fprintf(stderr, "[ERROR] Failed to allocate memory for worker %d\n", index);
+        return -1;
+    }
+    warg->pool = pool;
+    warg->index = index;
+
+    pool->queues[index].cpu = topology_worker_cpu(index);
+    pool->queues[index].node = topology_cpu_node(pool->queues[index].cpu);
+
+    atomic_store(&pool->queues[index].state, QUEUE_RUNNING);
+    if (pthread_create(&pool->threads[index], NULL, thread_pool_worker, warg) != 0) {
+        fprintf(stderr, "[ERROR] Failed to create thread %d\n", index);
+        atomic_store(&pool->queues[index].state, QUEUE_UNUSED);
+        free(warg);
+        return -1;
+    }
+    return 0;
+}
 
 /* Initialize the thread pool */
-struct thread_pool *thread_pool_init(int num_threads) {
+struct thread_pool *thread_pool_init(int min_threads, int max_threads) {
+    if (min_threads < 1) min_threads = 1;
+    if (max_threads < min_threads) max_threads = min_threads;
+
     struct thread_pool *pool = malloc(sizeof(struct thread_pool));
     if (pool == NULL) {
         fprintf(stderr, "[ERROR] Failed to allocate memory for thread pool\n");
         return NULL;
     }
 
-    pool->num_threads = num_threads;
-    pool->max_threads = num_threads;
-    pool->task_queue = NULL;
+    pool->num_threads = 0;
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+    pool->num_cores = sysconf(_SC_NPROCESSORS_ONLN);
     pool->stop = 0;
     pool->queue_length = 0;
+    pool->next_queue = 0;
+    pool->active_threads = 0;
+    pool->blocked_threads = 0;
+    pool->wait_total_ns = 0;
+    pool->wait_samples = 0;
+    pthread_mutex_init(&pool->resize_lock, NULL);
 
-    pthread_mutex_init(&pool->lock, NULL);
-    pthread_cond_init(&pool->cond, NULL);
-
-    pool->threads = malloc(num_threads * sizeof(pthread_t));
-    if (pool->threads == NULL) {
+    pool->queues = aligned_alloc(64, max_threads * sizeof(struct task_queue));
+    pool->threads = malloc(max_threads * sizeof(pthread_t));
+    if (pool->threads == NULL || pool->queues == NULL) {
         fprintf(stderr, "[ERROR] Failed to allocate memory for threads\n");
+        free(pool->threads);
+        free(pool->queues);
         free(pool);
         return NULL;
     }
 
-    for (int i = 0; i < num_threads; i++) {
-        if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool) != 0) {
-            fprintf(stderr, "[ERROR] Failed to create thread %d\n", i);
-            free(pool->threads);
-            free(pool);
+    for (int i = 0; i < max_threads; i++) {
+        struct task_queue *queue = &pool->queues[i];
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->cond, NULL);
+        queue->head = NULL;
+        queue->tail = NULL;
+        queue->length = 0;
+        queue->sleeping = 0;
+        queue->state = QUEUE_UNUSED;
+        queue->cpu = -1;
+        queue->node = -1;
+    }
+
+    metric_threads = metric_get("pool_threads");
+    metric_blocked = metric_get("pool_blocked_threads");
+    metric_queue_wait = metric_get("pool_queue_wait_us");
+    metric_grow_wait = metric_get("pool_resize_grow_queue_wait_total");
+    metric_grow_blocked = metric_get("pool_resize_grow_blocked_total");
+    metric_shrink_idle = metric_get("pool_resize_shrink_idle_total");
+    metric_shrink_oversubscribed = metric_get("pool_resize_shrink_oversubscribed_total");
+    metric_node_local = metric_get("numa_node_local_total");
+    metric_node_handoff = metric_get("numa_cross_node_handoffs_total");
+
+    pthread_mutex_lock(&pool->resize_lock);
+    for (int i = 0; i < min_threads; i++) {
+        if (thread_pool_spawn(pool, i) != 0) {
+            pthread_mutex_unlock(&pool->resize_lock);
+            thread_pool_join_workers(pool);
+            thread_pool_free(pool);
             return NULL;
         }
+        atomic_fetch_add(&pool->num_threads, 1);
     }
+    pthread_mutex_unlock(&pool->resize_lock);
+    metric_set(metric_threads, min_threads);
 
-    printf("[INFO] Initialized thread pool with %d threads\n", num_threads);
+    if (pthread_create(&pool->monitor, NULL, thread_pool_monitor, pool) != 0) {
+        fprintf(stderr, "[ERROR] Failed to create pool monitor thread\n");
+        thread_pool_join_workers(pool);
+        thread_pool_free(pool);
+        return NULL;
+    }
+
+    printf("[INFO] Initialized thread pool with %d threads (max %d)\n", min_threads, max_threads);
 
     return pool;
 }
 
+/* Append a task to the tail of a queue, caller holds the queue lock */
+static void task_queue_push(struct task_queue *queue, struct task *task) {
+    task->next = NULL;
+    if (queue->tail == NULL) {
+        queue->head = task;
+    } else {
+        queue->tail->next = task;
+    }
+    queue->tail = task;
+    atomic_fetch_add(&queue->length, 1);
+}
+
+/* Take the oldest task from a queue, caller holds the queue lock */
+static struct task *task_queue_pop(struct task_queue *queue) {
+    struct task *task = queue->head;
+    if (task == NULL) {
+        return NULL;
+    }
+
+    queue->head = task->next;
+    if (queue->head == NULL) {
+        queue->tail = NULL;
+    }
+    atomic_fetch_sub(&queue->length, 1);
+    return task;
+}
+
+/**
+ * Steal half of the tasks from another worker.
+ * The first stolen task is returned, the rest are moved to our own queue.
+ * Retiring workers are victims too, their queue may wait behind a long task.
+ */
+static struct task *thread_pool_steal(struct thread_pool *pool, int self) {
+    int slots = pool->max_threads;
+    int node = pool->queues[self].node;
+
+    /* Steal from workers on our own node first, only then across nodes */
+    for (int i = 1; i < slots * 2; i++) {
+        struct task_queue *victim = &pool->queues[(self + i) % slots];
+        int remote = victim->node != node;
+        if (i == slots || remote != (i > slots)) {
+            continue;
+        }
+
+        /* Peek without locking, an empty queue is not worth the lock */
+        if (atomic_load(&victim->length) == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&victim->lock);
+        int count = (atomic_load(&victim->length) + 1) / 2;
+        struct task *first = task_queue_pop(victim);
+        struct task *stolen = NULL, *stolen_tail = NULL;
+        for (int j = 1; j < count; j++) {
+            struct task *task = task_queue_pop(victim);
+            if (task == NULL) break;
+            task->next = NULL;
+            if (stolen_tail) stolen_tail->next = task; else stolen = task;
+            stolen_tail = task;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (first == NULL) {
+            continue;
+        }
+
+        if (stolen != NULL) {
+            struct task_queue *own = &pool->queues[self];
+            pthread_mutex_lock(&own->lock);
+            while (stolen != NULL) {
+                struct task *next = stolen->next;
+                task_queue_push(own, stolen);
+                stolen = next;
+            }
+            pthread_mutex_unlock(&own->lock);
+        }
+        return first;
+    }
+
+    return NULL;
+}
+
+/* Whether any queue but our own has tasks left to steal */
+static int thread_pool_stealable(struct thread_pool *pool, int self) {
+    for (int i = 0; i < pool->max_threads; i++) {
+        if (i != self && atomic_load(&pool->queues[i].length) > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Wake a sleeping worker (if any) so it can steal work, skipping the caller */
+static void thread_pool_wake_idle(struct thread_pool *pool, struct task_queue *skip) {
+    int num_threads = atomic_load(&pool->num_threads);
+    unsigned int start = atomic_fetch_add(&pool->next_queue, 1);
+
+    for (int i = 0; i < num_threads; i++) {
+        struct task_queue *queue = &pool->queues[(start + i) % num_threads];
+        if (queue != skip && atomic_load(&queue->sleeping)) {
+            pthread_mutex_lock(&queue->lock);
+            pthread_cond_signal(&queue->cond);
+            pthread_mutex_unlock(&queue->lock);
+            return;
+        }
+    }
+}
 
 /* Worker thread function */
 static void *thread_pool_worker(void *arg) {
-    struct thread_pool *pool = (struct thread_pool *)arg;
+    struct worker_arg *warg = (struct worker_arg *)arg;
+    struct thread_pool *pool = warg->pool;
+    int index = warg->index;
+    free(warg);
 
-    while (1) {
-        pthread_mutex_lock(&pool->lock);
+    struct task_queue *own = &pool->queues[index];
+    local_queue = own;
+    local_pool = pool;
 
-        /* Wait for tasks or stop signal */
-        while (pool->task_queue == NULL && !pool->stop) {
-            pthread_cond_wait(&pool->cond, &pool->lock);
-        }
+    if (own->cpu >= 0) {
+        topology_pin_thread(pthread_self(), own->cpu);
+    }
 
-        if (pool->stop) {
-            pthread_mutex_unlock(&pool->lock);
+    while (!pool->stop) {
+        pthread_mutex_lock(&own->lock);
+        struct task *task = task_queue_pop(own);
+        if (task == NULL && atomic_load(&own->state) == QUEUE_RETIRING) {
+            /* Retired by the monitor and nothing left to do */
+            atomic_store(&own->state, QUEUE_EXITED);
+            pthread_mutex_unlock(&own->lock);
             break;
         }
+        pthread_mutex_unlock(&own->lock);
 
-        /* Fetch a task from the queue */
-        struct task *task = pool->task_queue;
-        if (task != NULL) {
-            pool->task_queue = task->next;
-            pool->queue_length--;
-            atomic_fetch_add(&pool->active_threads, 1);
+        if (task == NULL && atomic_load(&own->state) == QUEUE_RUNNING) {
+            task = thread_pool_steal(pool, index);
         }
 
-        pthread_mutex_unlock(&pool->lock);
+        if (task == NULL) {
+            /**
+             * Nothing to do, sleep until signaled. Submitters queue first and then
+             * look for a sleeper, we announce ourselves first and then look at the
+             * queues, so one of us always sees the other and no task is missed.
+             */
+            pthread_mutex_lock(&own->lock);
+            atomic_store(&own->sleeping, 1);
+            if (own->head == NULL && !pool->stop && atomic_load(&own->state) == QUEUE_RUNNING
+                && !thread_pool_stealable(pool, index)) {
+                pthread_cond_wait(&own->cond, &own->lock);
+            }
+            atomic_store(&own->sleeping, 0);
+            pthread_mutex_unlock(&own->lock);
+            continue;
+        }
 
-        if (task != NULL) {
-            task->function(task->arg);
-            atomic_fetch_sub(&pool->active_threads, 1);
-            free(task);
+        local_task_wait = pool_now_ns() - task->enqueued;
+        atomic_fetch_add(&pool->wait_total_ns, local_task_wait);
+        atomic_fetch_add(&pool->wait_samples, 1);
+
+        if (task->node >= 0) {
+            metric_add(task->node == own->node ? metric_node_local : metric_node_handoff, 1);
+        }
+
+        atomic_fetch_sub(&pool->queue_length, 1);
+        atomic_fetch_add(&pool->active_threads, 1);
+        task->function(task->arg);
+        atomic_fetch_sub(&pool->active_threads, 1);
+        free(task);
+    }
+
+    local_queue = NULL;
+    local_pool = NULL;
+    return NULL;
+}
+
+/* Retire the newest worker, it finishes its queued tasks before exiting */
+static void thread_pool_retire(struct thread_pool *pool) {
+    int index = atomic_load(&pool->num_threads) - 1;
+    struct task_queue *queue = &pool->queues[index];
+
+    pthread_mutex_lock(&queue->lock);
+    atomic_store(&queue->state, QUEUE_RETIRING);
+    atomic_fetch_sub(&pool->num_threads, 1);
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Join retired workers so their slots can be reused */
+static void thread_pool_reap(struct thread_pool *pool) {
+    for (int i = atomic_load(&pool->num_threads); i < pool->max_threads; i++) {
+        if (atomic_load(&pool->queues[i].state) == QUEUE_EXITED) {
+            pthread_join(pool->threads[i], NULL);
+            atomic_store(&pool->queues[i].state, QUEUE_UNUSED);
+        }
+    }
+}
+
+/* Age of the oldest task still waiting in any queue */
+static long thread_pool_oldest_wait_us(struct thread_pool *pool) {
+    uint64_t now = pool_now_ns();
+    uint64_t oldest = now;
+
+    for (int i = 0; i < pool->max_threads; i++) {
+        struct task_queue *queue = &pool->queues[i];
+        if (atomic_load(&queue->length) == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head != NULL && queue->head->enqueued < oldest) {
+            oldest = queue->head->enqueued;
         }
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return (long)((now - oldest) / 1000);
+}
+
+/**
+ * Monitor thread, grows the pool while tasks wait in the queue and too few
+ * workers are runnable, and shrinks it when workers are idle or more
+ * workers are running than the cores can serve.
+ */
+static void *thread_pool_monitor(void *arg) {
+    struct thread_pool *pool = (struct thread_pool *)arg;
+    int runnable_target = pool->num_cores * POOL_RUNNABLE_PER_CORE;
+    int idle_ticks = 0;
+
+    while (!pool->stop) {
+        usleep(POOL_MONITOR_INTERVAL_MS * 1000);
+
+        unsigned long long wait_total = atomic_exchange(&pool->wait_total_ns, 0);
+        unsigned int samples = atomic_exchange(&pool->wait_samples, 0);
+        long avg_wait_us = samples ? (long)(wait_total / samples / 1000) : 0;
+
+        /* If every worker is stuck nothing is dequeued, so also look at the oldest waiting task */
+        long oldest_wait_us = thread_pool_oldest_wait_us(pool);
+        if (oldest_wait_us > avg_wait_us) {
+            avg_wait_us = oldest_wait_us;
+        }
+
+        pthread_mutex_lock(&pool->resize_lock);
+        thread_pool_reap(pool);
+
+        int num_threads = atomic_load(&pool->num_threads);
+        int blocked = atomic_load(&pool->blocked_threads);
+        int active = atomic_load(&pool->active_threads);
+        int queued = atomic_load(&pool->queue_length);
+        int running = active - blocked;
+
+        metric_set(metric_blocked, blocked);
+        metric_set(metric_queue_wait, avg_wait_us);
+
+        idle_ticks = (queued == 0 && active < num_threads) ? idle_ticks + 1 : 0;
+
+        if (queued > 0 && avg_wait_us >= POOL_GROW_WAIT_US && num_threads < pool->max_threads
+            && running < runnable_target && atomic_load(&pool->queues[num_threads].state) == QUEUE_UNUSED) {
+            if (thread_pool_spawn(pool, num_threads) == 0) {
+                atomic_fetch_add(&pool->num_threads, 1);
+                metric_add(blocked > 0 ? metric_grow_blocked : metric_grow_wait, 1);
+            }
+        } else if (num_threads > pool->min_threads && queued == 0 && running > runnable_target) {
+            thread_pool_retire(pool);
+            metric_add(metric_shrink_oversubscribed, 1);
+        } else if (num_threads > pool->min_threads && idle_ticks >= POOL_SHRINK_IDLE_TICKS) {
+            thread_pool_retire(pool);
+            metric_add(metric_shrink_idle, 1);
+            idle_ticks = 0;
+        }
+
+        metric_set(metric_threads, atomic_load(&pool->num_threads));
+        pthread_mutex_unlock(&pool->resize_lock);
     }
 
     return NULL;
 }
 
+/* Full when every worker is busy and the pool cannot grow any further */
 int thread_pool_is_full(struct thread_pool *pool) {
-    return atomic_load(&pool->active_threads) == pool->num_threads;
+    int num_threads = atomic_load(&pool->num_threads);
+    return num_threads >= pool->max_threads && atomic_load(&pool->active_threads) >= num_threads;
 }
 
-/* Add a task to the thread pool */
+uint64_t thread_pool_task_wait_ns(void) {
+    return local_task_wait;
+}
+
+void thread_pool_blocking_begin(void) {
+    if (local_pool == NULL) return;
+    if (local_blocking++ == 0) {
+        atomic_fetch_add(&local_pool->blocked_threads, 1);
+    }
+}
+
+void thread_pool_blocking_end(void) {
+    if (local_pool == NULL || local_blocking == 0) return;
+    if (--local_blocking == 0) {
+        atomic_fetch_sub(&local_pool->blocked_threads, 1);
+    }
+}
+
+/**
+ * Add a task to the thread pool
+ * Tasks submitted from a worker go to its own queue, others are
+ * given to a sleeping worker or spread round robin.
+ */
 void thread_pool_add_task(struct thread_pool *pool, void (*function)(void *), void *arg) {
+    thread_pool_add_task_node(pool, function, arg, -1);
+}
+
+/**
+ * Add a task that prefers workers on the given NUMA node.
+ * A node of -1 (or topology-aware mode being off) means any worker.
+ */
+void thread_pool_add_task_node(struct thread_pool *pool, void (*function)(void *), void *arg, int node) {
     struct task *task = malloc(sizeof(struct task));
     if (task == NULL) {
         fprintf(stderr, "[ERROR] Failed to allocate memory for task\n");
@@ -99,51 +476,110 @@ void thread_pool_add_task(struct thread_pool *pool, void (*function)(void *), vo
 
     task->function = function;
     task->arg = arg;
+    task->enqueued = pool_now_ns();
+    task->node = node;
     task->next = NULL;
 
-    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->queue_length, 1);
 
-    /* Add the task to the queue */
-    if (pool->task_queue == NULL) {
-        pool->task_queue = task;
-    } else {
-        struct task *tmp = pool->task_queue;
-        while (tmp->next != NULL) {
-            tmp = tmp->next;
+    if (local_pool == pool) {
+        if (task->node < 0) {
+            task->node = local_queue->node;
         }
-        tmp->next = task;
+
+        pthread_mutex_lock(&local_queue->lock);
+        task_queue_push(local_queue, task);
+        pthread_mutex_unlock(&local_queue->lock);
+
+        /* We are busy running a task, let an idle worker pick this up */
+        thread_pool_wake_idle(pool, local_queue);
+        return;
     }
 
-    pool->queue_length++;
-    pthread_cond_signal(&pool->cond);
-    pthread_mutex_unlock(&pool->lock);
-}
+    /* Prefer a sleeping worker on the right node, then any worker on that node */
+    int num_threads = atomic_load(&pool->num_threads);
+    unsigned int start = atomic_fetch_add(&pool->next_queue, 1);
+    struct task_queue *target = NULL, *fallback = NULL;
+    for (int i = 0; i < num_threads; i++) {
+        struct task_queue *queue = &pool->queues[(start + i) % num_threads];
+        if (node >= 0 && queue->node != node) {
+            continue;
+        }
+        if (fallback == NULL) {
+            fallback = queue;
+        }
+        if (atomic_load(&queue->sleeping)) {
+            target = queue;
+            break;
+        }
+    }
+    if (target == NULL) {
+        target = fallback ? fallback : &pool->queues[start % num_threads];
+    }
 
+    pthread_mutex_lock(&target->lock);
+    if (atomic_load(&target->state) != QUEUE_RUNNING) {
+        /* Raced with a retiring worker, the first worker is never retired */
+        pthread_mutex_unlock(&target->lock);
+        target = &pool->queues[0];
+        pthread_mutex_lock(&target->lock);
+    }
+    task_queue_push(target, task);
+    int sleeping = atomic_load(&target->sleeping);
+    pthread_cond_signal(&target->cond);
+    pthread_mutex_unlock(&target->lock);
+
+    /* Its owner is busy, let an idle worker steal it rather than wait */
+    if (!sleeping) {
+        thread_pool_wake_idle(pool, target);
+    }
+}
 
-/* Destroy the thread pool */
-void thread_pool_destroy(struct thread_pool *pool) {
-    printf("[INFO] Destroying thread pool\n");
 
-    pthread_mutex_lock(&pool->lock);
+/* Stop every started worker and join it, including retired ones not yet reaped */
+static void thread_pool_join_workers(struct thread_pool *pool) {
     pool->stop = 1;
-    pthread_cond_broadcast(&pool->cond);
-    pthread_mutex_unlock(&pool->lock);
 
-    /* Join all threads */
-    for (int i = 0; i < pool->num_threads; i++) {
-        pthread_join(pool->threads[i], NULL);
+    for (int i = 0; i < pool->max_threads; i++) {
+        pthread_mutex_lock(&pool->queues[i].lock);
+        pthread_cond_broadcast(&pool->queues[i].cond);
+        pthread_mutex_unlock(&pool->queues[i].lock);
     }
 
-    free(pool->threads);
-    pthread_mutex_destroy(&pool->lock);
-    pthread_cond_destroy(&pool->cond);
+    for (int i = 0; i < pool->max_threads; i++) {
+        if (atomic_load(&pool->queues[i].state) != QUEUE_UNUSED) {
+            pthread_join(pool->threads[i], NULL);
+            atomic_store(&pool->queues[i].state, QUEUE_UNUSED);
+        }
+    }
+}
 
-    while (pool->task_queue != NULL) {
-        struct task *tmp = pool->task_queue;
-        pool->task_queue = tmp->next;
-        free(tmp);
+/* Free the queues and the pool, no thread may be using it anymore */
+static void thread_pool_free(struct thread_pool *pool) {
+    for (int i = 0; i < pool->max_threads; i++) {
+        struct task_queue *queue = &pool->queues[i];
+        struct task *task;
+        while ((task = task_queue_pop(queue)) != NULL) {
+            free(task);
+        }
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->cond);
     }
 
+    free(pool->threads);
+    free(pool->queues);
+    pthread_mutex_destroy(&pool->resize_lock);
     free(pool);
+}
+
+/* Destroy the thread pool */
+void thread_pool_destroy(struct thread_pool *pool) {
+    printf("[INFO] Destroying thread pool\n");
+
+    pool->stop = 1;
+    pthread_join(pool->monitor, NULL);
+
+    thread_pool_join_workers(pool);
+    thread_pool_free(pool);
     printf("[INFO] Thread pool destroyed\n");
 }
@@ -0,0 +1,532 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "response.h"
+#include "map.h"
+#include "pool.h"
+
+#define RESPONSE_HEADER_IOV 3 /* Status line, Date and the rest of the headers */
+#define RESPONSE_IOV_MAX (RESPONSE_HEADER_IOV + 3) /* Most iovecs a single response needs */
+
+enum {
+    RESPONSE_CONNECTION_NONE,
+    RESPONSE_CONNECTION_CLOSE,
+    RESPONSE_CONNECTION_KEEP_ALIVE,
+    RESPONSE_CONNECTION_COUNT
+};
+
+/* Write all iovecs, resuming after partial writes */
+static int response_writev(int fd, struct iovec *iov, int count) {
+    int ret = 0;
+
+    /* Slow clients block the worker, let the pool know */
+    thread_pool_blocking_begin();
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            ret = -1;
+            break;
+        }
+
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    thread_pool_blocking_end();
+    return ret;
+}
+
+/* Write iovecs after whatever is held back in the batch, leaving it empty */
+static int response_send_iov(struct http_response *res, struct iovec *iov, int count) {
+    struct iovec all[RESPONSE_IOV_MAX + 1];
+    int n = 0;
+
+    if (res->batch && res->batch->length > 0) {
+        all[n++] = (struct iovec){ res->batch->buffer, res->batch->length };
+        res->batch->length = 0;
+    }
+    memcpy(all + n, iov, count * sizeof(struct iovec));
+    return response_writev(res->fd, all, n + count);
+}
+
+/* Send the file body without copying it through user space */
+static int response_sendfile(struct http_response *res) {
+    off_t offset = res->file.offset;
+    size_t remaining = res->file.length;
+    int ret = 0;
+
+    thread_pool_blocking_begin();
+    while (remaining > 0) {
+#ifdef __linux__
+        ssize_t sent = sendfile(res->fd, res->file.fd, &offset, remaining);
+#else
+        char buffer[16*1024];
+        ssize_t sent = pread(res->file.fd, buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer), offset);
+        if (sent > 0) {
+            struct iovec iov = { buffer, sent };
+            if (response_writev(res->fd, &iov, 1) != 0) sent = -1;
+            else offset += sent;
+        }
+#endif
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) {
+            /* The file shrank or the client left, the promised length cannot be kept */
+            ret = -1;
+            break;
+        }
+        remaining -= sent;
+    }
+    thread_pool_blocking_end();
+    return ret;
+}
+
+/* Copy a rendered response into the batch, -1 if it does not fit */
+static int response_batch_append(struct response_batch *batch, const struct iovec *iov, int count) {
+    size_t length = batch->length;
+    for (int i = 0; i < count; i++) {
+        length += iov[i].iov_len;
+    }
+    if (length > RESPONSE_BATCH_SIZE) {
+        return -1;
+    }
+
+    if (length > batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity : 4096;
+        while (capacity < length) {
+            capacity *= 2;
+        }
+        char *buffer = realloc(batch->buffer, capacity);
+        if (buffer == NULL) {
+            return -1;
+        }
+        batch->buffer = buffer;
+        batch->capacity = capacity;
+    }
+
+    for (int i = 0; i < count; i++) {
+        memcpy(batch->buffer + batch->length, iov[i].iov_base, iov[i].iov_len);
+        batch->length += iov[i].iov_len;
+    }
+    return 0;
+}
+
+int response_batch_flush(struct response_batch *batch, int fd) {
+    if (batch->length == 0) {
+        return 0;
+    }
+    struct iovec iov = { batch->buffer, batch->length };
+    batch->length = 0;
+    return response_writev(fd, &iov, 1);
+}
+
+void response_batch_destroy(struct response_batch *batch) {
+    free(batch->buffer);
+    *batch = (struct response_batch){0};
+}
+
+/* Status lines and canned error responses, rendered once at startup */
+static char status_storage[HTTP_STATUS_COUNT][48];
+static struct iovec status_lines[HTTP_STATUS_COUNT];
+static char canned_storage[HTTP_STATUS_COUNT][RESPONSE_CONNECTION_COUNT][160];
+static struct iovec canned_tails[HTTP_STATUS_COUNT][RESPONSE_CONNECTION_COUNT];
+
+static const struct iovec connection_headers[RESPONSE_CONNECTION_COUNT] = {
+    { "", 0 },
+    { "Connection: close\r\n", 19 },
+    { "Connection: keep-alive\r\n", 24 },
+};
+
+__attribute__((constructor)) static void response_render_static(void) {
+    for (int status = 0; status < HTTP_STATUS_COUNT; status++) {
+        int length = snprintf(status_storage[status], sizeof(status_storage[status]), HTTP_VERSION" %s\r\n", http_errors[status]);
+        status_lines[status] = (struct iovec){ status_storage[status], length };
+
+        for (int connection = 0; connection < RESPONSE_CONNECTION_COUNT; connection++) {
+            char *tail = canned_storage[status][connection];
+            length = snprintf(tail, sizeof(canned_storage[status][connection]),
+                "%sContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n%s\n",
+                (char *)connection_headers[connection].iov_base, strlen(http_errors[status]) + 1, http_errors[status]);
+            canned_tails[status][connection] = (struct iovec){ tail, length };
+        }
+    }
+}
+
+/* Date header, formatted at most once a second per thread */
+static struct iovec response_date(void) {
+    static __thread time_t cached;
+    static __thread char date[64];
+    static __thread size_t length;
+
+    time_t now = time(NULL);
+    if (now != cached || length == 0) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        length = strftime(date, sizeof(date), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        cached = now;
+    }
+    return (struct iovec){ date, length };
+}
+
+/* Headers only, HEAD keeps the Content-Length of the body it leaves out */
+static int response_bodyless(const struct http_response *res) {
+    return res->flags & HTTP_RESPONSE_NO_BODY || res->status == HTTP_304_NOT_MODIFIED || res->status == HTTP_204_NO_CONTENT;
+}
+
+/* Which Connection header to send, upgrades set their own */
+static int response_connection(const struct http_response *res) {
+    if (res->status == HTTP_101_SWITCHING_PROTOCOLS) {
+        return RESPONSE_CONNECTION_NONE;
+    }
+    if (res->flags & HTTP_RESPONSE_CLOSE) {
+        return RESPONSE_CONNECTION_CLOSE;
+    }
+    return res->flags & HTTP_RESPONSE_KEEP_ALIVE ? RESPONSE_CONNECTION_KEEP_ALIVE : RESPONSE_CONNECTION_NONE;
+}
+
+/* Digits of value in the given base, written backwards from the end of buffer */
+static char *response_format_number(char *end, size_t value, unsigned base) {
+    do {
+        *--end = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value);
+    return end;
+}
+
+/* Bounded append to the header block, sets overflow instead of writing past the end */
+struct response_header_block {
+    char *data;
+    size_t length;
+    size_t size;
+    int overflow;
+};
+
+static inline void response_append(struct response_header_block *block, const char *data, size_t length) {
+    if (length > block->size - block->length) {
+        block->overflow = 1;
+        return;
+    }
+    memcpy(block->data + block->length, data, length);
+    block->length += length;
+}
+
+/**
+ * Status line, Date and the rendered headers as RESPONSE_HEADER_IOV iovecs.
+ * Only handler headers and framing are copied into buffer, the rest is static.
+ * @param content_length Body length, or -1 if it is not known yet
+ */
+static int response_header_iov(struct http_response *res, struct iovec *iov, char *buffer, size_t size, long content_length) {
+    struct response_header_block block = { buffer, 0, size, 0 };
+
+    for (size_t i = 0; i < map_size(res->headers); i++) {
+        const char *name = res->headers->entries[i].key;
+        const char *value = res->headers->entries[i].value;
+
+        /* Framing and connection handling are ours, a handler can only ask to close */
+        if (strcasecmp(name, "Content-Length") == 0 || strcasecmp(name, "Transfer-Encoding") == 0 || strcasecmp(name, "Date") == 0) {
+            continue;
+        }
+        if (res->status != HTTP_101_SWITCHING_PROTOCOLS && strcasecmp(name, "Connection") == 0) {
+            if (http_header_has_token(value, "close")) {
+                res->flags |= HTTP_RESPONSE_CLOSE;
+            }
+            continue;
+        }
+
+        size_t before = block.length;
+        response_append(&block, name, strlen(name));
+        response_append(&block, ": ", 2);
+        response_append(&block, value, strlen(value));
+        response_append(&block, "\r\n", 2);
+        if (block.overflow) {
+            fprintf(stderr, "[ERROR] Header buffer overflow\n");
+            block.length = before;
+            block.overflow = 0;
+            break;
+        }
+    }
+
+    const struct iovec *connection = &connection_headers[response_connection(res)];
+    response_append(&block, connection->iov_base, connection->iov_len);
+
+    /* A 304 describes the full representation and a 204 has nothing, neither has a body to frame */
+    if (content_length >= 0 && res->status != HTTP_304_NOT_MODIFIED && res->status != HTTP_204_NO_CONTENT) {
+        char digits[24];
+        char *number = response_format_number(digits + sizeof(digits), content_length, 10);
+        response_append(&block, "Content-Length: ", 16);
+        response_append(&block, number, digits + sizeof(digits) - number);
+        response_append(&block, "\r\n", 2);
+    } else if (res->flags & HTTP_RESPONSE_CHUNKED) {
+        response_append(&block, "Transfer-Encoding: chunked\r\n", 28);
+    }
+    response_append(&block, "\r\n", 2);
+    if (block.overflow) {
+        return -1;
+    }
+
+    iov[0] = status_lines[res->status];
+    iov[1] = response_date();
+    iov[2] = (struct iovec){ buffer, block.length };
+    return RESPONSE_HEADER_IOV;
+}
+
+/* Word at a time multiply and xorshift, cheap enough to run over every body of an ETAG route */
+static uint64_t response_hash(const char *data, size_t length) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, length - i);
+    hash = (hash ^ tail) * 0xc4ceb9fe1a85ec53ull;
+    return hash ^ (hash >> 29);
+}
+
+void http_response_etag(struct http_request *req, struct http_response *res) {
+    if (res->status != HTTP_200_OK || res->flags & (HTTP_RESPONSE_HEADERS_SENT | HTTP_RESPONSE_CANNED) || res->file.fd >= 0 || res->file.data) {
+        return;
+    }
+
+    /* A HEAD handler that left the body empty would get the tag of an empty GET */
+    const char *etag = map_get(res->headers, "ETag");
+    if (etag == NULL && res->flags & HTTP_RESPONSE_NO_BODY && http_response_body_length(res) == 0) {
+        return;
+    }
+    if (etag == NULL) {
+        char *tag = arena_alloc(res->arena, 20);
+        if (tag == NULL) {
+            return;
+        }
+        snprintf(tag, 20, "\"%016llx\"", (unsigned long long)response_hash(res->body, http_response_body_length(res)));
+        map_insert(res->headers, "ETag", tag);
+        etag = tag;
+    }
+
+    const char *if_none_match = http_header(req, HTTP_HEADER_IF_NONE_MATCH);
+    if (if_none_match && http_etag_match(if_none_match, etag)) {
+        res->status = HTTP_304_NOT_MODIFIED;
+    }
+}
+
+void http_response_vary(struct http_response *res, const char *name) {
+    const char *vary = map_get(res->headers, "Vary");
+    if (vary == NULL) {
+        map_insert(res->headers, "Vary", (char *)name);
+        return;
+    }
+    if (http_header_has_token(vary, name) || http_header_has_token(vary, "*")) {
+        return;
+    }
+
+    size_t length = strlen(vary) + strlen(name) + 3;
+    char *list = arena_alloc(res->arena, length);
+    if (list) {
+        snprintf(list, length, "%s, %s", vary, name);
+        map_remove(res->headers, "Vary");
+        map_insert(res->headers, "Vary", list);
+    }
+}
+
+void http_response_error(struct http_response *res, http_error_t status) {
+    res->status = status;
+    res->flags |= HTTP_RESPONSE_CANNED;
+}
+
+static int response_reserve(struct http_response *res, size_t size) {
+    if (size + 1 <= res->capacity) {
+        return 0;
+    }
+
+    size_t capacity = res->capacity * 2;
+    while (capacity < size + 1) {
+        capacity *= 2;
+    }
+
+    /* The old buffer stays in the arena until the request ends */
+    char *body = arena_alloc(res->arena, capacity);
+    if (body == NULL) {
+        return -1;
+    }
+    memcpy(body, res->body, res->length);
+    res->body = body;
+    res->capacity = capacity;
+    return 0;
+}
+
+static int response_write(struct http_response *res, const void *data, size_t length) {
+    if (response_reserve(res, res->length + length) != 0) {
+        return -1;
+    }
+    memcpy(res->body + res->length, data, length);
+    res->length += length;
+    res->body[res->length] = '\0';
+    return 0;
+}
+
+/* Send headers on the first flush and everything written since as one chunk */
+static int response_flush(struct http_response *res) {
+    char headers[RESPONSE_HEADER_SIZE];
+    char chunk[32];
+    struct iovec iov[RESPONSE_IOV_MAX];
+    int count = 0;
+
+    if (!(res->flags & HTTP_RESPONSE_HEADERS_SENT)) {
+        /* HTTP/1.0 has no chunked encoding, the body ends when the connection does */
+        if (res->flags & HTTP_RESPONSE_HTTP10) {
+            res->flags |= HTTP_RESPONSE_CLOSE;
+        } else {
+            res->flags |= HTTP_RESPONSE_CHUNKED;
+        }
+
+        int headers_count = response_header_iov(res, iov, headers, sizeof(headers), -1);
+        if (headers_count < 0) return -1;
+        count += headers_count;
+        res->flags |= HTTP_RESPONSE_HEADERS_SENT;
+    }
+
+    if (res->length > 0 && !response_bodyless(res)) {
+        if (res->flags & HTTP_RESPONSE_CHUNKED) {
+            char *size = response_format_number(chunk + sizeof(chunk) - 2, res->length, 16);
+            memcpy(chunk + sizeof(chunk) - 2, "\r\n", 2);
+            iov[count++] = (struct iovec){ size, chunk + sizeof(chunk) - size };
+            iov[count++] = (struct iovec){ res->body, res->length };
+            iov[count++] = (struct iovec){ "\r\n", 2 };
+        } else {
+            iov[count++] = (struct iovec){ res->body, res->length };
+        }
+    }
+
+    res->length = 0;
+    if (count == 0) return 0;
+
+    if (response_send_iov(res, iov, count) != 0) {
+        res->flags |= HTTP_RESPONSE_CLOSE;
+        return -1;
+    }
+    return 0;
+}
+
+int http_response_init(struct http_response *res, int fd, struct arena *arena, struct response_batch *batch, int flags) {
+    memset(res, 0, sizeof(*res));
+    res->fd = fd;
+    res->arena = arena;
+    res->batch = batch;
+    res->flags = flags;
+    res->write = response_write;
+    res->flush = response_flush;
+    res->file.fd = -1;
+
+    res->headers = map_create_arena(arena, 32);
+    if (res->headers == NULL) {
+        return -1;
+    }
+
+    res->body = arena_alloc(arena, HTTP_RESPONSE_SIZE);
+    if (res->body == NULL) {
+        return -1;
+    }
+    res->body[0] = '\0';
+    res->capacity = HTTP_RESPONSE_SIZE;
+    return 0;
+}
+
+/* Written through the writer, set explicitly for binary data or a C string */
+size_t http_response_body_length(const struct http_response *res) {
+    if (res->length > 0) {
+        return res->length;
+    }
+    if (res->content_length > 0) {
+        return (size_t)res->content_length < res->capacity ? (size_t)res->content_length : res->capacity;
+    }
+    return strlen(res->body);
+}
+
+/**
+ * Status line, headers and body of a response as iovecs, at most RESPONSE_HEADER_IOV + 1.
+ * Only handler headers and framing are copied into headers, the rest points at static or body memory.
+ */
+static int response_render(struct http_response *res, struct iovec *iov, char *headers, size_t size) {
+    int count;
+
+    if (res->flags & HTTP_RESPONSE_CANNED) {
+        /* Everything but the Date is pre-rendered */
+        iov[0] = status_lines[res->status];
+        iov[1] = response_date();
+        iov[2] = canned_tails[res->status][response_connection(res)];
+        if (res->flags & HTTP_RESPONSE_NO_BODY) {
+            /* The canned body is the status text and a newline at the end of the tail */
+            iov[2].iov_len -= strlen(http_errors[res->status]) + 1;
+        }
+        count = 3;
+    } else if (res->file.data || res->file.fd >= 0) {
+        count = response_header_iov(res, iov, headers, size, res->file.length);
+        if (count < 0) return -1;
+        if (res->file.data && res->file.length > 0 && !response_bodyless(res)) {
+            iov[count++] = (struct iovec){ (char *)res->file.data + res->file.offset, res->file.length };
+        }
+    } else {
+        /* A 304 from a handler keeps its headers but never has a body */
+        size_t length = res->status == HTTP_304_NOT_MODIFIED ? 0 : http_response_body_length(res);
+
+        count = response_header_iov(res, iov, headers, size, length);
+        if (count < 0) return -1;
+        if (length > 0 && !response_bodyless(res)) {
+            iov[count++] = (struct iovec){ res->body, length };
+        }
+    }
+    return count;
+}
+
+int http_response_send(struct http_response *res, int more) {
+    /* Ending the body would make a truncated response look complete */
+    if (res->flags & HTTP_RESPONSE_ABORTED) {
+        return 0;
+    }
+
+    /* Streamed, send the rest and terminate the body */
+    if (res->flags & HTTP_RESPONSE_HEADERS_SENT) {
+        if (response_flush(res) != 0) return -1;
+        if (res->flags & HTTP_RESPONSE_CHUNKED && !response_bodyless(res)) {
+            struct iovec iov = { "0\r\n\r\n", 5 };
+            return response_send_iov(res, &iov, 1);
+        }
+        return 0;
+    }
+
+    struct iovec iov[RESPONSE_HEADER_IOV + 1];
+    char headers[RESPONSE_HEADER_SIZE];
+    int count = response_render(res, iov, headers, sizeof(headers));
+    if (count < 0) return -1;
+    res->flags |= HTTP_RESPONSE_HEADERS_SENT;
+
+    /* The next response is coming right after, send both together */
+    int zero_copy = res->file.fd >= 0 && res->file.data == NULL && res->file.length > 0 && !response_bodyless(res);
+    if (more && res->batch && !zero_copy && !(res->flags & HTTP_RESPONSE_CLOSE) && response_batch_append(res->batch, iov, count) == 0) {
+        return 0;
+    }
+
+    if (response_send_iov(res, iov, count) != 0 || (zero_copy && response_sendfile(res) != 0)) {
+        res->flags |= HTTP_RESPONSE_CLOSE;
+        return -1;
+    }
+    return 0;
+}
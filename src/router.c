@@ -1,11 +1,13 @@
 #include "http.h"
 #include "cweb.h"
 #include "router.h"
+#include "cache.h"
 #include <dlfcn.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <container.h>
 #include <regex.h>
+#include <stddef.h>
 
 #define MODULE_TAG "config"
 #define ROUTE_FILE "modules/routes.dat"
@@ -29,9 +31,31 @@ struct gateway {
     .count = 0
 };
 
+/* Reloads wait for pinned handlers without holding the entry lock, so they can finish */
+static pthread_mutex_t pin_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pin_cond = PTHREAD_COND_INITIALIZER;
+
 static int route_save_to_disk(char* filename);
 static int route_load_from_disk(char* filename);
 
+/* Does the route's path pattern match the whole request path */
+static int route_matches(const struct route_info *entry, const char *route) {
+    regex_t regex;
+    char anchored_pattern[1024];
+
+    /* Create an anchored regex pattern, else partial paths will be matched... */
+    snprintf(anchored_pattern, sizeof(anchored_pattern), "^%s$", entry->path);
+
+    if (regcomp(&regex, anchored_pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+        fprintf(stderr, "Invalid regex pattern: %s\n", anchored_pattern);
+        return 0;
+    }
+
+    int match = regexec(&regex, route, 0, NULL, 0);
+    regfree(&regex);
+    return match == 0;
+}
+
 /* Find route with regex pattern matching included. */
 struct route route_find(char *route, char *method) {
     pthread_rwlock_rdlock(&gateway.rwlock);
@@ -43,29 +67,13 @@ struct route route_find(char *route, char *method) {
                 continue;
             }
 
-            if (strcmp(method, entry->method) == 0) {
-                regex_t regex;
-                char anchored_pattern[1024];
-
-                /* Create an anchored regex pattern, else partial paths will be matched... */
-                snprintf(anchored_pattern, sizeof(anchored_pattern), "^%s$", entry->path);
-
-                if (regcomp(&regex, anchored_pattern, REG_EXTENDED | REG_NOSUB) != 0) {
-                    fprintf(stderr, "Invalid regex pattern: %s\n", anchored_pattern);
-                    continue;
-                }
-
-                int match = regexec(&regex, route, 0, NULL, 0);
-                regfree(&regex);
-
-                if (match == 0) {
-                    pthread_rwlock_unlock(&gateway.rwlock);
-                    /* Caller is responsible for unlocking the read lock! */
-                    return (struct route){
-                        .route = entry,
-                        .rwlock = &gateway.entries[i].rwlock
-                    };
-                }
+            if (strcmp(method, entry->method) == 0 && route_matches(entry, route)) {
+                pthread_rwlock_unlock(&gateway.rwlock);
+                /* Caller is responsible for unlocking the read lock! */
+                return (struct route){
+                    .route = entry,
+                    .rwlock = &gateway.entries[i].rwlock
+                };
             }
         }
         pthread_rwlock_unlock(&gateway.entries[i].rwlock);
@@ -74,6 +82,54 @@ struct route route_find(char *route, char *method) {
     return (struct route){0};
 }
 
+/* Append a method to a comma separated Allow list once */
+static void route_allow(char *allow, size_t size, const char *method) {
+    size_t length = strlen(method);
+    for (const char *p = strstr(allow, method); p; p = strstr(p + 1, method)) {
+        if ((p == allow || p[-1] == ' ') && (p[length] == ',' || p[length] == '\0')) {
+            return;
+        }
+    }
+    size_t used = strlen(allow);
+    snprintf(allow + used, size - used, "%s%s", used ? ", " : "", method);
+}
+
+int route_allowed_methods(char *route, char *allow, size_t size) {
+    allow[0] = '\0';
+    int count = 0;
+
+    pthread_rwlock_rdlock(&gateway.rwlock);
+    for (int i = 0; i < gateway.count; i++) {
+        pthread_rwlock_rdlock(&gateway.entries[i].rwlock);
+        for (int j = 0; j < gateway.entries[i].module->size; j++) {
+            struct route_info *entry = &gateway.entries[i].module->routes[j];
+            if (entry->path == NULL || entry->method == NULL || !route_matches(entry, route)) {
+                continue;
+            }
+            route_allow(allow, size, entry->method);
+            /* GET routes answer HEAD as well */
+            if (strcmp(entry->method, "GET") == 0) {
+                route_allow(allow, size, "HEAD");
+            }
+            count++;
+        }
+        /* Event streams are subscribed to with GET */
+        for (int j = 0; j < gateway.entries[i].module->sse_size; j++) {
+            if (gateway.entries[i].module->sse[j].path && strcmp(gateway.entries[i].module->sse[j].path, route) == 0) {
+                route_allow(allow, size, "GET");
+                count++;
+            }
+        }
+        pthread_rwlock_unlock(&gateway.entries[i].rwlock);
+    }
+    pthread_rwlock_unlock(&gateway.rwlock);
+
+    if (count > 0) {
+        route_allow(allow, size, "OPTIONS");
+    }
+    return count;
+}
+
 struct ws_route ws_route_find(char *route) {
     pthread_rwlock_rdlock(&gateway.rwlock);
     for (int i = 0; i < gateway.count; i++) {
@@ -93,7 +149,59 @@ struct ws_route ws_route_find(char *route) {
     return (struct ws_route){0};
 }
 
+struct sse_route sse_route_find(char *route) {
+    pthread_rwlock_rdlock(&gateway.rwlock);
+    for (int i = 0; i < gateway.count; i++) {
+        pthread_rwlock_rdlock(&gateway.entries[i].rwlock);
+        for (int j = 0; j < gateway.entries[i].module->sse_size; j++) {
+            if (gateway.entries[i].module->sse[j].path && strcmp(gateway.entries[i].module->sse[j].path, route) == 0) {
+                /* Caller is responsible for unlocking the read lock! */
+                pthread_rwlock_unlock(&gateway.rwlock);
+                return (struct sse_route){
+                    .info = &gateway.entries[i].module->sse[j],
+                    .rwlock = &gateway.entries[i].rwlock
+                };
+            }
+        }
+        pthread_rwlock_unlock(&gateway.entries[i].rwlock);
+    }
+    pthread_rwlock_unlock(&gateway.rwlock);
+    return (struct sse_route){0};
+}
+
+static struct gateway_entry *route_entry(pthread_rwlock_t *lock) {
+    return (struct gateway_entry *)((char *)lock - offsetof(struct gateway_entry, rwlock));
+}
+
+int route_pin(pthread_rwlock_t *lock) {
+    struct gateway_entry *entry = route_entry(lock);
+    pthread_mutex_lock(&pin_lock);
+    int ret = entry->draining ? -1 : 0;
+    if (ret == 0) {
+        entry->pins++;
+    }
+    pthread_mutex_unlock(&pin_lock);
+    return ret;
+}
+
+void route_unpin(pthread_rwlock_t *lock) {
+    struct gateway_entry *entry = route_entry(lock);
+    pthread_mutex_lock(&pin_lock);
+    if (--entry->pins == 0) {
+        pthread_cond_broadcast(&pin_cond);
+    }
+    pthread_mutex_unlock(&pin_lock);
+}
+
 static int update_gateway_entry(int index, char* so_path, struct module* routes, void* handle) {
+    /* Pinned handlers of the old module may be parked, let them finish first */
+    pthread_mutex_lock(&pin_lock);
+    gateway.entries[index].draining = 1;
+    while (gateway.entries[index].pins > 0) {
+        pthread_cond_wait(&pin_cond, &pin_lock);
+    }
+    pthread_mutex_unlock(&pin_lock);
+
     pthread_rwlock_wrlock(&gateway.entries[index].rwlock);
 
     void* old_handle = gateway.entries[index].handle;
@@ -107,6 +215,9 @@ static int update_gateway_entry(int index, char* so_path, struct module* routes,
     gateway.entries[index].handle = handle;
     gateway.entries[index].module = routes;
 
+    /* Responses of the old code must not outlive it, the entry lock identifies the module */
+    cache_invalidate(&gateway.entries[index].rwlock);
+
     /* Update all websocket connections */
     for(int i = 0; gateway.entries[index].module && i < gateway.entries[index].module->ws_size; i++) {
         /**
@@ -131,6 +242,10 @@ static int update_gateway_entry(int index, char* so_path, struct module* routes,
         gateway.entries[index].module->onload();
     }
     
+    pthread_mutex_lock(&pin_lock);
+    gateway.entries[index].draining = 0;
+    pthread_mutex_unlock(&pin_lock);
+
     pthread_rwlock_unlock(&gateway.entries[index].rwlock);
     printf("[INFO   ] Module %s is updated.\n", routes->name);
     return 0;
@@ -145,6 +260,18 @@ static void* load_shared_object(char* so_path){
     return handle;
 }
 
+/* Coroutine responses are finished after the gateway returns, past the points where they would be shared or stored */
+static int route_check_flags(const struct module *module) {
+    for (int i = 0; i < module->size; i++) {
+        const route_info_t *route = &module->routes[i];
+        if ((route->flags & COROUTINE) && (route->flags & (COALESCE | CACHE))) {
+            fprintf(stderr, "[ERROR] Route %s %s: COROUTINE cannot be combined with COALESCE or CACHE\n", route->method, route->path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static int load_from_shared_object(char* so_path){
     void* handle = load_shared_object(so_path);
     if (!handle) {
@@ -158,6 +285,11 @@ static int load_from_shared_object(char* so_path){
         return -1;
     }
 
+    if (route_check_flags(module) != 0) {
+        dlclose(handle);
+        return -1;
+    }
+
     /* Check if gateway is full */
     if (gateway.count >= 100) {
         fprintf(stderr, "[ERROR] Gateway is full\n");
@@ -0,0 +1,158 @@
+#include <string.h>
+#include <stdint.h>
+#include <scan.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/**
+ * Token characters are classified by splitting each byte into nibbles:
+ * a byte is a token character when token_lo[low] & token_hi[high] != 0.
+ * The same tables drive the scalar loop and the pshufb lookups below.
+ */
+static const uint8_t token_lo[16] = {
+    0x3a, 0x3f, 0x3e, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f,
+    0x3e, 0x3e, 0x3d, 0x15, 0x34, 0x15, 0x3d, 0x1c
+};
+static const uint8_t token_hi[16] = {
+    0x00, 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+size_t scan_token_scalar(const char *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        uint8_t c = (uint8_t)data[i];
+        if ((token_lo[c & 0x0f] & token_hi[c >> 4]) == 0) {
+            return i;
+        }
+    }
+    return length;
+}
+
+const char *scan_find_scalar(const char *data, size_t length, const char *needle, size_t needle_length) {
+    if (needle_length == 0) return data;
+
+    const char *end = data + length;
+    while ((size_t)(end - data) >= needle_length) {
+        data = memchr(data, needle[0], end - data - needle_length + 1);
+        if (data == NULL) return NULL;
+        if (memcmp(data, needle, needle_length) == 0) return data;
+        data++;
+    }
+    return NULL;
+}
+
+#ifdef SCAN_X86
+
+__attribute__((target("sse4.2")))
+static size_t scan_token_sse42(const char *data, size_t length) {
+    const __m128i lo_table = _mm_loadu_si128((const __m128i *)token_lo);
+    const __m128i hi_table = _mm_loadu_si128((const __m128i *)token_hi);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i lo = _mm_shuffle_epi8(lo_table, _mm_and_si128(v, nibble));
+        __m128i hi = _mm_shuffle_epi8(hi_table, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        __m128i bad = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+        int mask = _mm_movemask_epi8(bad);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + scan_token_scalar(data + i, length - i);
+}
+
+/* Compare the first and last needle byte 16 positions at a time, verify candidates with memcmp */
+__attribute__((target("sse4.2")))
+static const char *scan_find_sse42(const char *data, size_t length, const char *needle, size_t needle_length) {
+    if (needle_length == 0) return data;
+    if (needle_length > length) return NULL;
+
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+
+    size_t i = 0;
+    for (; i + needle_length - 1 + 16 <= length; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(data + i + needle_length - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(data + i + bit, needle, needle_length) == 0) {
+                return data + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return scan_find_scalar(data + i, length - i, needle, needle_length);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_token_avx2(const char *data, size_t length) {
+    const __m256i lo_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)token_lo));
+    const __m256i hi_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)token_hi));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i bad = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+        unsigned mask = (unsigned)_mm256_movemask_epi8(bad);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    /* The tail is legacy SSE, running it with dirty upper halves costs far more than the scan */
+    _mm256_zeroupper();
+    return i + scan_token_sse42(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_find_avx2(const char *data, size_t length, const char *needle, size_t needle_length) {
+    if (needle_length == 0) return data;
+    if (needle_length > length) return NULL;
+
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+
+    size_t i = 0;
+    for (; i + needle_length - 1 + 32 <= length; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(data + i + needle_length - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(data + i + bit, needle, needle_length) == 0) {
+                return data + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    _mm256_zeroupper();
+    return scan_find_sse42(data + i, length - i, needle, needle_length);
+}
+
+#endif /* SCAN_X86 */
+
+struct scanner scan = {
+    .name = "scalar",
+    .token = scan_token_scalar,
+    .find = scan_find_scalar,
+};
+
+__attribute__((constructor)) static void scan_init() {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan.name = "avx2";
+        scan.token = scan_token_avx2;
+        scan.find = scan_find_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        scan.name = "sse4.2";
+        scan.token = scan_token_sse42;
+        scan.find = scan_find_sse42;
+    }
+#endif
+}
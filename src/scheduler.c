@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <deadline.h>
+#include <metrics.h>
 
 static int add_work(work_t work, void *data, worker_state_t state);
 
@@ -18,6 +20,7 @@ struct scheduler *exposed_scheduler = &internal_scheduler;
 static pthread_t scheduler_thread;
 static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
 static volatile atomic_int running = 1;
+static struct metric *metric_expired;
 
 static int add_work(work_t work, void *data, worker_state_t state) {
     struct work *new_work = (struct work *)malloc(sizeof(struct work));
@@ -26,13 +29,18 @@ static int add_work(work_t work, void *data, worker_state_t state) {
         return -1;
     }
 
-    /* TODO: Implement the choice of state... */
-    (void)state;
-
     new_work->work = work;
     new_work->data = data;
     new_work->next = NULL;
 
+    /* SYNC work belongs to the calling request and shares its deadline, ASYNC work is detached */
+    const struct timespec *deadline = deadline_current();
+    if (state == SYNC && deadline) {
+        new_work->deadline = *deadline;
+    } else {
+        new_work->deadline = (struct timespec){0};
+    }
+
     pthread_mutex_lock(&internal_scheduler.mutex);
     if (internal_scheduler.size == 0) {
         internal_scheduler.queue = new_work;
@@ -75,7 +83,17 @@ static void* scheduler_thread_function(void *arg) {
 
         pthread_mutex_unlock(&internal_scheduler.mutex);
 
+        /**
+         * Work whose request already ran out of time still runs, it owns its data.
+         * Its deadline is expired, so database calls and deadline checks fail fast.
+         */
+        if (deadline_is_set(&current->deadline) && deadline_expired(&current->deadline)) {
+            metric_add(metric_expired, 1);
+        }
+
+        deadline_set_current(&current->deadline);
         current->work(current->data);
+        deadline_set_current(NULL);
         free(current);
     }
 
@@ -83,6 +101,7 @@ static void* scheduler_thread_function(void *arg) {
 }
 
 __attribute__((constructor)) void scheduler_init() {
+    metric_expired = metric_get("scheduler_expired_total");
     if (pthread_create(&scheduler_thread, NULL, scheduler_thread_function, NULL) != 0) {
         perror("Error creating scheduler thread");
         exit(EXIT_FAILURE);
@@ -13,6 +13,9 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <limits.h>
+#include <strings.h>
+#include <getopt.h>
 #include <openssl/crypto.h>
 
 #include "http.h"
@@ -22,10 +25,64 @@
 #include "db.h"
 #include "scheduler.h"
 #include "pool.h"
+#include "topology.h"
+#include "admission.h"
+#include "metrics.h"
+#include "response.h"
+#include "static.h"
+#include "compress.h"
+#include "cache.h"
+#include "coalesce.h"
+#include "sse.h"
+#include "defer.h"
+#include "coroutine.h"
+#include "chunked.h"
 
 #define ACCEPT_BACKLOG 128
 #define MODULE_URL "/mgnt"
 
+/* Connection buffer starts small and grows to fit large headers or buffered bodies */
+#define CONNECTION_BUFFER_SIZE 8*1024
+#define REQUEST_MAX_HEADER_SIZE 64*1024
+
+/* Defaults for --max-body-size and --max-upload-size */
+#define REQUEST_MAX_BODY_SIZE 1024*1024
+#define REQUEST_MAX_UPLOAD_SIZE 1024L*1024*1024
+
+/* Unread body left by a handler is drained up to this, larger leftovers close the connection */
+#define BODY_DRAIN_MAX 64*1024
+
+/* Chunked bodies are decoded through this much of the connection buffer, chunk size and trailer lines must fit */
+#define REQUEST_CHUNK_WINDOW 16*1024
+
+/* Gateway results */
+#define GATEWAY_OK 0
+#define GATEWAY_SHED 1
+#define GATEWAY_PARKED 2  /* The socket was handed to the SSE hub */
+#define GATEWAY_DEFERRED 3  /* The handler answers later through http_complete */
+
+/* Sent as is when shedding load, rendered once so overload stays cheap */
+static const char shed_response[] =
+    HTTP_VERSION" 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+/* Sent from the event loop when a deferred response misses its deadline */
+static const char deadline_response[] =
+    HTTP_VERSION" 503 Service Unavailable\r\n"
+    "Connection: close\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 18\r\n\r\n"
+    "Deadline exceeded\n";
+
+static const char continue_response[] = HTTP_VERSION" 100 Continue\r\n\r\n";
+
+static const char bad_request_response[] =
+    HTTP_VERSION" 400 Bad Request\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n\r\n";
+
 /* Feature for later... */
 static const char* allowed_management_commands[] = {
     "reload",
@@ -50,10 +107,51 @@ struct cidr_prefix {
 struct connection {
     int sockfd;
     struct sockaddr_in address;
+    int node; /* NUMA node that received the connection, -1 if unknown */
+    struct timespec accepted;
+
+    /* Read buffer, requests are parsed in place */
+    char *buffer;
+    size_t capacity;
+    size_t length;
+
+    /* Request scoped allocations, reset after every response */
+    struct arena arena;
+
+    /* Body of the current request, starts at buffer + body */
+    size_t body;
+    size_t body_length;
+    size_t body_consumed;
+    int continued; /* 100 Continue was sent */
+    char body_end;  /* Byte replaced by the body's terminating NUL, may start the next request */
+
+    /**
+     * Transfer-Encoding: chunked. body_length counts the bytes decoded so far,
+     * they are moved down over the framing in place and dropped once consumed.
+     */
+    int chunked;
+    struct chunked_decoder chunk;
+    size_t chunk_raw;    /* Next byte of framing not decoded yet, the request ends here when done */
+    size_t chunk_window; /* Decoded bytes dropped from the buffer */
+    size_t chunk_served; /* Read back from a buffered chunked body */
+
+    /* Responses to pipelined requests not written yet */
+    struct response_batch batch;
+
+    /* Deferred response in flight, what the gateway still has to do when it completes */
+    int deferred_flags;
+    const char *deferred_route;
+    struct timespec deferred_start;
+    pthread_rwlock_t *deferred_lock; /* Module of the running handler, pinned once it defers */
+    struct http_deferred *deferred;  /* Completed token handed to a worker */
 };
 
 static struct thread_pool *pool;
 static int silent = 0;
+static size_t max_body_size = REQUEST_MAX_BODY_SIZE;
+static size_t max_upload_size = REQUEST_MAX_UPLOAD_SIZE;
+static struct metric *metric_shed;
+static struct metric *metric_deadline_expired;
 
 // static int parse_cidr(const char *cidr_str, struct cidr_prefix *result) {
 //     char ip[INET_ADDRSTRLEN];
@@ -84,6 +182,7 @@ static int silent = 0;
 /* TODO: Ugly fix to allow server access to these.. */
 void ws_handle_client(int sd, struct http_request *req, struct http_response *res, struct ws_info *ws_module_info);
 int ws_confirm_open(int sd);
+void ws_pin_event_thread(int cpu);
 
 static struct connection server_init(uint16_t port) {
     struct connection s;
@@ -136,34 +235,141 @@ static struct connection* server_accept(struct connection s) {
         return NULL;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &c->accepted);
+    c->buffer = NULL;
+    c->capacity = 0;
+    c->length = 0;
+    c->arena = (struct arena){0};
+    c->batch = (struct response_batch){0};
+
+    /* Keep the connection on the node whose cpu handled its packets */
+    c->node = topology_socket_node(c->sockfd);
+
     return c;
 }
 
-static int gateway(int fd, struct http_request *req, struct http_response *res) {
+static int connection_buffer_body(struct connection *c, struct http_request *req);
+
+/* Origin allowed by CORS preflights, "*" for any, NULL answers them without CORS headers */
+static const char *cors_origin = NULL;
+
+/* Answer OPTIONS from route metadata, the handler is never run */
+static void gateway_options(struct http_request *req, struct http_response *res) {
+    char allow[128];
+    if (strcmp(req->path, "*") == 0) {
+        snprintf(allow, sizeof(allow), "GET, HEAD, POST, PUT, DELETE, PATCH, OPTIONS");
+    } else if (route_allowed_methods(req->path, allow, sizeof(allow)) == 0) {
+        http_response_error(res, HTTP_404_NOT_FOUND);
+        return;
+    }
+
+    char *methods = arena_strdup(req->arena, allow);
+    res->status = HTTP_204_NO_CONTENT;
+    map_insert(res->headers, "Allow", methods);
+
+    /* Preflight, the browser asks before sending a non-simple cross-origin request */
+    const char *origin = http_get_header(req, "Origin");
+    if (cors_origin == NULL || origin == NULL || http_get_header(req, "Access-Control-Request-Method") == NULL) {
+        return;
+    }
+    if (strcmp(cors_origin, "*") != 0 && strcmp(cors_origin, origin) != 0) {
+        return;
+    }
+    map_insert(res->headers, "Access-Control-Allow-Origin", (char *)origin);
+    map_insert(res->headers, "Access-Control-Allow-Methods", methods);
+    const char *request_headers = http_get_header(req, "Access-Control-Request-Headers");
+    if (request_headers) {
+        map_insert(res->headers, "Access-Control-Allow-Headers", (char *)request_headers);
+    }
+    map_insert(res->headers, "Access-Control-Max-Age", "600");
+    http_response_vary(res, "Origin");
+}
+
+/* No route for the method, tell the client which ones the path has */
+static void gateway_not_found(struct http_request *req, struct http_response *res) {
+    char allow[128];
+    if (route_allowed_methods(req->path, allow, sizeof(allow)) == 0) {
+        http_response_error(res, HTTP_404_NOT_FOUND);
+        return;
+    }
+    res->status = HTTP_405_METHOD_NOT_ALLOWED;
+    map_insert(res->headers, "Allow", arena_strdup(req->arena, allow));
+    snprintf(res->body, HTTP_RESPONSE_SIZE, "%s\n", http_errors[HTTP_405_METHOD_NOT_ALLOWED]);
+}
+
+/* Refuse a body over the limit, the rest of it is never read so the connection has to go */
+static void gateway_too_large(struct http_response *res) {
+    res->flags |= HTTP_RESPONSE_CLOSE;
+    http_response_error(res, HTTP_413_PAYLOAD_TOO_LARGE);
+}
+
+/* Subscribe to an event stream, on success nothing more is written for this request */
+static int gateway_sse(struct connection *c, struct http_request *req, struct http_response *res, int shed, struct sse_route stream) {
+    if (shed) {
+        pthread_rwlock_unlock(stream.rwlock);
+        return GATEWAY_SHED;
+    }
+
+    if (stream.info->on_subscribe && stream.info->on_subscribe(req) != 0) {
+        pthread_rwlock_unlock(stream.rwlock);
+        http_response_error(res, HTTP_403_FORBIDDEN);
+        return 0;
+    }
+    pthread_rwlock_unlock(stream.rwlock);
+
+    /* Earlier pipelined responses have to be out before the stream starts */
+    if (response_batch_flush(&c->batch, c->sockfd) != 0 || sse_subscribe(c->sockfd, req->path, http_header(req, HTTP_HEADER_LAST_EVENT_ID)) != 0) {
+        res->flags |= HTTP_RESPONSE_CLOSE;
+        http_response_error(res, HTTP_500_INTERNAL_SERVER_ERROR);
+        return 0;
+    }
+    return GATEWAY_PARKED;
+}
+
+/**
+ * Dispatch a request to management, websocket, event stream or module routes.
+ * When shed is set only priority routes are run, else GATEWAY_SHED is returned.
+ * Bodies are read into the connection buffer unless the route streams them.
+ */
+static int gateway(struct connection *c, struct http_request *req, struct http_response *res, int shed) {
+    int fd = c->sockfd;
     if (strncmp(req->path, "/favicon.ico", 12) == 0) {
-        res->status = HTTP_404_NOT_FOUND;
-        snprintf(res->body, HTTP_RESPONSE_SIZE, "404 Not Found\n");
+        http_response_error(res, HTTP_404_NOT_FOUND);
         return 0;
     }
 
-    if(strncmp(req->path, MODULE_URL, 6) == 0) {
+    size_t module_url_len = strlen(MODULE_URL);
+    if(strncmp(req->path, MODULE_URL, module_url_len) == 0 && (req->path[module_url_len] == '\0' || req->path[module_url_len] == '/')) {
+        if (connection_buffer_body(c, req) != 0) {
+            gateway_too_large(res);
+            return 0;
+        }
         if(mgnt_parse_request(req, res) >= 0) {
             res->status = HTTP_200_OK; 
+        } else if (res->body[0] == '\0') {
+            http_response_error(res, HTTP_500_INTERNAL_SERVER_ERROR);
         } else {
+            /* Compiler output is in the body */
             res->status = HTTP_500_INTERNAL_SERVER_ERROR;
         }
         return 0;
     }
 
     if(http_is_websocket_upgrade(req)) {
+        if (shed) {
+            return GATEWAY_SHED;
+        }
+
         struct ws_route ws = ws_route_find(req->path);
         if (ws.info == NULL) {
-            res->status = HTTP_404_NOT_FOUND;
-            snprintf(res->body, HTTP_RESPONSE_SIZE, "404 Not Found\n");
+            http_response_error(res, HTTP_404_NOT_FOUND);
             return 0;
         }
 
-        /* Upgrade to websocket */
+        /* Upgrade to websocket, earlier pipelined responses have to be out before any frame */
+        http_get_headers(req);
+        http_get_params(req);
+        response_batch_flush(&c->batch, fd);
         ws_handle_client(fd, req, res, ws.info);
 
         pthread_rwlock_unlock(ws.rwlock);
@@ -171,32 +377,106 @@ static int gateway(int fd, struct http_request *req, struct http_response *res)
         return 0;
     }
 
+    if (req->method == HTTP_OPTIONS) {
+        gateway_options(req, res);
+        return 0;
+    }
+
+    /* Mounted directories are served by the core, cached files cost about as much as shedding so they are never shed */
+    if (static_serve(req, res) == STATIC_SERVED) {
+        return 0;
+    }
+
+    /* Stored module responses need neither the route nor its module lock */
+    if (cache_serve(req, res) == CACHE_HIT) {
+        return 0;
+    }
+
+    /* HEAD runs the GET route unless the module routes it, the body is dropped when sent */
     struct route r = route_find(req->path, (char*)http_methods[req->method]);
+    if (r.route == NULL && req->method == HTTP_HEAD) {
+        r = route_find(req->path, (char*)http_methods[HTTP_GET]);
+    }
     if (r.route == NULL) {
-        res->status = HTTP_404_NOT_FOUND;
-        snprintf(res->body, HTTP_RESPONSE_SIZE, "404 Not Found\n"); 
+        /* Event streams are looked up last, ordinary requests never pay for them */
+        struct sse_route stream = req->method == HTTP_GET ? sse_route_find(req->path) : (struct sse_route){0};
+        if (stream.info) {
+            return gateway_sse(c, req, res, shed, stream);
+        }
+        gateway_not_found(req, res);
         return 0;
     }
 
-    safe_execute_handler(r.route->handler, req, res);
+    if (shed && !(r.route->flags & PRIORITY)) {
+        pthread_rwlock_unlock(r.rwlock);
+        return GATEWAY_SHED;
+    }
 
-    /* Release the read lock after handler execution */
-    pthread_rwlock_unlock(r.rwlock);
-    return 0;
-}
+    /* Streaming routes pull the body themselves, everyone else gets it in req->body */
+    if ((r.route->flags & STREAM_BODY) ? c->body_length > max_upload_size : connection_buffer_body(c, req) != 0) {
+        pthread_rwlock_unlock(r.rwlock);
+        gateway_too_large(res);
+        return 0;
+    }
 
-/* Build headers for response */
-static void build_headers(struct http_response *res, char *headers, int headers_size) {
-    struct map *headers_map = res->headers;
-    int headers_len = 0;
-    for (size_t i = 0; i < map_size(headers_map); i++) {
-        int written = snprintf(headers + headers_len, headers_size - headers_len, "%s: %s\r\n", headers_map->entries[i].key, (char*)headers_map->entries[i].value);
-        if (written < 0 || written >= headers_size - headers_len) {
-            fprintf(stderr, "[ERROR] Header buffer overflow\n");
-            break;
+    /* Skip the handler if the request already waited past its deadline */
+    http_set_deadline(req, r.route->timeout);
+    if (deadline_expired(&req->deadline)) {
+        pthread_rwlock_unlock(r.rwlock);
+        metric_add(metric_deadline_expired, 1);
+        res->status = HTTP_503_SERVICE_UNAVAILABLE;
+        snprintf(res->body, HTTP_RESPONSE_SIZE, "Deadline exceeded\n");
+        return 0;
+    }
+
+    /* Handlers that read req->params and req->data directly get them parsed up front */
+    if (!(r.route->flags & LAZY_PARAMS)) {
+        http_get_headers(req);
+        http_get_params(req);
+        if (!(r.route->flags & STREAM_BODY)) {
+            http_get_data(req);
         }
-        headers_len += written;
     }
+
+    /* A handler that defers pins its module until the response has been sent */
+    c->deferred_lock = r.rwlock;
+
+    /* A coroutine owns the response from here and releases the module lock, it may be done before this returns */
+    if (r.route->flags & COROUTINE) {
+        c->deferred_flags = r.route->flags;
+        c->deferred_route = arena_strdup(&c->arena, r.route->path);
+        if (coroutine_execute(r.route->handler, req, res, r.rwlock) == 0) {
+            return GATEWAY_DEFERRED;
+        }
+    }
+
+    if (r.route->flags & COALESCE) {
+        coalesce_execute(r.route->handler, req, res);
+    } else {
+        safe_execute_handler(r.route->handler, req, res);
+    }
+
+    /* ETag and compression wait for http_complete, deferred responses are not cached */
+    if (res->deferred) {
+        c->deferred_flags = r.route->flags;
+        c->deferred_route = arena_strdup(&c->arena, r.route->path);
+        pthread_rwlock_unlock(r.rwlock);
+        return GATEWAY_DEFERRED;
+    }
+
+    if (r.route->flags & ETAG) {
+        http_response_etag(req, res);
+    }
+    compress_response(req, res, r.route->path);
+
+    /* Stored under the module lock, a reload cannot slip in before the entry is tied to the module */
+    if (!(r.route->flags & STREAM_BODY)) {
+        cache_store(req, res, r.route->flags & CACHE, r.rwlock);
+    }
+
+    /* Release the read lock after handler execution */
+    pthread_rwlock_unlock(r.rwlock);
+    return 0;
 }
 
 static void measure_time(struct timespec *start, struct timespec *end, double *time_taken) {
@@ -205,21 +485,25 @@ static void measure_time(struct timespec *start, struct timespec *end, double *t
     *time_taken = (*time_taken + (end->tv_nsec - start->tv_nsec)) * 1e-9;
 }
 
+/**
+ * Path, headers and body point into the connection buffer, the request and
+ * response maps, parameter values and the response body live in the arena.
+ * map_destroy only frees maps a handler put on the heap in their place.
+ */
 static void thread_clean_up(struct http_request *req, struct http_response *res) {
-    if (req->body) free(req->body);
-
-    for (size_t i = 0; i < map_size(req->params); i++) {
-        free(req->params->entries[i].value);
+    for (struct http_upload *upload = req->uploads; upload; upload = upload->next) {
+        unlink(upload->path);
     }
     map_destroy(req->params);
-
-    for (size_t i = 0; i < map_size(req->headers); i++) {
-        free(req->headers->entries[i].value);
-    }
     map_destroy(req->headers);
     map_destroy(req->data);
-    map_destroy(res->headers);
-    free(res->body);
+    if (res) {
+        map_destroy(res->headers);
+        if (res->file.release) {
+            res->file.release(res->file.arg);
+        }
+    }
+    arena_reset(req->arena);
 }
 
 static void thread_set_timeout(int sockfd, int seconds) {
@@ -229,109 +513,628 @@ static void thread_set_timeout(int sockfd, int seconds) {
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
 }
 
+static void connection_close(struct connection *c) {
+    response_batch_flush(&c->batch, c->sockfd);
+    response_batch_destroy(&c->batch);
+    close(c->sockfd);
+    free(c->buffer);
+    arena_destroy(&c->arena);
+    free(c);
+}
+
+/* Free a connection whose socket the event loop owns now */
+static void connection_release(struct connection *c) {
+    response_batch_destroy(&c->batch);
+    free(c->buffer);
+    arena_destroy(&c->arena);
+    free(c);
+}
+
+/* Answer with a canned response and drop the connection */
+static void connection_reject(struct connection *c, const char *response, size_t length) {
+    if (response_batch_flush(&c->batch, c->sockfd) != 0 || write(c->sockfd, response, length) < 0) {
+        perror("[ERROR] Error writing to socket");
+    }
+    connection_close(c);
+}
+
+/* Make room for at least size bytes plus a terminating NUL */
+static int connection_reserve(struct connection *c, size_t size) {
+    if (size + 1 <= c->capacity) {
+        return 0;
+    }
+    if (size + 1 > REQUEST_MAX_HEADER_SIZE + max_body_size) {
+        return -1;
+    }
+
+    size_t capacity = c->capacity ? c->capacity : CONNECTION_BUFFER_SIZE;
+    while (capacity < size + 1) {
+        capacity *= 2;
+    }
+    if (capacity > REQUEST_MAX_HEADER_SIZE + max_body_size) {
+        capacity = REQUEST_MAX_HEADER_SIZE + max_body_size;
+    }
+
+    char *buffer = realloc(c->buffer, capacity);
+    if (buffer == NULL) {
+        perror("[ERROR] Error growing connection buffer");
+        return -1;
+    }
+    c->buffer = buffer;
+    c->capacity = capacity;
+    return 0;
+}
+
+/* Read from the client, responses held back for pipelining go out first so it is not left waiting */
+static ssize_t connection_recv(struct connection *c, void *buffer, size_t length) {
+    if (response_batch_flush(&c->batch, c->sockfd) != 0) {
+        return -1;
+    }
+
+    /* Waiting on keep-alive clients does not use a core, let the pool know */
+    thread_pool_blocking_begin();
+    ssize_t ret = read(c->sockfd, buffer, length);
+    thread_pool_blocking_end();
+    return ret;
+}
+
+/* Append whatever the client sent to the connection buffer */
+static int connection_read(struct connection *c) {
+    if (c->length + 1 >= c->capacity && connection_reserve(c, c->capacity * 2) != 0) {
+        return -1;
+    }
+
+    ssize_t ret = connection_recv(c, c->buffer + c->length, c->capacity - c->length - 1);
+
+    if (ret > 0) {
+        c->length += ret;
+        c->buffer[c->length] = '\0';
+    }
+    return ret;
+}
+
+static int connection_expects_continue(const struct http_request *req) {
+    const char *expect = http_header(req, HTTP_HEADER_EXPECT);
+    return !req->http10 && expect && strcasecmp(expect, "100-continue") == 0;
+}
+
+/* Tell a client waiting on Expect: 100-continue to send the body, once per request */
+static int connection_continue(struct connection *c, struct http_request *req) {
+    if (c->continued || !connection_expects_continue(req)) {
+        return 0;
+    }
+    c->continued = 1;
+    if (response_batch_flush(&c->batch, c->sockfd) != 0) {
+        return -1;
+    }
+    return write(c->sockfd, continue_response, sizeof(continue_response) - 1) < 0 ? -1 : 0;
+}
+
+/* Decode the framing buffered after chunk_raw, data moves down to follow what was decoded before */
+static int connection_chunked_decode(struct connection *c) {
+    size_t consumed, decoded;
+    int ret = chunked_decode(&c->chunk, c->buffer + c->chunk_raw, c->length - c->chunk_raw, &consumed,
+                             c->buffer + c->body + c->body_length - c->chunk_window, &decoded);
+    c->chunk_raw += consumed;
+    c->body_length += decoded;
+    return ret;
+}
+
+/**
+ * Body reader for chunked requests. Framing is read into the window after
+ * the headers and decoded there, consumed data is dropped to make room so
+ * the buffer never moves and large uploads use constant memory.
+ */
+static long connection_chunked_read(struct http_request *req, void *buffer, size_t length) {
+    struct connection *c = req->connection;
+
+    /* Buffered by the gateway, serve it again from req->body */
+    if (req->body) {
+        size_t remaining = req->content_length - c->chunk_served;
+        length = length < remaining ? length : remaining;
+        memcpy(buffer, req->body + c->chunk_served, length);
+        c->chunk_served += length;
+        return length;
+    }
+
+    while (c->body_consumed == c->body_length) {
+        if (c->chunk.state == CHUNK_DONE) {
+            return 0;
+        }
+        if (c->chunk.state == CHUNK_ERROR || c->body_length > max_upload_size) {
+            return -1;
+        }
+
+        /* Everything decoded was consumed, keep only the framing not decoded yet */
+        size_t pending = c->length - c->chunk_raw;
+        memmove(c->buffer + c->body, c->buffer + c->chunk_raw, pending);
+        c->length = c->body + pending;
+        c->chunk_raw = c->body;
+        c->chunk_window = c->body_length;
+
+        if (connection_continue(c, req) != 0 || c->length + 1 >= c->capacity) {
+            return -1;
+        }
+        ssize_t ret = connection_recv(c, c->buffer + c->length, c->capacity - c->length - 1);
+        if (ret <= 0) {
+            return -1;
+        }
+        c->length += ret;
+        c->buffer[c->length] = '\0';
+        if (connection_chunked_decode(c) < 0) {
+            return -1;
+        }
+    }
+
+    size_t available = c->body_length - c->body_consumed;
+    length = length < available ? length : available;
+    memcpy(buffer, c->buffer + c->body + c->body_consumed - c->chunk_window, length);
+    c->body_consumed += length;
+    return length;
+}
+
+/**
+ * Body reader behind http_read. Bytes that arrived with the headers are
+ * served from the connection buffer, the rest is read from the socket
+ * straight into the caller's buffer so large uploads use constant memory.
+ */
+static long connection_body_read(struct http_request *req, void *buffer, size_t length) {
+    struct connection *c = req->connection;
+    size_t remaining = c->body_length - c->body_consumed;
+    if (length > remaining) {
+        length = remaining;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    size_t offset = c->body + c->body_consumed;
+    if (offset < c->length) {
+        if (length > c->length - offset) {
+            length = c->length - offset;
+        }
+        memcpy(buffer, c->buffer + offset, length);
+        c->body_consumed += length;
+        return length;
+    }
+
+    if (connection_continue(c, req) != 0) {
+        return -1;
+    }
+
+    ssize_t ret = connection_recv(c, buffer, length);
+
+    if (ret <= 0) {
+        /* Early end of the body is an error to the handler, not end of data */
+        return -1;
+    }
+    c->body_consumed += ret;
+    return ret;
+}
+
+/* Read the whole body into the connection buffer, -1 if it is over the limit or the client went away */
+static int connection_buffer_body(struct connection *c, struct http_request *req) {
+    if (req->body) {
+        return 0;
+    }
+    if (c->body_length > max_body_size || c->body_consumed > 0) {
+        return -1;
+    }
+
+    /* Length is only known at the end, collect the decoded body in the arena */
+    if (c->chunked) {
+        size_t capacity = CONNECTION_BUFFER_SIZE;
+        size_t length = 0;
+        char *body = arena_alloc(req->arena, capacity);
+        long ret;
+        while (body && (ret = connection_chunked_read(req, body + length, capacity - length - 1)) > 0) {
+            length += ret;
+            if (length > max_body_size) {
+                return -1;
+            }
+            if (length + 1 == capacity) {
+                char *grown = arena_alloc(req->arena, capacity * 2);
+                if (grown) {
+                    memcpy(grown, body, length);
+                    capacity *= 2;
+                }
+                body = grown;
+            }
+        }
+        if (body == NULL || ret < 0) {
+            return -1;
+        }
+        body[length] = '\0';
+        req->body = body;
+        req->content_length = length;
+        return 0;
+    }
+
+    /* Reserved before the request was initialised so the buffer does not move here */
+    while (c->length < c->body + c->body_length) {
+        if (connection_continue(c, req) != 0) {
+            return -1;
+        }
+        if (connection_read(c) <= 0) {
+            return -1;
+        }
+    }
+
+    /* http_read still works, it is served from the buffer */
+    req->body = c->buffer + c->body;
+    c->body_end = req->body[c->body_length];
+    req->body[c->body_length] = '\0';
+    return 0;
+}
+
+/* Chunked leftovers have no known length, read on up to the drain limit */
+static int connection_drain_chunked(struct connection *c, struct http_request *req) {
+    if (c->chunk.state == CHUNK_DONE) {
+        return 0;
+    }
+    if (!c->continued && connection_expects_continue(req)) {
+        return -1;
+    }
+
+    char scratch[4096];
+    size_t drained = 0;
+    long ret;
+    while ((ret = connection_chunked_read(req, scratch, sizeof(scratch))) > 0) {
+        drained += ret;
+        if (drained > BODY_DRAIN_MAX) {
+            return -1;
+        }
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+/* Skip what the handler left unread so the next request starts at the right place */
+static int connection_drain_body(struct connection *c, struct http_request *req) {
+    if (c->chunked) {
+        return connection_drain_chunked(c, req);
+    }
+
+    size_t remaining = c->body_length - c->body_consumed;
+    if (remaining == 0) {
+        return 0;
+    }
+    if (remaining > BODY_DRAIN_MAX) {
+        return -1;
+    }
+
+    /* A client that never got its 100 Continue will not send the body */
+    if (!c->continued && connection_expects_continue(req)) {
+        return -1;
+    }
+
+    char scratch[4096];
+
+    while (remaining > 0) {
+        size_t offset = c->body + c->body_consumed;
+        size_t length = remaining < sizeof(scratch) ? remaining : sizeof(scratch);
+        if (offset < c->length) {
+            length = length < c->length - offset ? length : c->length - offset;
+        } else {
+            ssize_t ret = connection_recv(c, scratch, length);
+            if (ret <= 0) {
+                return -1;
+            }
+            length = ret;
+        }
+        c->body_consumed += length;
+        remaining -= length;
+    }
+    return 0;
+}
+
+/* Where the next request starts, a chunked body ends after its framing */
+static size_t connection_request_end(const struct connection *c) {
+    return c->chunked ? c->chunk_raw : c->body + c->body_length;
+}
+
+/* Strict Content-Length, digits only, -1 if malformed */
+static long connection_content_length(const char *value) {
+    if (value == NULL) {
+        return 0;
+    }
+    if (*value == '\0') {
+        return -1;
+    }
+
+    long length = 0;
+    for (const char *p = value; *p; p++) {
+        if (*p < '0' || *p > '9' || length > (LONG_MAX - 9) / 10) {
+            return -1;
+        }
+        length = length * 10 + (*p - '0');
+    }
+    return length;
+}
+
+/**
+ * Send the response and get the connection ready for its next request.
+ * @return 0 if the connection stays open, -1 if it was closed or handed to the event loop
+ */
+static int connection_respond(struct connection *c, struct http_request *req, struct http_response *res, struct timespec *start) {
+    /* Too much unread body to skip, say so while headers can still change */
+    if (!req->websocket && c->body_length - c->body_consumed > BODY_DRAIN_MAX) {
+        res->flags |= HTTP_RESPONSE_CLOSE;
+    }
+
+    /* Hold small responses back while the client has more requests in flight */
+    int pipelined = !req->websocket && c->length > connection_request_end(c);
+    if (http_response_send(res, pipelined) != 0) {
+        perror("[ERROR] Error writing to socket");
+    }
+    int keep_alive = !(res->flags & HTTP_RESPONSE_CLOSE) && (req->websocket || connection_drain_body(c, req) == 0);
+
+    struct timespec end;
+    double time_taken;
+    measure_time(start, &end, &time_taken);
+
+    if (!silent)
+        printf("[%ld] %s - Request %s %s took %f seconds.\n", (long)req->tid, http_errors[res->status], http_methods[req->method], req->path, time_taken);
+
+    thread_clean_up(req, res);
+
+    /* The event loop owns the socket from here on */
+    if (req->websocket) {
+        ws_confirm_open(c->sockfd);
+        connection_release(c);
+        return -1;
+    }
+
+    if (!keep_alive) {
+        connection_close(c);
+        return -1;
+    }
+
+    /* Whatever follows this request is the start of the next one, move it to the front */
+    size_t request_end = connection_request_end(c);
+    if (req->body && !c->chunked) {
+        c->buffer[request_end] = c->body_end;
+    }
+    if (c->length > request_end) {
+        memmove(c->buffer, c->buffer + request_end, c->length - request_end);
+        c->length -= request_end;
+    } else {
+        c->length = 0;
+    }
+    c->buffer[c->length] = '\0';
+    return 0;
+}
+
+/* Installed as res->defer, a module being replaced takes no new pins so its handlers answer as usual */
+static struct http_deferred *connection_defer(struct http_request *req, struct http_response *res) {
+    struct connection *c = req->connection;
+    if (res->deferred) {
+        return res->deferred;
+    }
+    if (c->deferred_lock == NULL || route_pin(c->deferred_lock) != 0) {
+        return NULL;
+    }
+    struct http_deferred *deferred = deferred_create(req, res);
+    if (deferred == NULL) {
+        route_unpin(c->deferred_lock);
+    }
+    return deferred;
+}
+
 static void thread_handle_client(void *arg) {
-    int ret;
     struct connection *c = (struct connection *)arg;
 
+    /* Allocated by the worker so the buffer is local to its node */
+    if (connection_reserve(c, CONNECTION_BUFFER_SIZE - 1) != 0) {
+        connection_close(c);
+        return;
+    }
+
     /* Set timeout for client */
     thread_set_timeout(c->sockfd, 2);
 
+    /* Only the first request waited in the queue, decide on it once */
+    int shed = admission_check(thread_pool_task_wait_ns()) == ADMISSION_SHED;
+    int first_request = 1;
+
     while(1){
-        char buffer[8*1024] = {0};
-        int read_size = read(c->sockfd, buffer, sizeof(buffer) - 1);
-        if (read_size <= 0) {
-            if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                printf("[SERVER] Client read timeout\n");
+        struct http_parser parser;
+        http_parser_init(&parser);
+
+        /* Keep reading until the headers are complete, parsing resumes where it stopped. A pipelined request may already be buffered */
+        int status = c->length > 0 ? http_parser_execute(&parser, c->buffer, c->length) : HTTP_PARSE_INCOMPLETE;
+        while (status == HTTP_PARSE_INCOMPLETE) {
+            if (connection_read(c) <= 0) {
+                if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                    printf("[SERVER] Client read timeout\n");
+                }
+                connection_close(c);
+                return;
             }
-            close(c->sockfd);
-            free(c);
+            status = http_parser_execute(&parser, c->buffer, c->length);
+        }
+
+        if (status == HTTP_PARSE_ERROR) {
+            connection_reject(c, bad_request_response, sizeof(bad_request_response) - 1);
+            return;
+        }
+
+        /* Only chunked is understood, and a Content-Length next to it could frame the request differently */
+        const char *content_length = http_parser_get_header(&parser, c->buffer, "Content-Length");
+        const char *transfer_encoding = http_parser_get_header(&parser, c->buffer, "Transfer-Encoding");
+        long body_length = connection_content_length(content_length);
+        if (body_length < 0 || (transfer_encoding && (content_length || strcasecmp(transfer_encoding, "chunked") != 0))) {
+            connection_reject(c, bad_request_response, sizeof(bad_request_response) - 1);
+            return;
+        }
+        c->body = parser.body;
+        c->body_length = body_length;
+        c->body_consumed = 0;
+        c->continued = 0;
+        c->chunked = transfer_encoding != NULL;
+        chunked_init(&c->chunk);
+        c->chunk_raw = parser.body;
+        c->chunk_window = 0;
+        c->chunk_served = 0;
+
+        /**
+         * Make room for a body that may be buffered, the buffer can move so this
+         * is done before pointers are handed out. Larger bodies are only
+         * accepted by streaming routes and never enter the buffer.
+         */
+        size_t reserve = c->chunked ? REQUEST_CHUNK_WINDOW : (size_t)body_length;
+        if (reserve <= max_body_size && connection_reserve(c, parser.body + reserve) != 0) {
+            connection_close(c);
+            return;
+        }
+        if (c->chunked && connection_chunked_decode(c) < 0) {
+            connection_reject(c, bad_request_response, sizeof(bad_request_response) - 1);
             return;
         }
-        buffer[read_size] = '\0';
 
-        struct timespec start, end;
+        struct timespec start;
         clock_gettime(CLOCK_MONOTONIC, &start);
 
-        struct http_request req;
+        struct http_request req = {0};
         req.tid = pthread_self();
+        req.arena = &c->arena;
 
-        http_parse(buffer, &req);
+        /* The first request has been waiting since accept, later ones since they were read */
+        req.received = first_request ? c->accepted : start;
+        first_request = 0;
 
-        /* Read the rest of the request */
-        while (req.content_length > read_size) {
-            ret = read(c->sockfd, buffer + read_size, sizeof(buffer) - read_size - 1);
-            if (ret <= 0) {
-                /* Client disconnected */
-                close(c->sockfd);
-                free(c);
-                return;
-            }
+        if (http_request_init(&req, &parser, c->buffer) != 0) {
+            thread_clean_up(&req, NULL);
+            connection_reject(c, bad_request_response, sizeof(bad_request_response) - 1);
+            return;
+        }
 
-            read_size += ret;
-            buffer[read_size] = '\0';
+        /* Filled by the gateway unless the route streams the body */
+        req.body = NULL;
+        req.read = c->chunked ? connection_chunked_read : connection_body_read;
+        req.connection = c;
+        if (c->chunked) {
+            req.content_length = -1;
         }
-        req.body = strdup(strstr(buffer, "\r\n\r\n") + 4);
 
-        http_parse_data(&req);
+        /* Close when the client asked to or all threads are in use, a 1.0 client has to be told we keep it open */
+        int flags = req.http10 ? HTTP_RESPONSE_HTTP10 : 0;
+        if (req.method == HTTP_HEAD) {
+            flags |= HTTP_RESPONSE_NO_BODY;
+        }
+        if (req.close || thread_pool_is_full(pool)) {
+            flags |= HTTP_RESPONSE_CLOSE;
+        } else if (req.keep_alive) {
+            flags |= HTTP_RESPONSE_KEEP_ALIVE;
+        }
 
         struct http_response res;
-        res.headers = map_create(32);
-        if (res.headers == NULL) {
-            perror("[ERROR] Error creating map");
-            close(c->sockfd);
-            free(c);
+        if (http_response_init(&res, c->sockfd, &c->arena, &c->batch, flags) != 0) {
+            perror("[ERROR] Error creating response");
+            thread_clean_up(&req, &res);
+            connection_close(c);
             return;
         }
-
-        res.body = (char *)malloc(HTTP_RESPONSE_SIZE);
-        if (res.body == NULL) {
-            perror("[ERROR] Error allocating memory for response body");
-            close(c->sockfd);
-            free(c);
+        res.defer = connection_defer;
+        c->deferred_lock = NULL;
+
+        int result = gateway(c, &req, &res, shed);
+        if (result == GATEWAY_SHED) {
+            metric_add(metric_shed, 1);
+            thread_clean_up(&req, &res);
+            connection_reject(c, shed_response, sizeof(shed_response) - 1);
             return;
         }
+        shed = 0;
 
-        gateway(c->sockfd, &req, &res);
+        if (result == GATEWAY_PARKED) {
+            if (!silent)
+                printf("[%ld] Event stream %s subscribed\n", (long)req.tid, req.path);
+            thread_clean_up(&req, &res);
+            connection_release(c);
+            return;
+        }
 
-        char headers[4*1024] = {0};
-        /* If all threads are in use, send close */
-        if(thread_pool_is_full(pool)) {
-            map_insert(res.headers, "Connection", "close");
+        if (result == GATEWAY_DEFERRED) {
+            /* The connection belongs to the response now, it may be finished before this returns. The loop cannot flush */
+            c->deferred_start = start;
+            if (response_batch_flush(&c->batch, c->sockfd) != 0) {
+                perror("[ERROR] Error writing to socket");
+            }
+            deferred_park(res.deferred, c);
+            return;
         }
-        build_headers(&res, headers, sizeof(headers));
-        
-        char response[8*1024] = {0};
-        snprintf(response, sizeof(response), HTTP_VERSION" %s\r\n%sContent-Length: %lu\r\n\r\n%s", http_errors[res.status], headers, strlen(res.body), res.body);
-        ret = write(c->sockfd, response, strlen(response));
-        if (ret < 0) {
-            perror("[ERROR] Error writing to socket");
+
+        if (connection_respond(c, &req, &res, &start) != 0) {
+            return;
         }
+    }
 
-        double time_taken;
-        measure_time(&start, &end, &time_taken);
+    connection_close(c);
+    return;
+}
 
-        if (!silent)
-            printf("[%ld] %s - Request %s %s took %f seconds.\n", (long)req.tid, http_errors[res.status], http_methods[req.method], req.path, time_taken);
+/**
+ * Send a completed deferred response on a worker of the connection's node.
+ * Unread body is not drained, and a connection that stays open goes on with
+ * its next request here. The module stays pinned until the response is sent.
+ */
+static void connection_deferred_send(void *arg) {
+    struct connection *c = arg;
+    struct http_deferred *deferred = c->deferred;
+    struct http_request *req = &deferred->req;
+    struct http_response *res = &deferred->res;
+    pthread_rwlock_t *lock = c->deferred_lock;
+
+    if (c->deferred_flags & ETAG) {
+        http_response_etag(req, res);
+    }
+    compress_response(req, res, c->deferred_route ? c->deferred_route : req->path);
 
-        char* ac = map_get(res.headers, "Sec-WebSocket-Accept");
-        if (ac) free(ac);
+    if (c->chunked ? c->chunk.state != CHUNK_DONE : c->body_consumed < c->body_length) {
+        res->flags |= HTTP_RESPONSE_CLOSE;
+    }
+    int ret = connection_respond(c, req, res, &c->deferred_start);
+    route_unpin(lock);
+    deferred_free(deferred);
+    if (ret != 0) {
+        return;
+    }
 
-        thread_clean_up(&req, &res);
+    clock_gettime(CLOCK_MONOTONIC, &c->accepted);
+    thread_handle_client(c);
+}
 
-        if (req.websocket) {
-            ws_confirm_open(c->sockfd);
-        }
+/* Completed after its deadline, the client is gone and the handler has let go */
+static void connection_deferred_release(void *arg) {
+    struct connection *c = arg;
+    struct http_deferred *deferred = c->deferred;
+    pthread_rwlock_t *lock = c->deferred_lock;
 
-        if (thread_pool_is_full(pool)) {
-            close(c->sockfd);
-            free(c);
-            return;
+    thread_clean_up(&deferred->req, &deferred->res);
+    connection_release(c);
+    route_unpin(lock);
+    deferred_free(deferred);
+}
+
+/**
+ * Event loop side of a deferred response. Nothing here may block the loop, so
+ * sending and releasing go to a worker. A missed deadline only answers 503 and
+ * closes the socket, the handler may still write to req and res.
+ */
+static void connection_deferred_finish(struct http_deferred *deferred, void *owner, deferred_outcome_t outcome) {
+    struct connection *c = owner;
+    c->deferred = deferred;
+
+    if (outcome == DEFERRED_EXPIRE) {
+        metric_add(metric_deadline_expired, 1);
+        if (send(c->sockfd, deadline_response, sizeof(deadline_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            perror("[ERROR] Error writing to socket");
         }
+        close(c->sockfd);
+        c->sockfd = -1;
+        return;
     }
-
-    close(c->sockfd);
-    free(c);
-    return;
+    thread_pool_add_task_node(pool, outcome == DEFERRED_SEND ? connection_deferred_send : connection_deferred_release, c, c->node);
 }
 
 #define INIT_OPTIONS (OPENSSL_INIT_NO_ATEXIT)
@@ -355,14 +1158,79 @@ int main(int argc, char *argv[]) {
     (void)allowed_management_commands;
     (void)allowed_ip_prefixes;
 
-    /* Check for --silent flag */
-    if (argc > 1 && strcmp(argv[1], "--silent") == 0) {
-        silent = 1;
-    }
-
     int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
     printf("[SERVER] Detected %d cores\n", num_cores);
 
+    /* Pool grows and shrinks between these, defaults to 2 to 8 times numbers of cores */
+    int min_threads = num_cores*2;
+    int max_threads = num_cores*8;
+    int numa = 0;
+    int queue_delay_target = 5;
+    int queue_delay_interval = 100;
+
+    static const struct option options[] = {
+        {"silent", no_argument, NULL, 's'},
+        {"min-threads", required_argument, NULL, 'm'},
+        {"max-threads", required_argument, NULL, 'M'},
+        {"numa", no_argument, NULL, 'n'},
+        {"queue-delay-target", required_argument, NULL, 't'},
+        {"queue-delay-interval", required_argument, NULL, 'i'},
+        {"max-body-size", required_argument, NULL, 'b'},
+        {"max-upload-size", required_argument, NULL, 'u'},
+        {"static", required_argument, NULL, 'S'},
+        {"compression-level", required_argument, NULL, 'z'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"coalesce-timeout", required_argument, NULL, 'C'},
+        {"cors-origin", required_argument, NULL, 'O'},
+        {"coroutine-stack", required_argument, NULL, 'k'},
+        {"coroutines", required_argument, NULL, 'K'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 's': silent = 1; break;
+            case 'm': min_threads = atoi(optarg); break;
+            case 'M': max_threads = atoi(optarg); break;
+            case 'n': numa = 1; break;
+            case 't': queue_delay_target = atoi(optarg); break;
+            case 'i': queue_delay_interval = atoi(optarg); break;
+            case 'b': max_body_size = strtoul(optarg, NULL, 10); break;
+            case 'u': max_upload_size = strtoul(optarg, NULL, 10); break;
+            case 'z': compress_set_level(atoi(optarg)); break;
+            case 'c': cache_set_size(strtoul(optarg, NULL, 10)); break;
+            case 'C': coalesce_set_timeout(atoi(optarg)); break;
+            case 'O': cors_origin = optarg; break;
+            case 'k': coroutine_set_stack_size(strtoul(optarg, NULL, 10)); break;
+            case 'K': coroutine_set_limit(atoi(optarg)); break;
+            case 'S': {
+                /* PREFIX=DIR, e.g. /static=static */
+                char *dir = strchr(optarg, '=');
+                if (dir == NULL) {
+                    fprintf(stderr, "[ERROR] --static expects PREFIX=DIR\n");
+                    exit(EXIT_FAILURE);
+                }
+                *dir++ = '\0';
+                if (static_mount(optarg, dir) != 0) {
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            default:
+                fprintf(stderr, "Usage: %s [--silent] [--min-threads N] [--max-threads N] [--numa]"
+                    " [--queue-delay-target MS] [--queue-delay-interval MS]"
+                    " [--max-body-size BYTES] [--max-upload-size BYTES] [--static PREFIX=DIR]"
+                    " [--compression-level 1-9] [--cache-size BYTES]"
+                    " [--coalesce-timeout MS] [--cors-origin ORIGIN]"
+                    " [--coroutine-stack BYTES] [--coroutines N]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (max_threads < min_threads) {
+        max_threads = min_threads;
+    }
+
     CRYPTO_ONCE openssl_once = CRYPTO_ONCE_STATIC_INIT;
     if (!CRYPTO_THREAD_run_once(&openssl_once, openssl_init_wrapper)) {
         fprintf(stderr, "[ERROR] Failed to run OpenSSL initialization\n");
@@ -376,14 +1244,25 @@ int main(int argc, char *argv[]) {
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
 
+    /* Topology-aware mode pins workers and the event loop and keeps connections on their node */
+    if (numa && topology_init() == 0) {
+        ws_pin_event_thread(topology_worker_cpu(0));
+    }
+
+    admission_init(queue_delay_target, queue_delay_interval);
+    deferred_set_finish(connection_deferred_finish);
+    metric_shed = metric_get("admission_shed_total");
+    metric_deadline_expired = metric_get("deadline_expired_total");
+
     struct connection s = server_init(8080);
 
-    /* Initialize thread pool, 2 times numbers of cores */
-    pool = thread_pool_init(num_cores*2);
+    /* Initialize elastic thread pool */
+    pool = thread_pool_init(min_threads, max_threads);
     if (pool == NULL) {
         fprintf(stderr, "[ERROR] Failed to initialize thread pool\n");
         return 1;
     }
+    coroutine_init(pool);
 
     /* Main server loop */
     while (!stop) {
@@ -397,7 +1276,7 @@ int main(int argc, char *argv[]) {
         }
 
         /* Add client handling task to the thread pool */
-        thread_pool_add_task(pool, thread_handle_client, client);
+        thread_pool_add_task_node(pool, thread_handle_client, client, client->node);
     }
 
     /* Clean up */
@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include <sse.h>
+#include <map.h>
+#include <libevent.h>
+#include <metrics.h>
+
+/* Wire form of one event, written once and shared by the replay ring and every subscriber backlog */
+struct sse_event {
+    atomic_int refs;
+    long id;
+    size_t length;
+    char data[];
+};
+
+struct sse_client {
+    int fd;
+    int dead;              /* Shut down, the event loop sees the hangup and frees it */
+    struct event *ev;
+    struct sse_channel *channel;
+    struct sse_event *backlog[SSE_CLIENT_BACKLOG];
+    size_t head;
+    size_t count;
+    size_t offset;         /* Bytes of the oldest backlog event already sent */
+    time_t last_write;
+    struct sse_client *next;
+};
+
+/* Subscribers and recent events of one path, everything below is under lock */
+struct sse_channel {
+    pthread_mutex_t lock;
+    long last_id;
+    struct sse_event *replay[SSE_REPLAY_MAX];
+    size_t replay_head;
+    size_t replay_count;
+    struct sse_client *clients;
+    int subscribers;
+};
+
+static long sse_publish(const char *path, const char *event, const char *data);
+static int sse_subscribers(const char *path);
+
+static struct sse internal_sse = {
+    .publish = sse_publish,
+    .subscribers = sse_subscribers,
+};
+__attribute__((visibility("default"))) struct sse* exposed_sse = &internal_sse;
+
+static struct map *channels = NULL;
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Comment line sent to idle subscribers, never freed */
+static struct sse_event *heartbeat = NULL;
+
+static pthread_t ticker_thread;
+static pthread_mutex_t ticker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ticker_cond;
+static int ticker_running = 0;
+
+static struct metric *metric_subscribers;
+static struct metric *metric_events;
+static struct metric *metric_dropped;
+
+static time_t sse_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static struct sse_event *sse_event_alloc(size_t size) {
+    struct sse_event *ev = malloc(sizeof(struct sse_event) + size);
+    if (ev == NULL) {
+        return NULL;
+    }
+    atomic_init(&ev->refs, 1);
+    ev->id = 0;
+    ev->length = 0;
+    return ev;
+}
+
+static void sse_event_put(struct sse_event *ev) {
+    if (atomic_fetch_sub(&ev->refs, 1) == 1) {
+        free(ev);
+    }
+}
+
+/* id, optional event name and one data: line per line of data, any of CR, LF or CRLF ends a line */
+static struct sse_event *sse_event_create(long id, const char *event, const char *data) {
+    size_t lines = 1;
+    for (const char *p = data; *p; p++) {
+        if (*p == '\n' || (*p == '\r' && p[1] != '\n')) {
+            lines++;
+        }
+    }
+
+    size_t size = 32 + (event ? strlen(event) + 8 : 0) + strlen(data) + lines * 7 + 3;
+    struct sse_event *ev = sse_event_alloc(size);
+    if (ev == NULL) {
+        return NULL;
+    }
+
+    char *cursor = ev->data + sprintf(ev->data, "id: %ld\n", id);
+    if (event) {
+        cursor += sprintf(cursor, "event: %s\n", event);
+    }
+    cursor = stpcpy(cursor, "data: ");
+    for (const char *p = data; *p; p++) {
+        if (*p == '\r' || *p == '\n') {
+            if (*p == '\r' && p[1] == '\n') {
+                p++;
+            }
+            cursor = stpcpy(cursor, "\ndata: ");
+        } else {
+            *cursor++ = *p;
+        }
+    }
+    cursor = stpcpy(cursor, "\n\n");
+
+    ev->id = id;
+    ev->length = cursor - ev->data;
+    return ev;
+}
+
+static struct sse_channel *sse_channel_get(const char *path, int create) {
+    pthread_mutex_lock(&channels_lock);
+    struct sse_channel *channel = map_get(channels, path);
+    if (channel == NULL && create) {
+        channel = calloc(1, sizeof(struct sse_channel));
+        if (channel) {
+            pthread_mutex_init(&channel->lock, NULL);
+            if (map_insert(channels, path, channel) != MAP_OK) {
+                pthread_mutex_destroy(&channel->lock);
+                free(channel);
+                channel = NULL;
+            }
+        }
+    }
+    pthread_mutex_unlock(&channels_lock);
+    return channel;
+}
+
+/* Hang up on a client, freeing it is left to the event loop so its callback never sees freed memory */
+static void sse_client_kill(struct sse_client *client) {
+    if (!client->dead) {
+        client->dead = 1;
+        shutdown(client->fd, SHUT_RDWR);
+    }
+}
+
+/* Write as much of the backlog as the socket takes without blocking, caller holds the channel lock */
+static void sse_client_flush(struct sse_client *client, time_t now) {
+    while (client->count > 0 && !client->dead) {
+        struct sse_event *ev = client->backlog[client->head];
+        ssize_t n = send(client->fd, ev->data + client->offset, ev->length - client->offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                sse_client_kill(client);
+            }
+            return;
+        }
+
+        client->last_write = now;
+        client->offset += n;
+        if (client->offset < ev->length) {
+            continue;
+        }
+        client->offset = 0;
+        client->head = (client->head + 1) % SSE_CLIENT_BACKLOG;
+        client->count--;
+        sse_event_put(ev);
+    }
+}
+
+/* Queue a reference to ev, a client that fell a full backlog behind is dropped */
+static void sse_client_push(struct sse_client *client, struct sse_event *ev, time_t now) {
+    if (client->dead) {
+        return;
+    }
+    if (client->count == SSE_CLIENT_BACKLOG) {
+        metric_add(metric_dropped, 1);
+        sse_client_kill(client);
+        return;
+    }
+    atomic_fetch_add(&ev->refs, 1);
+    client->backlog[(client->head + client->count) % SSE_CLIENT_BACKLOG] = ev;
+    client->count++;
+    sse_client_flush(client, now);
+}
+
+static void sse_client_free(struct sse_client *client) {
+    struct sse_channel *channel = client->channel;
+    pthread_mutex_lock(&channel->lock);
+    struct sse_client **link = &channel->clients;
+    while (*link && *link != client) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = client->next;
+        channel->subscribers--;
+        metric_add(metric_subscribers, -1);
+    }
+    pthread_mutex_unlock(&channel->lock);
+
+    event_del(client->ev);
+    event_free(client->ev);
+    close(client->fd);
+    for (size_t i = 0; i < client->count; i++) {
+        sse_event_put(client->backlog[(client->head + i) % SSE_CLIENT_BACKLOG]);
+    }
+    free(client);
+}
+
+/* Subscribers have nothing to say, whatever they send is dropped until the socket closes */
+static void sse_event_callback(struct event *ev, void *arg) {
+    (void)ev;
+    struct sse_client *client = arg;
+    char scratch[512];
+    ssize_t n;
+    while ((n = recv(client->fd, scratch, sizeof(scratch), MSG_DONTWAIT)) > 0 || (n < 0 && errno == EINTR));
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    sse_client_free(client);
+}
+
+static long sse_publish(const char *path, const char *event, const char *data) {
+    /* A line break in the name would end the event early */
+    if (path == NULL || (event && strpbrk(event, "\r\n"))) {
+        return -1;
+    }
+    struct sse_channel *channel = sse_channel_get(path, 1);
+    if (channel == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&channel->lock);
+    long id = channel->last_id + 1;
+    struct sse_event *ev = sse_event_create(id, event, data ? data : "");
+    if (ev == NULL) {
+        pthread_mutex_unlock(&channel->lock);
+        return -1;
+    }
+    channel->last_id = id;
+
+    /* The ring keeps the creation reference, the oldest event makes room */
+    if (channel->replay_count == SSE_REPLAY_MAX) {
+        sse_event_put(channel->replay[channel->replay_head]);
+        channel->replay_head = (channel->replay_head + 1) % SSE_REPLAY_MAX;
+        channel->replay_count--;
+    }
+    channel->replay[(channel->replay_head + channel->replay_count) % SSE_REPLAY_MAX] = ev;
+    channel->replay_count++;
+
+    time_t now = sse_now();
+    for (struct sse_client *client = channel->clients; client; client = client->next) {
+        sse_client_push(client, ev, now);
+    }
+    pthread_mutex_unlock(&channel->lock);
+
+    metric_add(metric_events, 1);
+    return id;
+}
+
+static int sse_subscribers(const char *path) {
+    struct sse_channel *channel = path ? sse_channel_get(path, 0) : NULL;
+    if (channel == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&channel->lock);
+    int count = channel->subscribers;
+    pthread_mutex_unlock(&channel->lock);
+    return count;
+}
+
+/* Blocking write of the response head, the socket is not shared with anyone yet */
+static int sse_write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+int sse_subscribe(int fd, const char *path, const char *last_event_id) {
+    struct sse_channel *channel = sse_channel_get(path, 1);
+    struct sse_client *client = channel ? calloc(1, sizeof(struct sse_client)) : NULL;
+    if (client == NULL) {
+        return -1;
+    }
+    client->fd = fd;
+    client->channel = channel;
+    client->ev = event_new(fd, 0, sse_event_callback, client);
+    if (client->ev == NULL) {
+        free(client);
+        return -1;
+    }
+
+    /* No length, the stream ends when either side closes */
+    char head[256];
+    int length = snprintf(head, sizeof(head),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "X-Accel-Buffering: no\r\n"
+        "\r\n"
+        "retry: %d\n\n", SSE_RETRY_MS);
+    if (sse_write_all(fd, head, length) != 0) {
+        event_free(client->ev);
+        free(client);
+        return -1;
+    }
+
+    /* An id from before a restart is newer than anything here, resend all that is left */
+    char *end = NULL;
+    long after = last_event_id ? strtol(last_event_id, &end, 10) : -1;
+    if (end == last_event_id || after < 0) {
+        after = -1;
+    }
+
+    pthread_mutex_lock(&channel->lock);
+    time_t now = sse_now();
+    client->last_write = now;
+    if (after >= 0) {
+        if (after > channel->last_id) {
+            after = 0;
+        }
+        for (size_t i = 0; i < channel->replay_count; i++) {
+            struct sse_event *ev = channel->replay[(channel->replay_head + i) % SSE_REPLAY_MAX];
+            if (ev->id > after) {
+                sse_client_push(client, ev, now);
+            }
+        }
+    }
+    client->next = channel->clients;
+    channel->clients = client;
+    channel->subscribers++;
+    pthread_mutex_unlock(&channel->lock);
+    metric_add(metric_subscribers, 1);
+
+    if (event_add(client->ev) < 0) {
+        fprintf(stderr, "[ERROR] Failed to add SSE subscriber to event loop\n");
+        sse_client_free(client);
+    }
+    return 0;
+}
+
+/* Retry backlogs and send heartbeats to subscribers that have been quiet */
+static void sse_tick(void) {
+    time_t now = sse_now();
+    pthread_mutex_lock(&channels_lock);
+    for (size_t i = 0; i < map_size(channels); i++) {
+        struct sse_channel *channel = channels->entries[i].value;
+        pthread_mutex_lock(&channel->lock);
+        for (struct sse_client *client = channel->clients; client; client = client->next) {
+            if (client->count > 0) {
+                sse_client_flush(client, now);
+            } else if (now - client->last_write >= SSE_HEARTBEAT) {
+                sse_client_push(client, heartbeat, now);
+            }
+        }
+        pthread_mutex_unlock(&channel->lock);
+    }
+    pthread_mutex_unlock(&channels_lock);
+}
+
+static void *sse_ticker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&ticker_lock);
+    while (ticker_running) {
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += 1;
+        pthread_cond_timedwait(&ticker_cond, &ticker_lock, &until);
+        if (!ticker_running) {
+            break;
+        }
+        pthread_mutex_unlock(&ticker_lock);
+        sse_tick();
+        pthread_mutex_lock(&ticker_lock);
+    }
+    pthread_mutex_unlock(&ticker_lock);
+    return NULL;
+}
+
+__attribute__((constructor)) static void sse_init(void) {
+    channels = map_create(16);
+    heartbeat = sse_event_alloc(4);
+    if (channels == NULL || heartbeat == NULL) {
+        fprintf(stderr, "[ERROR] Failed to create SSE hub\n");
+        exit(EXIT_FAILURE);
+    }
+    heartbeat->length = sprintf(heartbeat->data, ":\n\n");
+
+    metric_subscribers = metric_get("sse_subscribers");
+    metric_events = metric_get("sse_events_total");
+    metric_dropped = metric_get("sse_dropped_total");
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ticker_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    ticker_running = 1;
+    if (pthread_create(&ticker_thread, NULL, sse_ticker, NULL) != 0) {
+        perror("Error creating SSE thread");
+        exit(EXIT_FAILURE);
+    }
+}
+
+__attribute__((destructor)) static void sse_destroy(void) {
+    pthread_mutex_lock(&ticker_lock);
+    ticker_running = 0;
+    pthread_cond_signal(&ticker_cond);
+    pthread_mutex_unlock(&ticker_lock);
+    pthread_join(ticker_thread, NULL);
+
+    /* Hang up on everyone, the sockets close with the process */
+    pthread_mutex_lock(&channels_lock);
+    for (size_t i = 0; i < map_size(channels); i++) {
+        struct sse_channel *channel = channels->entries[i].value;
+        pthread_mutex_lock(&channel->lock);
+        for (struct sse_client *client = channel->clients; client; client = client->next) {
+            sse_client_kill(client);
+        }
+        pthread_mutex_unlock(&channel->lock);
+    }
+    pthread_mutex_unlock(&channels_lock);
+}
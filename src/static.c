@@ -0,0 +1,658 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#endif
+#endif
+
+#include <static.h>
+#include <map.h>
+#include <response.h>
+#include <compress.h>
+
+#define STATIC_PATH_MAX 1024
+#define STATIC_MAX_WATCHES 256
+#define STATIC_HTTP_DATE "%a, %d %b %Y %H:%M:%S GMT"
+
+/* Compressed copy of a whole file, made on first request. Length 0 marks a file that does not shrink */
+struct static_variant {
+    size_t length;
+    char data[];
+};
+
+/* Open file and its metadata, shared by concurrent requests through a reference count */
+struct static_file {
+    int fd;
+    char *data; /* Contents of small files, the descriptor is closed */
+    off_t size;
+    ino_t inode;
+    struct timespec mtime;
+    const char *content_type;
+    char etag[48];
+    char weak_etag[52]; /* For compressed variants */
+    char last_modified[40];
+    int compressible;
+    struct static_variant *variants[COMPRESS_ENCODING_COUNT];
+    int refs;
+};
+
+static struct static_mount {
+    char prefix[128];
+    size_t prefix_length;
+    char dir[256];
+    int dirfd;
+    struct map *files; /* Relative path -> struct static_file, holds one reference */
+    pthread_rwlock_t lock;
+} mounts[STATIC_MAX_MOUNTS];
+static int mount_count = 0;
+
+/* Directories with cached files, events on them drop the affected entries */
+static struct static_watch {
+    int wd;
+    int mount;
+    char dir[STATIC_PATH_MAX]; /* Relative to the mount, empty for its root */
+} watches[STATIC_MAX_WATCHES];
+static int watch_count = 0;
+static int inotify_fd = -1;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct {
+    const char *extension;
+    const char *type;
+} content_types[] = {
+    {".html", "text/html"},
+    {".css", "text/css"},
+    {".js", "application/javascript"},
+    {".json", "application/json"},
+    {".txt", "text/plain"},
+    {".svg", "image/svg+xml"},
+    {".png", "image/png"},
+    {".jpg", "image/jpeg"},
+    {".jpeg", "image/jpeg"},
+    {".gif", "image/gif"},
+    {".ico", "image/x-icon"},
+    {".webp", "image/webp"},
+    {".woff2", "font/woff2"},
+    {".wasm", "application/wasm"},
+    {".pdf", "application/pdf"},
+};
+
+static const char *static_content_type(const char *path) {
+    const char *extension = strrchr(path, '.');
+    if (extension && strchr(extension, '/') == NULL) {
+        for (size_t i = 0; i < sizeof(content_types) / sizeof(content_types[0]); i++) {
+            if (strcasecmp(extension, content_types[i].extension) == 0) {
+                return content_types[i].type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+static void static_file_release(void *arg) {
+    struct static_file *file = arg;
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    if (file->fd >= 0) {
+        close(file->fd);
+    }
+    free(file->data);
+    for (int i = 0; i < COMPRESS_ENCODING_COUNT; i++) {
+        free(file->variants[i]);
+    }
+    free(file);
+}
+
+static void static_invalidate(struct static_mount *mount, const char *key) {
+    pthread_rwlock_wrlock(&mount->lock);
+    struct static_file *file = map_get(mount->files, key);
+    if (file) {
+        map_remove(mount->files, key);
+        static_file_release(file);
+    }
+    pthread_rwlock_unlock(&mount->lock);
+}
+
+static void static_invalidate_all(struct static_mount *mount) {
+    pthread_rwlock_wrlock(&mount->lock);
+    for (size_t i = 0; mount->files && i < map_size(mount->files); i++) {
+        static_file_release(mount->files->entries[i].value);
+    }
+    map_destroy(mount->files);
+    mount->files = map_create(64);
+    pthread_rwlock_unlock(&mount->lock);
+}
+
+#ifdef __linux__
+static void static_watch_event(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        for (int i = 0; i < mount_count; i++) {
+            static_invalidate_all(&mounts[i]);
+        }
+        return;
+    }
+
+    char key[STATIC_PATH_MAX];
+    int mount = -1;
+
+    pthread_mutex_lock(&watch_lock);
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].wd != event->wd) {
+            continue;
+        }
+        mount = watches[i].mount;
+        snprintf(key, sizeof(key), "%s%s%s", watches[i].dir, watches[i].dir[0] ? "/" : "", event->len ? event->name : "");
+        if (event->mask & IN_IGNORED) {
+            watches[i] = watches[--watch_count];
+        }
+        break;
+    }
+    pthread_mutex_unlock(&watch_lock);
+
+    if (mount < 0) {
+        return;
+    }
+
+    /* A directory changed or went away, its cached files may now resolve elsewhere */
+    if (event->mask & (IN_ISDIR | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF) || event->len == 0) {
+        static_invalidate_all(&mounts[mount]);
+        return;
+    }
+    static_invalidate(&mounts[mount], key);
+}
+
+static void *static_watch_thread(void *arg) {
+    (void)arg;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            if (length < 0 && errno == EINTR) continue;
+            break;
+        }
+
+        for (char *p = buffer; p < buffer + length; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            static_watch_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return NULL;
+}
+
+/* Watch the directory holding key, -1 if changes to it would go unnoticed */
+static int static_watch(int mount, const char *key) {
+    if (inotify_fd < 0) {
+        return -1;
+    }
+
+    char dir[STATIC_PATH_MAX], path[STATIC_PATH_MAX + 256];
+    const char *slash = strrchr(key, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - key) : 0, key);
+    snprintf(path, sizeof(path), "%s/%s", mounts[mount].dir, dir);
+
+    pthread_mutex_lock(&watch_lock);
+    int wd = inotify_add_watch(inotify_fd, path, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+        | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    int ret = wd < 0 ? -1 : 0;
+    if (wd >= 0) {
+        int known = 0;
+        for (int i = 0; i < watch_count; i++) {
+            known |= watches[i].wd == wd;
+        }
+        if (!known && watch_count < STATIC_MAX_WATCHES) {
+            watches[watch_count++] = (struct static_watch){ .wd = wd, .mount = mount };
+            snprintf(watches[watch_count - 1].dir, sizeof(watches[0].dir), "%s", dir);
+        } else if (!known) {
+            inotify_rm_watch(inotify_fd, wd);
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return ret;
+}
+#else
+static int static_watch(int mount, const char *key) {
+    (void)mount;
+    (void)key;
+    return -1;
+}
+#endif
+
+/**
+ * Open beneath the mount directory, symlinks and ".." cannot escape it.
+ * Without openat2 every directory is opened on its own with O_NOFOLLOW, since a
+ * single openat would still follow symlinks in the leading components.
+ * Keys come from static_resolve and have no empty, "." or ".." segments.
+ */
+static int static_open(int dirfd, const char *path) {
+#if defined(__linux__) && defined(SYS_openat2) && defined(RESOLVE_BENEATH)
+    struct open_how how = {
+        .flags = O_RDONLY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    int fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS) {
+        return fd;
+    }
+#endif
+    char segment[STATIC_PATH_MAX];
+    int parent = dirfd;
+    const char *slash;
+    while ((slash = strchr(path, '/')) != NULL) {
+        snprintf(segment, sizeof(segment), "%.*s", (int)(slash - path), path);
+        int child = openat(parent, segment, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_DIRECTORY);
+        if (parent != dirfd) {
+            close(parent);
+        }
+        if (child < 0) {
+            return -1;
+        }
+        parent = child;
+        path = slash + 1;
+    }
+
+    int file = openat(parent, path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (parent != dirfd) {
+        close(parent);
+    }
+    return file;
+}
+
+static struct static_file *static_file_open(struct static_mount *mount, const char *key) {
+    int fd = static_open(mount->dirfd, key);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    struct static_file *file = calloc(1, sizeof(struct static_file));
+    if (file == NULL) {
+        close(fd);
+        return NULL;
+    }
+    file->fd = fd;
+    file->size = st.st_size;
+    file->inode = st.st_ino;
+    file->mtime = st.st_mtim;
+    file->content_type = static_content_type(key);
+    file->refs = 1;
+    snprintf(file->etag, sizeof(file->etag), "\"%llx-%llx\"", (unsigned long long)st.st_mtime, (unsigned long long)st.st_size);
+    snprintf(file->weak_etag, sizeof(file->weak_etag), "W/%s", file->etag);
+    file->compressible = compress_content_type_allowed(file->content_type) && st.st_size >= COMPRESS_MIN_SIZE && st.st_size <= COMPRESS_MAX_SIZE;
+
+    struct tm tm;
+    gmtime_r(&st.st_mtime, &tm);
+    strftime(file->last_modified, sizeof(file->last_modified), STATIC_HTTP_DATE, &tm);
+
+    /* Small files go out in the same writev as the headers */
+    if (st.st_size <= STATIC_MEMORY_MAX) {
+        file->data = malloc(st.st_size + 1);
+        if (file->data && pread(fd, file->data, st.st_size, 0) == st.st_size) {
+            close(fd);
+            file->fd = -1;
+        } else {
+            free(file->data);
+            file->data = NULL;
+        }
+    }
+    return file;
+}
+
+/* Without inotify a cached entry is checked against the file on every hit */
+static int static_file_fresh(struct static_mount *mount, const char *key, const struct static_file *file) {
+    struct stat st;
+    return fstatat(mount->dirfd, key, &st, 0) == 0 && st.st_ino == file->inode && st.st_size == file->size
+        && st.st_mtim.tv_sec == file->mtime.tv_sec && st.st_mtim.tv_nsec == file->mtime.tv_nsec;
+}
+
+/* Cached file for key with a reference for the caller, NULL if it cannot be served */
+static struct static_file *static_lookup(int index, const char *key) {
+    struct static_mount *mount = &mounts[index];
+
+    pthread_rwlock_rdlock(&mount->lock);
+    struct static_file *file = map_get(mount->files, key);
+    if (file) {
+        __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&mount->lock);
+
+    if (file) {
+        if (inotify_fd >= 0 || static_file_fresh(mount, key, file)) {
+            return file;
+        }
+        static_file_release(file);
+        static_invalidate(mount, key);
+    }
+
+    /* Watch before opening so a change in between is not missed */
+    int watched = static_watch(index, key) == 0;
+    file = static_file_open(mount, key);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    pthread_rwlock_wrlock(&mount->lock);
+    struct static_file *cached = map_get(mount->files, key);
+    if (cached) {
+        /* Another request got here first */
+        __atomic_add_fetch(&cached->refs, 1, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&mount->lock);
+        static_file_release(file);
+        return cached;
+    }
+    if ((watched || inotify_fd < 0) && mount->files && map_size(mount->files) < STATIC_CACHE_MAX && map_insert(mount->files, key, file) == 0) {
+        file->refs++;
+    }
+    pthread_rwlock_unlock(&mount->lock);
+    return file;
+}
+
+/* Percent-decode the path below the mount and refuse anything that is not a plain relative path */
+static int static_resolve(const char *path, char *key, size_t size) {
+    while (*path == '/') {
+        path++;
+    }
+
+    size_t length = 0;
+    for (const char *p = path; *p; p++) {
+        char c = *p;
+        if (c == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+            char hex[3] = { p[1], p[2], '\0' };
+            c = (char)strtol(hex, NULL, 16);
+            p += 2;
+        }
+        if (c == '\0' || c == '\\' || length + 1 >= size) {
+            return -1;
+        }
+        key[length++] = c;
+    }
+    key[length] = '\0';
+
+    /* Directories serve their index */
+    if (length == 0 || key[length - 1] == '/') {
+        if (length + sizeof(STATIC_INDEX) > size) {
+            return -1;
+        }
+        memcpy(key + length, STATIC_INDEX, sizeof(STATIC_INDEX));
+    }
+
+    for (const char *segment = key; segment; ) {
+        const char *end = strchr(segment, '/');
+        size_t segment_length = end ? (size_t)(end - segment) : strlen(segment);
+        if (segment_length == 0 || (segment[0] == '.' && (segment_length == 1 || (segment_length == 2 && segment[1] == '.')))) {
+            return -1;
+        }
+        segment = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+static int static_parse_date(const char *value, time_t *time) {
+    struct tm tm = {0};
+    const char *end = strptime(value, STATIC_HTTP_DATE, &tm);
+    if (end == NULL) {
+        return -1;
+    }
+    *time = timegm(&tm);
+    return 0;
+}
+
+static int static_not_modified(const struct http_request *req, const struct static_file *file) {
+    const char *if_none_match = http_header(req, HTTP_HEADER_IF_NONE_MATCH);
+    if (if_none_match) {
+        return http_etag_match(if_none_match, file->etag);
+    }
+
+    time_t since;
+    const char *if_modified_since = http_header(req, HTTP_HEADER_IF_MODIFIED_SINCE);
+    return if_modified_since && static_parse_date(if_modified_since, &since) == 0 && file->mtime.tv_sec <= since;
+}
+
+/**
+ * Single byte range from the Range header.
+ * @return 1 for a range, 0 to send the whole file, -1 if not satisfiable
+ */
+static int static_range(const struct http_request *req, const struct static_file *file, off_t *start, off_t *length) {
+    const char *range = http_header(req, HTTP_HEADER_RANGE);
+    if (range == NULL || strncmp(range, "bytes=", 6) != 0 || strchr(range, ',')) {
+        return 0;
+    }
+
+    /* A stale validator means the client wants the whole new file */
+    const char *if_range = http_header(req, HTTP_HEADER_IF_RANGE);
+    if (if_range) {
+        time_t date;
+        if (if_range[0] == '"' ? strcmp(if_range, file->etag) != 0
+                : static_parse_date(if_range, &date) != 0 || date != file->mtime.tv_sec) {
+            return 0;
+        }
+    }
+
+    const char *spec = range + 6;
+    char *end;
+    if (*spec == '-') {
+        long long suffix = strtoll(spec + 1, &end, 10);
+        if (end == spec + 1 || *end != '\0') return 0;
+        if (suffix <= 0 || file->size == 0) return -1;
+        if (suffix > file->size) suffix = file->size;
+        *start = file->size - suffix;
+        *length = suffix;
+        return 1;
+    }
+
+    long long first = strtoll(spec, &end, 10);
+    if (end == spec || *end != '-' || first < 0) return 0;
+    const char *last_spec = end + 1;
+    long long last = file->size - 1;
+    if (*last_spec) {
+        last = strtoll(last_spec, &end, 10);
+        if (end == last_spec || *end != '\0' || last < first) return 0;
+        if (last >= file->size) last = file->size - 1;
+    }
+    if (first >= file->size) return -1;
+
+    *start = first;
+    *length = last - first + 1;
+    return 1;
+}
+
+/* Compressed variant of the file, made once and kept until the file changes */
+static struct static_variant *static_variant(const struct static_mount *mount, struct static_file *file, compress_encoding_t encoding) {
+    struct static_variant *variant = __atomic_load_n(&file->variants[encoding], __ATOMIC_ACQUIRE);
+    if (variant) {
+        return variant->length ? variant : NULL;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+    const char *contents = file->data;
+    char *loaded = NULL;
+    if (contents == NULL) {
+        loaded = malloc(file->size);
+        if (loaded == NULL || pread(file->fd, loaded, file->size, 0) != file->size) {
+            free(loaded);
+            return NULL;
+        }
+        contents = loaded;
+    }
+
+    char *compressed;
+    size_t length = compress_buffer(encoding, 1, contents, file->size, &compressed);
+    free(loaded);
+
+    variant = malloc(sizeof(struct static_variant) + length);
+    if (variant == NULL) {
+        free(compressed);
+        return NULL;
+    }
+    variant->length = length;
+    if (length) {
+        memcpy(variant->data, compressed, length);
+        compress_account(mount->prefix, file->size, length, &start);
+    }
+    free(compressed);
+
+    /* Concurrent first hits may both compress, one result is kept */
+    struct static_variant *expected = NULL;
+    if (!__atomic_compare_exchange_n(&file->variants[encoding], &expected, variant, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(variant);
+        variant = expected;
+    }
+    return variant->length ? variant : NULL;
+}
+
+static void static_respond(const struct static_mount *mount, struct http_request *req, struct http_response *res, struct static_file *file) {
+    /* Ranges are served from the identity encoding */
+    struct static_variant *variant = NULL;
+    compress_encoding_t encoding = COMPRESS_IDENTITY;
+    if (file->compressible) {
+        http_response_vary(res, "Accept-Encoding");
+        encoding = http_header(req, HTTP_HEADER_RANGE) ? COMPRESS_IDENTITY : compress_negotiate(req);
+        variant = encoding != COMPRESS_IDENTITY ? static_variant(mount, file, encoding) : NULL;
+    }
+
+    map_insert(res->headers, "Content-Type", (char *)file->content_type);
+    map_insert(res->headers, "ETag", variant ? file->weak_etag : file->etag);
+    map_insert(res->headers, "Last-Modified", file->last_modified);
+    map_insert(res->headers, "Accept-Ranges", "bytes");
+
+    if (static_not_modified(req, file)) {
+        res->status = HTTP_304_NOT_MODIFIED;
+        return;
+    }
+
+    if (variant) {
+        map_insert(res->headers, "Content-Encoding", (char *)compress_encodings[encoding]);
+        res->status = HTTP_200_OK;
+        res->file.data = variant->data;
+        res->file.length = variant->length;
+        return;
+    }
+
+    off_t start = 0, length = file->size;
+    int range = static_range(req, file, &start, &length);
+    if (range < 0) {
+        char *content_range = arena_alloc(req->arena, 64);
+        if (content_range) {
+            snprintf(content_range, 64, "bytes */%lld", (long long)file->size);
+            map_insert(res->headers, "Content-Range", content_range);
+        }
+        res->status = HTTP_416_RANGE_NOT_SATISFIABLE;
+        return;
+    }
+    if (range > 0) {
+        char *content_range = arena_alloc(req->arena, 96);
+        if (content_range) {
+            snprintf(content_range, 96, "bytes %lld-%lld/%lld", (long long)start, (long long)(start + length - 1), (long long)file->size);
+            map_insert(res->headers, "Content-Range", content_range);
+        }
+        res->status = HTTP_206_PARTIAL_CONTENT;
+    } else {
+        res->status = HTTP_200_OK;
+    }
+
+    res->file.fd = file->fd;
+    res->file.data = file->data;
+    res->file.offset = start;
+    res->file.length = length;
+}
+
+int static_serve(struct http_request *req, struct http_response *res) {
+    if (req->method != HTTP_GET && req->method != HTTP_HEAD) {
+        return STATIC_NO_MOUNT;
+    }
+
+    for (int i = 0; i < mount_count; i++) {
+        struct static_mount *mount = &mounts[i];
+        const char *rest = req->path + mount->prefix_length;
+        if (strncmp(req->path, mount->prefix, mount->prefix_length) != 0 || (*rest != '/' && *rest != '\0')) {
+            continue;
+        }
+
+        char key[STATIC_PATH_MAX];
+        struct static_file *file = static_resolve(rest, key, sizeof(key)) == 0 ? static_lookup(i, key) : NULL;
+        if (file == NULL) {
+            http_response_error(res, HTTP_404_NOT_FOUND);
+            return STATIC_SERVED;
+        }
+
+        /* The reference is dropped once the response has been sent */
+        res->file.release = static_file_release;
+        res->file.arg = file;
+        static_respond(mount, req, res, file);
+        return STATIC_SERVED;
+    }
+    return STATIC_NO_MOUNT;
+}
+
+int static_mount(const char *prefix, const char *dir) {
+    if (mount_count >= STATIC_MAX_MOUNTS) {
+        fprintf(stderr, "[ERROR] Too many static mounts\n");
+        return -1;
+    }
+
+    struct static_mount *mount = &mounts[mount_count];
+    snprintf(mount->prefix, sizeof(mount->prefix), "%s", prefix);
+    mount->prefix_length = strlen(mount->prefix);
+    while (mount->prefix_length > 0 && mount->prefix[mount->prefix_length - 1] == '/') {
+        mount->prefix[--mount->prefix_length] = '\0';
+    }
+    snprintf(mount->dir, sizeof(mount->dir), "%s", dir);
+
+    mount->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (mount->dirfd < 0) {
+        fprintf(stderr, "[ERROR] Cannot open static directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    mount->files = map_create(64);
+    pthread_rwlock_init(&mount->lock, NULL);
+
+#ifdef __linux__
+    if (inotify_fd < 0) {
+        inotify_fd = inotify_init1(IN_CLOEXEC);
+        pthread_t thread;
+        if (inotify_fd >= 0 && pthread_create(&thread, NULL, static_watch_thread, NULL) == 0) {
+            pthread_detach(thread);
+        } else {
+            perror("[ERROR] inotify unavailable, static files are checked on every request");
+            if (inotify_fd >= 0) close(inotify_fd);
+            inotify_fd = -1;
+        }
+    }
+#endif
+
+    mount_count++;
+    printf("[STARTUP] Serving %s at %s\n", dir, mount->prefix[0] ? mount->prefix : "/");
+    return 0;
+}
+
+__attribute__((destructor)) static void static_destroy(void) {
+    for (int i = 0; i < mount_count; i++) {
+        static_invalidate_all(&mounts[i]);
+        map_destroy(mounts[i].files);
+        mounts[i].files = NULL;
+        close(mounts[i].dirfd);
+    }
+}
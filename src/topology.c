@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include <topology.h>
+
+#define TOPOLOGY_MAX_CPUS 1024
+#define NODE_SYSFS "/sys/devices/system/node"
+
+static struct topology {
+    int enabled;
+    int num_cpus;
+    int num_nodes;
+    int cpu_node[TOPOLOGY_MAX_CPUS]; /* Node of each cpu id, -1 if offline */
+    int cpus[TOPOLOGY_MAX_CPUS];     /* Online cpus ordered by node */
+} topology = {0};
+
+/* Parse a sysfs cpulist such as "0-3,8-11" and assign the cpus to a node */
+static void topology_parse_cpulist(const char *list, int node) {
+    const char *cursor = list;
+    while (*cursor && *cursor != '\n') {
+        char *end;
+        long first = strtol(cursor, &end, 10);
+        long last = first;
+        if (end == cursor) break;
+        if (*end == '-') {
+            cursor = end + 1;
+            last = strtol(cursor, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < TOPOLOGY_MAX_CPUS; cpu++) {
+            topology.cpu_node[cpu] = node;
+        }
+        cursor = (*end == ',') ? end + 1 : end;
+    }
+}
+
+static int topology_read_nodes(void) {
+    DIR *dir = opendir(NODE_SYSFS);
+    if (dir == NULL) {
+        return 0;
+    }
+
+    int nodes = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int node;
+        if (sscanf(entry->d_name, "node%d", &node) != 1) {
+            continue;
+        }
+
+        char path[512];
+        snprintf(path, sizeof(path), NODE_SYSFS "/%s/cpulist", entry->d_name);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+
+        char list[1024];
+        if (fgets(list, sizeof(list), fp) != NULL) {
+            topology_parse_cpulist(list, node);
+            if (node + 1 > nodes) nodes = node + 1;
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+    return nodes;
+}
+
+/**
+ * Mark the cpus this process may run on. Under a cpuset (docker --cpuset-cpus)
+ * pinning to any other cpu fails, so those are never handed to workers.
+ */
+static void topology_read_affinity(char *allowed) {
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < TOPOLOGY_MAX_CPUS; cpu++) {
+            allowed[cpu] = cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set);
+        }
+        return;
+    }
+#endif
+    memset(allowed, 1, TOPOLOGY_MAX_CPUS);
+}
+
+/* Discover cpus and nodes and enable topology-aware placement */
+int topology_init(void) {
+    for (int i = 0; i < TOPOLOGY_MAX_CPUS; i++) {
+        topology.cpu_node[i] = -1;
+    }
+
+    topology.num_nodes = topology_read_nodes();
+    if (topology.num_nodes == 0) {
+        /* No NUMA information (or not Linux), treat the machine as a single node */
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long cpu = 0; cpu < online && cpu < TOPOLOGY_MAX_CPUS; cpu++) {
+            topology.cpu_node[cpu] = 0;
+        }
+        topology.num_nodes = 1;
+    }
+
+    char allowed[TOPOLOGY_MAX_CPUS];
+    topology_read_affinity(allowed);
+
+    topology.num_cpus = 0;
+    for (int node = 0; node < topology.num_nodes; node++) {
+        for (int cpu = 0; cpu < TOPOLOGY_MAX_CPUS; cpu++) {
+            if (topology.cpu_node[cpu] == node && allowed[cpu]) {
+                topology.cpus[topology.num_cpus++] = cpu;
+            }
+        }
+    }
+
+    if (topology.num_cpus == 0) {
+        fprintf(stderr, "[ERROR] Failed to discover cpu topology\n");
+        return -1;
+    }
+
+    topology.enabled = 1;
+    printf("[SERVER] Topology-aware mode: %d cpus on %d nodes\n", topology.num_cpus, topology.num_nodes);
+    return 0;
+}
+
+int topology_enabled(void) {
+    return topology.enabled;
+}
+
+int topology_num_nodes(void) {
+    return topology.enabled ? topology.num_nodes : 1;
+}
+
+int topology_cpu_node(int cpu) {
+    if (!topology.enabled || cpu < 0 || cpu >= TOPOLOGY_MAX_CPUS) {
+        return -1;
+    }
+    return topology.cpu_node[cpu];
+}
+
+/* Workers are spread over the cpus node by node, wrapping when oversubscribed */
+int topology_worker_cpu(int index) {
+    if (!topology.enabled) {
+        return -1;
+    }
+    return topology.cpus[index % topology.num_cpus];
+}
+
+int topology_pin_thread(pthread_t thread, int cpu) {
+    if (!topology.enabled || cpu < 0) {
+        return -1;
+    }
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0) {
+        fprintf(stderr, "[ERROR] Failed to pin thread to cpu %d\n", cpu);
+        return -1;
+    }
+    return 0;
+#else
+    /* No hard affinity on this platform */
+    (void)thread;
+    return -1;
+#endif
+}
+
+/* Node of the cpu that received the packets for this socket */
+int topology_socket_node(int fd) {
+    if (!topology.enabled) {
+        return -1;
+    }
+
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0) {
+        return topology_cpu_node(cpu);
+    }
+#else
+    (void)fd;
+#endif
+    return -1;
+}
@@ -11,6 +11,7 @@
 #include <list.h>
 #include <cweb.h>
 #include <libevent.h>
+#include <topology.h>
 
 #define WS_MAX_FRAME_SIZE 2048
 
@@ -398,10 +399,10 @@ static void* ws_event_thread(void* args) {
 }
 
 int http_is_websocket_upgrade(struct http_request *req) {
-    const char *connection = map_get(req->headers, "Connection");
-    const char *upgrade = map_get(req->headers, "Upgrade");
-    
-    if (connection && upgrade && strstr(connection, "Upgrade") && strcmp(upgrade, "websocket") == 0) {
+    const char *connection = http_header(req, HTTP_HEADER_CONNECTION);
+    const char *upgrade = http_header(req, HTTP_HEADER_UPGRADE);
+
+    if (upgrade && http_header_has_token(connection, "upgrade") && strcasecmp(upgrade, "websocket") == 0) {
         return 1;
     }
     
@@ -422,7 +423,7 @@ int ws_confirm_open(int sd){
 void ws_handle_client(int sd, struct http_request *req, struct http_response *res, struct ws_info *info) {
     printf("[WS] Upgrading connection to WebSocket %d\n", sd);
 
-    const char *client_key = map_get(req->headers, "Sec-WebSocket-Key");
+    const char *client_key = http_header(req, HTTP_HEADER_SEC_WEBSOCKET_KEY);
     if (!client_key) {
         fprintf(stderr, "[ERROR] Missing Sec-WebSocket-Key header\n");
         res->status = HTTP_400_BAD_REQUEST;
@@ -443,10 +444,10 @@ void ws_handle_client(int sd, struct http_request *req, struct http_response *re
         return;
     }
 
-    /* Freed by main server */
-    char* accept_key = malloc(128);
+    /* Released with the request */
+    char* accept_key = arena_alloc(req->arena, 128);
     if(!accept_key) {
-        perror("[ERROR] Failed to allocate memory for accept key");
+        fprintf(stderr, "[ERROR] Failed to allocate memory for accept key\n");
         res->status = HTTP_500_INTERNAL_SERVER_ERROR;
         return;
     }
@@ -466,6 +467,11 @@ __attribute__((constructor)) void ws_constructor() {
     printf("[WS] WebSocket thread started\n");
 }
 
+/* Pin the event loop in topology-aware mode, started before options are parsed */
+void ws_pin_event_thread(int cpu) {
+    topology_pin_thread(ws_thread, cpu);
+}
+
 __attribute__((destructor)) void ws_destructor() {
     printf("[WS] Shutting down WebSocket thread\n");
 
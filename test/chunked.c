@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <chunked.h>
+
+/**
+ * Checks the chunked body decoder the way the server drives it: framing
+ * arrives in pieces split anywhere and is decoded in place, so chunk data
+ * moves down over the framing in the same buffer.
+ * Run with "bench" to measure decoding throughput instead.
+ */
+
+#define BUFFER_SIZE 8192
+#define BENCH_BODY (16 * 1024 * 1024)
+#define BENCH_CHUNK 4096
+#define BENCH_READ 1500
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "[FAIL] " __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+/* Wikipedia's example with an extension, a bare LF and trailers, then a pipelined request */
+static const char sample[] =
+    "4\r\nWiki\r\n"
+    "5;name=value;quoted=\"a;b\"\r\npedia\r\n"
+    "e\n in\r\n\r\nchunks.\r\n"
+    "0\r\n"
+    "Expires: never\r\n"
+    "X-Checksum: 1234\r\n"
+    "\r\n";
+static const char sample_body[] = "Wikipedia in\r\n\r\nchunks.";
+static const char pipelined[] = "GET /next HTTP/1.1\r\n\r\n";
+
+struct result {
+    int ret;
+    size_t consumed; /* Framing bytes decoded in total */
+    size_t length;
+    char body[BUFFER_SIZE];
+};
+
+/* Feed input in pieces ending at the cut offsets, decoding in place after each */
+static void decode(const char *input, size_t length, const size_t *cuts, int count, struct result *result) {
+    static char buffer[BUFFER_SIZE];
+    struct chunked_decoder decoder;
+    chunked_init(&decoder);
+
+    size_t filled = 0, raw = 0, decoded = 0;
+    result->ret = 0;
+    for (int i = 0; i <= count && result->ret == 0; i++) {
+        size_t upto = i < count ? cuts[i] : length;
+        memcpy(buffer + filled, input + filled, upto - filled);
+        filled = upto;
+
+        size_t consumed, written;
+        result->ret = chunked_decode(&decoder, buffer + raw, filled - raw, &consumed, buffer + decoded, &written);
+        raw += consumed;
+        decoded += written;
+    }
+    result->consumed = raw;
+    result->length = decoded;
+    memcpy(result->body, buffer, decoded);
+}
+
+static int decode_whole(const char *input, struct result *result) {
+    decode(input, strlen(input), NULL, 0, result);
+    return result->ret;
+}
+
+/* The sample split into up to three reads at every pair of offsets */
+static void splits(void) {
+    char input[sizeof(sample) + sizeof(pipelined)];
+    snprintf(input, sizeof(input), "%s%s", sample, pipelined);
+    size_t length = strlen(input);
+    static struct result result;
+
+    for (size_t first = 0; first <= length; first++) {
+        for (size_t second = first; second <= length; second++) {
+            size_t cuts[2] = { first, second };
+            decode(input, length, cuts, 2, &result);
+            CHECK(result.ret == 1, "split at %zu and %zu returned %d", first, second, result.ret);
+            CHECK(result.length == sizeof(sample_body) - 1 && memcmp(result.body, sample_body, result.length) == 0,
+                  "split at %zu and %zu decoded \"%.*s\"", first, second, (int)result.length, result.body);
+            /* The next request starts right after the trailers */
+            CHECK(result.consumed == sizeof(sample) - 1, "split at %zu and %zu consumed %zu", first, second, result.consumed);
+        }
+    }
+}
+
+/* One byte per read, the worst case for lines that have not arrived */
+static void bytewise(void) {
+    size_t length = sizeof(sample) - 1;
+    size_t cuts[sizeof(sample)];
+    for (size_t i = 0; i < length; i++) {
+        cuts[i] = i;
+    }
+    static struct result result;
+    decode(sample, length, cuts, (int)length, &result);
+    CHECK(result.ret == 1 && result.length == sizeof(sample_body) - 1, "byte by byte returned %d with %zu bytes", result.ret, result.length);
+}
+
+static void extensions(void) {
+    static struct result result;
+    CHECK(decode_whole("3;a\r\nabc\r\n0;last=1\r\n\r\n", &result) == 1 && result.length == 3, "extension on size");
+    CHECK(decode_whole("3;\r\nabc\r\n0\r\n\r\n", &result) == 1 && result.length == 3, "empty extension");
+    CHECK(decode_whole("A\r\n0123456789\r\n0\r\n\r\n", &result) == 1 && result.length == 10, "upper case size");
+    CHECK(decode_whole("0000000000000000003\r\nabc\r\n0\r\n\r\n", &result) == 1 && result.length == 3, "leading zeros");
+    CHECK(decode_whole("0\r\n\r\n", &result) == 1 && result.length == 0, "empty body");
+}
+
+/* Size and trailer lines up to the limit are fine, longer ones fail even before their end arrives */
+static void long_lines(void) {
+    static char input[BUFFER_SIZE];
+    static struct result result;
+
+    int pad = CHUNKED_LINE_MAX - (int)strlen("3;x=\r");
+    snprintf(input, sizeof(input), "3;x=%0*d\r\nabc\r\n0\r\n\r\n", pad, 0);
+    CHECK(decode_whole(input, &result) == 1, "size line of %d bytes rejected", CHUNKED_LINE_MAX);
+
+    snprintf(input, sizeof(input), "3;x=%0*d\r\nabc\r\n0\r\n\r\n", pad + 1, 0);
+    CHECK(decode_whole(input, &result) == -1, "size line of %d bytes accepted", CHUNKED_LINE_MAX + 1);
+
+    snprintf(input, sizeof(input), "3;x=%0*d", CHUNKED_LINE_MAX, 0);
+    CHECK(decode_whole(input, &result) == -1, "unterminated size line of %zu bytes waits for more", strlen(input));
+
+    snprintf(input, sizeof(input), "3;x=%0*d", CHUNKED_LINE_MAX - 10, 0);
+    CHECK(decode_whole(input, &result) == 0, "unterminated short size line rejected");
+
+    snprintf(input, sizeof(input), "0\r\nX-Long: %0*d\r\n\r\n", CHUNKED_LINE_MAX, 0);
+    CHECK(decode_whole(input, &result) == -1, "trailer line of %zu bytes accepted", strlen(input) - 7);
+}
+
+/* Anything but CRLF or LF after the data, whether the line has ended or not */
+static void data_end(void) {
+    static const char *bad[] = {
+        "3\r\nabcX\r\n0\r\n\r\n",
+        "3\r\nabc\rX\n0\r\n\r\n",
+        "3\r\nabc\r\r\n0\r\n\r\n",
+        "3\r\nabcd",
+        "3\r\nabc0\r\n\r\n",
+    };
+    static struct result result;
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        size_t length = strlen(bad[i]);
+        for (size_t cut = 0; cut <= length; cut++) {
+            decode(bad[i], length, &cut, 1, &result);
+            CHECK(result.ret == -1, "missing CRLF in \"%s\" split at %zu returned %d", bad[i], cut, result.ret);
+        }
+    }
+    CHECK(decode_whole("3\r\nabc\n0\n\n", &result) == 1 && result.length == 3, "bare LF after data rejected");
+}
+
+/* Trailer fields are skipped and never reach the body */
+static void trailers(void) {
+    static struct result result;
+    CHECK(decode_whole("2\r\nok\r\n0\r\nA: 1\r\nB: 2\r\n\r\n", &result) == 1 && result.length == 2 && memcmp(result.body, "ok", 2) == 0,
+          "trailers decoded \"%.*s\"", (int)result.length, result.body);
+    CHECK(decode_whole("2\r\nok\r\n0\r\nA: 1\r\n", &result) == 0, "body ended before the empty line");
+
+    /* Done is final, nothing after it is decoded */
+    struct chunked_decoder decoder;
+    chunked_init(&decoder);
+    char buffer[] = "0\r\n\r\n1\r\nx\r\n";
+    size_t consumed, decoded;
+    CHECK(chunked_decode(&decoder, buffer, strlen(buffer), &consumed, buffer, &decoded) == 1 && consumed == 5, "done at %zu", consumed);
+    CHECK(chunked_decode(&decoder, buffer + 5, strlen(buffer) - 5, &consumed, buffer, &decoded) == 1 && consumed == 0 && decoded == 0,
+          "decoded after done");
+}
+
+static void malformed(void) {
+    static const char *bad[] = {
+        "\r\n",
+        "g\r\n",
+        "-1\r\n",
+        "3 \r\nabc\r\n",
+        " 3\r\nabc\r\n",
+        "0x3\r\nabc\r\n",
+        "10000000000000000\r\n",
+        "fffffffffffffffff\r\n",
+        "ffffffffffffffff0\r\n",
+    };
+    static struct result result;
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        CHECK(decode_whole(bad[i], &result) == -1, "\"%s\" accepted", bad[i]);
+    }
+
+    /* The largest size that fits is not an error here, the upload limit stops it */
+    CHECK(decode_whole("ffffffffffffffff\r\n", &result) == 0, "largest chunk size rejected");
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* A large upload in fixed chunks, arriving in reads the size of a TCP segment */
+static void bench(void) {
+    size_t framed = BENCH_BODY + BENCH_BODY / BENCH_CHUNK * 16 + 16;
+    char *input = malloc(framed);
+    char *buffer = malloc(framed);
+    if (input == NULL || buffer == NULL) {
+        perror("[ERROR] Error allocating benchmark buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t length = 0;
+    for (size_t i = 0; i < BENCH_BODY / BENCH_CHUNK; i++) {
+        length += sprintf(input + length, "%x\r\n", BENCH_CHUNK);
+        memset(input + length, 'a', BENCH_CHUNK);
+        length += BENCH_CHUNK;
+        length += sprintf(input + length, "\r\n");
+    }
+    length += sprintf(input + length, "0\r\n\r\n");
+
+    struct chunked_decoder decoder;
+    chunked_init(&decoder);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t filled = 0, raw = 0, decoded = 0;
+    int ret = 0;
+    while (ret == 0 && filled < length) {
+        size_t read = length - filled < BENCH_READ ? length - filled : BENCH_READ;
+        memcpy(buffer + filled, input + filled, read);
+        filled += read;
+
+        size_t consumed, written;
+        ret = chunked_decode(&decoder, buffer + raw, filled - raw, &consumed, buffer + decoded, &written);
+        raw += consumed;
+        decoded += written;
+    }
+    double seconds = seconds_since(&start);
+
+    printf("chunked %d byte chunks in %d byte reads  %6.2f GB/s%s\n", BENCH_CHUNK, BENCH_READ,
+           decoded / seconds / 1e9, ret == 1 && decoded == BENCH_BODY ? "" : "  (decoding failed)");
+    free(input);
+    free(buffer);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench();
+        return 0;
+    }
+
+    splits();
+    bytewise();
+    extensions();
+    long_lines();
+    data_end();
+    trailers();
+    malformed();
+
+    printf("[TEST] chunked: %s\n", failures ? "FAILED" : "ok");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
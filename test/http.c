@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <http.h>
+#include <map.h>
+#include <arena.h>
+#include <response.h>
+
+/**
+ * Checks the incremental request parser: a request split across reads at
+ * every offset parses to the same slices as in one read, and malformed,
+ * oversized or smuggling requests are refused.
+ * Run with "bench" to count mallocs and time per request instead.
+ */
+
+#define BENCH_REQUESTS 500000
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "[FAIL] " __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+/* Count every heap allocation, glibc lets a program replace malloc */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static long mallocs = 0;
+
+void *malloc(size_t size) {
+    mallocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    mallocs++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    mallocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+#else
+static long mallocs = -1; /* Not counted */
+#endif
+
+static const char request[] =
+    "\r\n"
+    "POST /items/42?sort=name&page=2 HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "User-Agent:  curl/8.0 \t\r\n"
+    "Accept: */*\n"
+    "X-Empty:\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 9\r\n"
+    "\r\n"
+    "name=test";
+
+static int slice_is(const char *buffer, struct http_slice slice, const char *expected) {
+    return slice.length == strlen(expected) && memcmp(buffer + slice.offset, expected, slice.length) == 0
+           && buffer[slice.offset + slice.length] == '\0';
+}
+
+static int parse(struct http_parser *parser, char *buffer, const char *data) {
+    strcpy(buffer, data);
+    http_parser_init(parser);
+    return http_parser_execute(parser, buffer, strlen(data));
+}
+
+/* Every slice of the sample request, each also NUL terminated in place */
+static void slices(void) {
+    char buffer[sizeof(request)];
+    struct http_parser parser;
+    CHECK(parse(&parser, buffer, request) == HTTP_PARSE_OK, "sample request does not parse");
+
+    CHECK(slice_is(buffer, parser.method, "POST"), "method slice");
+    CHECK(slice_is(buffer, parser.target, "/items/42?sort=name&page=2"), "target slice");
+    CHECK(slice_is(buffer, parser.version, "HTTP/1.1"), "version slice");
+    CHECK(parser.num_headers == 6, "%d headers, expected 6", parser.num_headers);
+
+    static const char *expected[][2] = {
+        { "Host", "example.com" },
+        { "User-Agent", "curl/8.0" },
+        { "Accept", "*/*" },
+        { "X-Empty", "" },
+        { "Content-Type", "application/x-www-form-urlencoded" },
+        { "Content-Length", "9" },
+    };
+    for (int i = 0; i < parser.num_headers && i < 6; i++) {
+        CHECK(slice_is(buffer, parser.headers[i].name, expected[i][0]), "header %d name", i);
+        CHECK(slice_is(buffer, parser.headers[i].value, expected[i][1]), "header %d value", i);
+    }
+    CHECK(strcmp(buffer + parser.body, "name=test") == 0, "body offset %zu", parser.body);
+
+    struct arena arena = {0};
+    struct http_request req = {0};
+    req.arena = &arena;
+    CHECK(http_request_init(&req, &parser, buffer) == 0, "request init failed");
+    CHECK(req.method == HTTP_POST, "method %d", req.method);
+    CHECK(strcmp(req.path, "/items/42") == 0, "path \"%s\"", req.path);
+    CHECK(slice_is(buffer, parser.target, "/items/42"), "target keeps the query");
+    CHECK(slice_is(buffer, parser.query, "sort=name&page=2"), "query slice");
+    CHECK(req.content_length == 9, "content length %d", req.content_length);
+    CHECK(!req.close && !req.http10, "HTTP/1.1 is persistent");
+
+    CHECK(strcmp(http_header(&req, HTTP_HEADER_HOST), "example.com") == 0, "Host slot");
+    CHECK(strcmp(http_get_header(&req, "user-agent"), "curl/8.0") == 0, "case-insensitive lookup");
+    CHECK(strcmp(http_get_header(&req, "x-empty"), "") == 0, "empty value");
+    CHECK(http_get_header(&req, "Cookie") == NULL, "missing header");
+    CHECK(map_get(http_get_headers(&req), "User-Agent") != NULL, "headers map keeps names as sent");
+
+    req.body = buffer + parser.body;
+    CHECK(strcmp(map_get(http_get_params(&req), "page"), "2") == 0, "query parameter");
+    CHECK(strcmp(map_get(http_get_data(&req), "name"), "test") == 0, "form field");
+    arena_destroy(&arena);
+}
+
+/**
+ * Feed the request in three reads split at every pair of offsets. Bytes not
+ * received yet are garbage, the result must match a single read exactly.
+ */
+static void splits(void) {
+    size_t length = strlen(request);
+    char reference[sizeof(request)];
+    struct http_parser expected;
+    parse(&expected, reference, request);
+
+    char buffer[sizeof(request)];
+    struct http_parser parser;
+    for (size_t first = 0; first <= length; first++) {
+        for (size_t second = first; second <= length; second++) {
+            memset(buffer, '#', sizeof(buffer));
+            http_parser_init(&parser);
+
+            size_t reads[] = { first, second, length };
+            int status = HTTP_PARSE_INCOMPLETE;
+            for (int r = 0; r < 3 && status == HTTP_PARSE_INCOMPLETE; r++) {
+                size_t received = r ? reads[r - 1] : 0;
+                memcpy(buffer + received, request + received, reads[r] - received);
+                status = http_parser_execute(&parser, buffer, reads[r]);
+                if (status == HTTP_PARSE_OK && reads[r] < expected.body) {
+                    CHECK(0, "split %zu/%zu: done after %zu bytes", first, second, reads[r]);
+                }
+            }
+
+            CHECK(status == HTTP_PARSE_OK, "split %zu/%zu: status %d", first, second, status);
+            CHECK(memcmp(&parser.method, &expected.method, 4 * sizeof(struct http_slice)) == 0
+                  && parser.num_headers == expected.num_headers && parser.body == expected.body
+                  && memcmp(parser.headers, expected.headers, sizeof(parser.headers[0]) * parser.num_headers) == 0,
+                  "split %zu/%zu: slices differ", first, second);
+            CHECK(memcmp(buffer, reference, expected.body) == 0, "split %zu/%zu: buffer differs", first, second);
+        }
+    }
+}
+
+/* Identical repeats are harmless, a second differing length smuggles a body */
+static void content_length(void) {
+    static const struct {
+        const char *request;
+        int valid;
+    } cases[] = {
+        { "POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\n", 1 },
+        { "POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n", 0 },
+        { "POST / HTTP/1.1\r\nContent-Length: 5\r\ncontent-length: 50\r\n\r\n", 0 },
+        { "POST / HTTP/1.1\r\nContent-Length: 5\r\nHost: a\r\nCONTENT-LENGTH: 05\r\n\r\n", 0 },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char buffer[256];
+        struct http_parser parser;
+        struct http_request req = {0};
+        CHECK(parse(&parser, buffer, cases[i].request) == HTTP_PARSE_OK, "content length case %zu does not parse", i);
+        int ret = http_request_init(&req, &parser, buffer);
+        CHECK((ret == 0) == cases[i].valid, "content length case %zu: init returned %d", i, ret);
+    }
+}
+
+static void malformed(void) {
+    static const char *cases[] = {
+        "GET /\r\n\r\n",
+        "GET / HTTP/2.0\r\n\r\n",
+        "GET / HTTP/1.1 \r\n\r\n",
+        "GET  HTTP/1.1\r\n\r\n",
+        "G(T / HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost : a\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost: a\r\n folded\r\n\r\n",
+        "GET / HTTP/1.1\r\n: empty\r\n\r\n",
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char buffer[256];
+        struct http_parser parser;
+        CHECK(parse(&parser, buffer, cases[i]) == HTTP_PARSE_ERROR, "malformed case %zu accepted", i);
+    }
+
+    /* An unknown method parses but is refused when the request is set up */
+    char buffer[256];
+    struct http_parser parser;
+    struct http_request req = {0};
+    CHECK(parse(&parser, buffer, "BREW / HTTP/1.1\r\n\r\n") == HTTP_PARSE_OK, "unknown method does not parse");
+    CHECK(http_request_init(&req, &parser, buffer) != 0, "unknown method accepted");
+}
+
+/* A request with one header line of the given length, \r included */
+static char *long_line_request(size_t line_length) {
+    size_t prefix = strlen("GET / HTTP/1.1\r\nX-Long: ");
+    char *data = malloc(prefix + line_length + 8);
+    strcpy(data, "GET / HTTP/1.1\r\nX-Long: ");
+    memset(data + prefix, 'a', line_length - strlen("X-Long: ") - 1);
+    strcpy(data + prefix + line_length - strlen("X-Long: ") - 1, "\r\n\r\n");
+    return data;
+}
+
+/* Lines up to HTTP_MAX_LINE are fine, longer ones fail whether or not their end has arrived */
+static void oversized(void) {
+    for (size_t line = HTTP_MAX_LINE - 1; line <= HTTP_MAX_LINE + 1; line++) {
+        char *data = long_line_request(line);
+        size_t length = strlen(data);
+        int valid = line <= HTTP_MAX_LINE;
+        struct http_parser parser;
+
+        http_parser_init(&parser);
+        int status = http_parser_execute(&parser, data, length);
+        CHECK(status == (valid ? HTTP_PARSE_OK : HTTP_PARSE_ERROR), "line of %zu in one read: status %d", line, status);
+
+        /* In 1000 byte reads the line is refused before its newline arrives */
+        char *copy = long_line_request(line);
+        http_parser_init(&parser);
+        status = HTTP_PARSE_INCOMPLETE;
+        for (size_t received = 0; received < length && status == HTTP_PARSE_INCOMPLETE;) {
+            received = received + 1000 < length ? received + 1000 : length;
+            status = http_parser_execute(&parser, copy, received);
+        }
+        CHECK(status == (valid ? HTTP_PARSE_OK : HTTP_PARSE_ERROR), "line of %zu in reads: status %d", line, status);
+
+        free(data);
+        free(copy);
+    }
+
+    /* A request line without any newline waits until it is too long */
+    char *data = malloc(HTTP_MAX_LINE + 1);
+    memset(data, 'a', HTTP_MAX_LINE + 1);
+    struct http_parser parser;
+    http_parser_init(&parser);
+    int status = http_parser_execute(&parser, data, HTTP_MAX_LINE);
+    CHECK(status == HTTP_PARSE_INCOMPLETE, "request line of HTTP_MAX_LINE: status %d", status);
+    status = http_parser_execute(&parser, data, HTTP_MAX_LINE + 1);
+    CHECK(status == HTTP_PARSE_ERROR, "request line past HTTP_MAX_LINE: status %d", status);
+    free(data);
+
+    /* One header more than the index holds */
+    data = malloc(64 + (HTTP_MAX_HEADERS + 1) * 16);
+    for (int count = HTTP_MAX_HEADERS; count <= HTTP_MAX_HEADERS + 1; count++) {
+        char *p = data + sprintf(data, "GET / HTTP/1.1\r\n");
+        for (int i = 0; i < count; i++) p += sprintf(p, "X-%d: %d\r\n", i, i);
+        strcpy(p, "\r\n");
+
+        http_parser_init(&parser);
+        status = http_parser_execute(&parser, data, strlen(data));
+        CHECK(status == (count <= HTTP_MAX_HEADERS ? HTTP_PARSE_OK : HTTP_PARSE_ERROR), "%d headers: status %d", count, status);
+    }
+    free(data);
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Parse only, then what the gateway does for a route without LAZY_PARAMS:
+ * headers, params and data maps plus the response, cleaned up as after a response.
+ */
+static void bench(void) {
+    struct arena arena = {0};
+    char buffer[sizeof(request)];
+
+    for (int full = 0; full <= 1; full++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long before = mallocs;
+
+        for (int i = 0; i < BENCH_REQUESTS; i++) {
+            struct http_parser parser;
+            struct http_request req = {0};
+            req.arena = &arena;
+            parse(&parser, buffer, request);
+            http_request_init(&req, &parser, buffer);
+            req.body = buffer + parser.body;
+
+            if (full) {
+                struct http_response res;
+                http_get_headers(&req);
+                http_get_params(&req);
+                http_get_data(&req);
+                http_response_init(&res, -1, &arena, NULL, 0);
+                map_destroy(req.params);
+                map_destroy(req.headers);
+                map_destroy(req.data);
+                map_destroy(res.headers);
+            }
+            arena_reset(&arena);
+        }
+
+        double ns = seconds_since(&start) / BENCH_REQUESTS * 1e9;
+        printf("%-28s %6.0f ns  %6.2f mallocs per request\n", full ? "parse, maps and response" : "parse",
+               ns, mallocs < 0 ? -1.0 : (double)(mallocs - before) / BENCH_REQUESTS);
+    }
+    arena_destroy(&arena);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench();
+        return 0;
+    }
+
+    slices();
+    splits();
+    content_length();
+    malformed();
+    oversized();
+
+    printf("[TEST] http: %s\n", failures ? "FAILED" : "ok");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
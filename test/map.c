@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <map.h>
+#include <arena.h>
+
+/**
+ * Checks struct map against a plain linear map, the algorithm map.c used
+ * before the Swiss table, with random inserts, lookups and removals.
+ * Run with "bench" to compare the two instead.
+ */
+
+#define FUZZ_ROUNDS 200
+#define FUZZ_OPS 3000
+#define FUZZ_KEYS 400
+#define FUZZ_MAX_KEY 40
+#define BENCH_REQUESTS 200000
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "[FAIL] " __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+/* Linear scan over malloc'd keys with a fixed capacity */
+struct linear_map {
+    struct map_entry *entries;
+    size_t size;
+    size_t capacity;
+};
+
+static struct linear_map *linear_create(size_t capacity) {
+    struct linear_map *m = malloc(sizeof(struct linear_map));
+    m->entries = malloc(capacity * sizeof(struct map_entry));
+    m->size = 0;
+    m->capacity = capacity;
+    return m;
+}
+
+static void linear_destroy(struct linear_map *m) {
+    for (size_t i = 0; i < m->size; i++) {
+        free(m->entries[i].key);
+    }
+    free(m->entries);
+    free(m);
+}
+
+static int linear_insert(struct linear_map *m, const char *key, void *value) {
+    if (m->size >= m->capacity) {
+        return -MAP_ERR;
+    }
+    for (size_t i = 0; i < m->size; i++) {
+        if (strcmp(m->entries[i].key, key) == 0) return 0;
+    }
+    m->entries[m->size].key = strdup(key);
+    m->entries[m->size].value = value;
+    m->size++;
+    return 0;
+}
+
+static void *linear_get(const struct linear_map *m, const char *key) {
+    for (size_t i = 0; i < m->size; i++) {
+        if (strcmp(m->entries[i].key, key) == 0) return m->entries[i].value;
+    }
+    return NULL;
+}
+
+static int linear_remove(struct linear_map *m, const char *key) {
+    for (size_t i = 0; i < m->size; i++) {
+        if (strcmp(m->entries[i].key, key) == 0) {
+            free(m->entries[i].key);
+            m->entries[i] = m->entries[--m->size];
+            return 0;
+        }
+    }
+    return -MAP_KEY_NOT_FOUND;
+}
+
+/* Modules built against the original map.h index entries with this stride */
+static void layout(void) {
+    CHECK(sizeof(struct map_entry) == 2 * sizeof(void *), "map_entry is %zu bytes", sizeof(struct map_entry));
+    CHECK(offsetof(struct map_entry, key) == 0 && offsetof(struct map_entry, value) == sizeof(void *), "map_entry fields moved");
+    CHECK(offsetof(struct map, entries) == 0 && offsetof(struct map, size) == sizeof(void *)
+          && offsetof(struct map, capacity) == sizeof(void *) + sizeof(size_t), "map fields moved");
+}
+
+static void fuzz(void) {
+    static char keys[FUZZ_KEYS][FUZZ_MAX_KEY];
+
+    for (int round = 0; round < FUZZ_ROUNDS; round++) {
+        /* Short keys over a small alphabet collide often, long ones are not stored inline */
+        for (int i = 0; i < FUZZ_KEYS; i++) {
+            int length = rand() % (FUZZ_MAX_KEY - 1);
+            for (int j = 0; j < length; j++) keys[i][j] = 'a' + rand() % 3;
+            keys[i][length] = '\0';
+        }
+
+        /* Every other round in an arena, where growing copies instead of reallocating */
+        struct arena arena = {0};
+        struct map *map = round % 2 ? map_create_arena(&arena, 1 + rand() % 5) : map_create(1 + rand() % 5);
+        struct linear_map *reference = linear_create(FUZZ_KEYS);
+
+        for (long op = 1; op <= FUZZ_OPS; op++) {
+            const char *key = keys[rand() % FUZZ_KEYS];
+            switch (rand() % 3) {
+            case 0:
+                CHECK(map_insert(map, key, (void *)op) == 0, "insert \"%s\" failed", key);
+                linear_insert(reference, key, (void *)op);
+                break;
+            case 1:
+                CHECK(map_remove(map, key) == linear_remove(reference, key), "remove \"%s\" disagrees", key);
+                break;
+            default:
+                CHECK(map_get(map, key) == linear_get(reference, key), "get \"%s\" disagrees", key);
+                break;
+            }
+        }
+
+        /* Iteration sees every key exactly once, with keys that still read back */
+        CHECK(map_size(map) == reference->size, "size %zu, expected %zu", map_size(map), reference->size);
+        for (size_t i = 0; i < map->size; i++) {
+            const struct map_entry *entry = &map->entries[i];
+            CHECK(linear_get(reference, entry->key) == entry->value, "entry %zu \"%s\" has a stale value", i, entry->key);
+            CHECK(map_get(map, entry->key) == entry->value, "entry %zu \"%s\" is not indexed", i, entry->key);
+        }
+
+        map_destroy(map);
+        arena_destroy(&arena);
+        linear_destroy(reference);
+    }
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* A typical request's headers, inserted and then each looked up once */
+static void bench_request(void) {
+    static const char *names[] = {
+        "Host", "User-Agent", "Accept", "Accept-Encoding", "Accept-Language", "Connection",
+        "Cookie", "Content-Type", "Content-Length", "Referer", "Cache-Control", "Upgrade-Insecure-Requests",
+    };
+    size_t count = sizeof(names) / sizeof(names[0]);
+    struct timespec start;
+    volatile size_t sink = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < BENCH_REQUESTS; r++) {
+        struct linear_map *m = linear_create(32);
+        for (size_t i = 0; i < count; i++) linear_insert(m, names[i], (void *)names[i]);
+        for (size_t i = 0; i < count; i++) sink += (size_t)linear_get(m, names[i]);
+        linear_destroy(m);
+    }
+    double linear = seconds_since(&start) / BENCH_REQUESTS * 1e9;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < BENCH_REQUESTS; r++) {
+        struct map *m = map_create(count);
+        for (size_t i = 0; i < count; i++) map_insert(m, names[i], (void *)names[i]);
+        for (size_t i = 0; i < count; i++) sink += (size_t)map_get(m, names[i]);
+        map_destroy(m);
+    }
+    double swiss = seconds_since(&start) / BENCH_REQUESTS * 1e9;
+
+    printf("%zu headers, insert and get   linear %8.0f ns   map %8.0f ns\n", count, linear, swiss);
+    (void)sink;
+}
+
+/* Lookups in a map of n keys, like the container cache */
+static void bench_lookup(size_t n) {
+    char key[32];
+    struct linear_map *linear = linear_create(n);
+    struct map *map = map_create(16);
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "session-%zu", i);
+        linear_insert(linear, key, (void *)(i + 1));
+        map_insert(map, key, (void *)(i + 1));
+    }
+
+    size_t lookups = 2000000 / n + 1000;
+    struct timespec start;
+    volatile size_t sink = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < lookups; i++) {
+        snprintf(key, sizeof(key), "session-%zu", i % n);
+        sink += (size_t)linear_get(linear, key);
+    }
+    double linear_ns = seconds_since(&start) / lookups * 1e9;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < lookups; i++) {
+        snprintf(key, sizeof(key), "session-%zu", i % n);
+        sink += (size_t)map_get(map, key);
+    }
+    double map_ns = seconds_since(&start) / lookups * 1e9;
+
+    printf("%6zu keys, get                linear %8.0f ns   map %8.0f ns\n", n, linear_ns, map_ns);
+    linear_destroy(linear);
+    map_destroy(map);
+    (void)sink;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench_request();
+        bench_lookup(32);
+        bench_lookup(1000);
+        bench_lookup(10000);
+        return 0;
+    }
+
+    srand(1);
+    layout();
+    fuzz();
+
+    printf("[TEST] map: %s\n", failures ? "FAILED" : "ok");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Built in directly, the renderers under test are static */
+#include "../src/response.c"
+
+/**
+ * Checks the iovec response renderer against the snprintf renderer it
+ * replaced: apart from the added Date header the bytes must not change.
+ * Also checks how Vary is built up.
+ * Run with "bench" to compare bytes copied and time per response instead.
+ */
+
+#define BENCH_RESPONSES 1000000
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "[FAIL] " __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+/* The header renderer before status lines were pre-rendered, kept as the reference */
+static int snprintf_header_block(struct http_response *res, char *buffer, size_t size, long content_length) {
+    int length = snprintf(buffer, size, HTTP_VERSION" %s\r\n", http_errors[res->status]);
+
+    for (size_t i = 0; i < map_size(res->headers); i++) {
+        const char *name = res->headers->entries[i].key;
+
+        if (strcasecmp(name, "Content-Length") == 0 || strcasecmp(name, "Transfer-Encoding") == 0) {
+            continue;
+        }
+        if (res->status != HTTP_101_SWITCHING_PROTOCOLS && strcasecmp(name, "Connection") == 0) {
+            if (http_header_has_token(res->headers->entries[i].value, "close")) {
+                res->flags |= HTTP_RESPONSE_CLOSE;
+            }
+            continue;
+        }
+
+        int written = snprintf(buffer + length, size - length, "%s: %s\r\n", res->headers->entries[i].key, (char*)res->headers->entries[i].value);
+        if (written < 0 || (size_t)written >= size - length) {
+            break;
+        }
+        length += written;
+    }
+
+    const char *connection = NULL;
+    if (res->status != HTTP_101_SWITCHING_PROTOCOLS) {
+        if (res->flags & HTTP_RESPONSE_CLOSE) {
+            connection = "Connection: close\r\n";
+        } else if (res->flags & HTTP_RESPONSE_KEEP_ALIVE) {
+            connection = "Connection: keep-alive\r\n";
+        }
+    }
+
+    int written;
+    if (content_length >= 0) {
+        written = snprintf(buffer + length, size - length, "%sContent-Length: %ld\r\n\r\n", connection ? connection : "", content_length);
+    } else if (res->flags & HTTP_RESPONSE_CHUNKED) {
+        written = snprintf(buffer + length, size - length, "%sTransfer-Encoding: chunked\r\n\r\n", connection ? connection : "");
+    } else {
+        written = snprintf(buffer + length, size - length, "%s\r\n", connection ? connection : "");
+    }
+    if (written < 0 || (size_t)written >= size - length) {
+        return -1;
+    }
+    return length + written;
+}
+
+/* Concatenate iovecs, dropping the Date line so the output can be compared */
+static size_t flatten(const struct iovec *iov, int count, char *out) {
+    size_t length = 0;
+    for (int i = 0; i < count; i++) {
+        if (i == 1 && strncmp(iov[i].iov_base, "Date: ", 6) == 0) continue;
+        memcpy(out + length, iov[i].iov_base, iov[i].iov_len);
+        length += iov[i].iov_len;
+    }
+    out[length] = '\0';
+    return length;
+}
+
+static void response_setup(struct http_response *res, struct arena *arena, int flags) {
+    http_response_init(res, -1, arena, NULL, flags);
+    res->status = HTTP_200_OK;
+    map_insert(res->headers, "Content-Type", "text/html; charset=utf-8");
+    map_insert(res->headers, "Cache-Control", "no-cache");
+    map_insert(res->headers, "X-Request-Id", "3f9a6c0e2b71");
+    strcpy(res->body, "<p>hello world</p>\n");
+}
+
+/* Both renderers on the same response, the new one must only add Date */
+static void check_same(const char *name, int flags, const char *header, const char *value, int status) {
+    struct arena arena = {0};
+    struct http_response res;
+    response_setup(&res, &arena, flags);
+    res.status = status;
+    if (header) map_insert(res.headers, header, (void *)value);
+    size_t length = http_response_body_length(&res);
+
+    char old[RESPONSE_HEADER_SIZE + HTTP_RESPONSE_SIZE];
+    struct http_response copy = res;
+    int old_length = snprintf_header_block(&copy, old, RESPONSE_HEADER_SIZE, length);
+    memcpy(old + old_length, res.body, length);
+    old[old_length + length] = '\0';
+
+    struct iovec iov[RESPONSE_HEADER_IOV + 1];
+    char headers[RESPONSE_HEADER_SIZE];
+    char out[RESPONSE_HEADER_SIZE + HTTP_RESPONSE_SIZE];
+    int count = response_render(&res, iov, headers, sizeof(headers));
+    CHECK(count > 0 && strncmp(iov[1].iov_base, "Date: ", 6) == 0, "%s: no Date header", name);
+    flatten(iov, count, out);
+    CHECK(strcmp(out, old) == 0, "%s: rendered\n%s\nexpected\n%s", name, out, old);
+    CHECK((res.flags & HTTP_RESPONSE_CLOSE) == (copy.flags & HTTP_RESPONSE_CLOSE), "%s: close flag differs", name);
+    arena_destroy(&arena);
+}
+
+/* Responses where the renderers agree, then the ones the iovec renderer changes on purpose */
+static void rendering(void) {
+    check_same("plain", 0, NULL, NULL, HTTP_200_OK);
+    check_same("keep-alive", HTTP_RESPONSE_KEEP_ALIVE, NULL, NULL, HTTP_200_OK);
+    check_same("close", HTTP_RESPONSE_CLOSE, NULL, NULL, HTTP_200_OK);
+    check_same("handler close", 0, "Connection", "close", HTTP_200_OK);
+    check_same("handler length", 0, "Content-Length", "99", HTTP_200_OK);
+    check_same("not found", 0, NULL, NULL, HTTP_404_NOT_FOUND);
+    check_same("upgrade", 0, "Connection", "Upgrade", HTTP_101_SWITCHING_PROTOCOLS);
+
+    struct arena arena = {0};
+    struct http_response res;
+    struct iovec iov[RESPONSE_HEADER_IOV + 1];
+    char headers[RESPONSE_HEADER_SIZE];
+    char out[RESPONSE_HEADER_SIZE + HTTP_RESPONSE_SIZE];
+
+    /* A handler Date is replaced by ours */
+    response_setup(&res, &arena, 0);
+    map_insert(res.headers, "Date", "yesterday");
+    flatten(iov, response_render(&res, iov, headers, sizeof(headers)), out);
+    CHECK(strstr(out, "yesterday") == NULL, "handler Date was sent");
+
+    /* A 304 keeps its headers but has neither a body nor a length */
+    response_setup(&res, &arena, 0);
+    res.status = HTTP_304_NOT_MODIFIED;
+    int count = response_render(&res, iov, headers, sizeof(headers));
+    flatten(iov, count, out);
+    CHECK(count == RESPONSE_HEADER_IOV && strstr(out, "Content-Length") == NULL && strstr(out, "Cache-Control: no-cache\r\n"),
+          "304 rendered\n%s", out);
+
+    /* Streamed bodies of unknown length are chunked */
+    response_setup(&res, &arena, HTTP_RESPONSE_CHUNKED);
+    count = response_header_iov(&res, iov, headers, sizeof(headers), -1);
+    flatten(iov, count, out);
+    CHECK(strstr(out, "Transfer-Encoding: chunked\r\n\r\n") != NULL, "chunked rendered\n%s", out);
+
+    /* Headers that do not fit are dropped, framing still goes out */
+    response_setup(&res, &arena, 0);
+    count = response_header_iov(&res, iov, headers, 64, 5);
+    flatten(iov, count, out);
+    CHECK(count == RESPONSE_HEADER_IOV && strstr(out, "Content-Length: 5\r\n\r\n") != NULL, "overflow rendered\n%s", out);
+
+    /* Canned responses, with and without their body */
+    static const char canned[] = "HTTP/1.1 404 Not Found\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 14\r\n\r\n";
+    response_setup(&res, &arena, HTTP_RESPONSE_CLOSE);
+    http_response_error(&res, HTTP_404_NOT_FOUND);
+    flatten(iov, response_render(&res, iov, headers, sizeof(headers)), out);
+    CHECK(strncmp(out, canned, sizeof(canned) - 1) == 0 && strcmp(out + sizeof(canned) - 1, "404 Not Found\n") == 0,
+          "canned 404 rendered\n%s", out);
+
+    response_setup(&res, &arena, HTTP_RESPONSE_CLOSE | HTTP_RESPONSE_NO_BODY);
+    http_response_error(&res, HTTP_404_NOT_FOUND);
+    flatten(iov, response_render(&res, iov, headers, sizeof(headers)), out);
+    CHECK(strcmp(out, canned) == 0, "canned HEAD 404 rendered\n%s", out);
+
+    arena_destroy(&arena);
+}
+
+/* Vary collects the names of every header that picked the variant */
+static void vary(void) {
+    struct arena arena = {0};
+    struct http_response res;
+
+    response_setup(&res, &arena, 0);
+    http_response_vary(&res, "Accept-Encoding");
+    CHECK(strcmp(map_get(res.headers, "Vary"), "Accept-Encoding") == 0, "vary set to %s", (char *)map_get(res.headers, "Vary"));
+
+    response_setup(&res, &arena, 0);
+    map_insert(res.headers, "Vary", "Origin");
+    http_response_vary(&res, "Accept-Encoding");
+    http_response_vary(&res, "accept-encoding");
+    CHECK(strcmp(map_get(res.headers, "Vary"), "Origin, Accept-Encoding") == 0, "vary appended to %s", (char *)map_get(res.headers, "Vary"));
+
+    response_setup(&res, &arena, 0);
+    map_insert(res.headers, "Vary", "*");
+    http_response_vary(&res, "Accept-Encoding");
+    CHECK(strcmp(map_get(res.headers, "Vary"), "*") == 0, "vary * changed to %s", (char *)map_get(res.headers, "Vary"));
+
+    arena_destroy(&arena);
+}
+
+/* HEAD responses only get an automatic ETag when the handler filled the body anyway */
+static void etag(void) {
+    struct arena arena = {0};
+    struct http_request req = {0};
+    struct http_response res;
+
+    response_setup(&res, &arena, HTTP_RESPONSE_NO_BODY);
+    res.body[0] = '\0';
+    http_response_etag(&req, &res);
+    CHECK(map_get(res.headers, "ETag") == NULL, "empty HEAD response got an ETag");
+
+    response_setup(&res, &arena, HTTP_RESPONSE_NO_BODY);
+    http_response_etag(&req, &res);
+    const char *head = map_get(res.headers, "ETag");
+    response_setup(&res, &arena, 0);
+    http_response_etag(&req, &res);
+    const char *get = map_get(res.headers, "ETag");
+    CHECK(head && get && strcmp(head, get) == 0, "HEAD ETag %s, GET ETag %s", head, get);
+
+    arena_destroy(&arena);
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static unsigned long long cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void report(const char *name, const struct timespec *start, unsigned long long first, size_t copied) {
+    double ns = seconds_since(start) / BENCH_RESPONSES * 1e9;
+    printf("%-22s %6.0f ns  %6.0f cycles  %6zu bytes copied per response\n", name, ns,
+           (double)(cycles() - first) / BENCH_RESPONSES, copied / BENCH_RESPONSES);
+}
+
+/**
+ * Rendering only, no syscalls. The snprintf path copies the whole header block,
+ * the iovec path only handler headers and framing, canned responses nothing.
+ */
+static void bench(void) {
+    struct arena arena = {0};
+    struct http_response res;
+    struct iovec iov[RESPONSE_HEADER_IOV + 1];
+    char headers[RESPONSE_HEADER_SIZE];
+    struct timespec start;
+    unsigned long long first;
+    size_t copied;
+
+    for (int canned = 0; canned <= 1; canned++) {
+        response_setup(&res, &arena, HTTP_RESPONSE_KEEP_ALIVE);
+        if (canned) {
+            map_destroy(res.headers);
+            res.headers = map_create_arena(&arena, 1);
+            res.status = HTTP_404_NOT_FOUND;
+        }
+
+        /* Before: errors were a formatted body behind snprintf headers */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        first = cycles();
+        copied = 0;
+        for (int i = 0; i < BENCH_RESPONSES; i++) {
+            size_t length;
+            if (canned) {
+                length = snprintf(res.body, HTTP_RESPONSE_SIZE, "%s\n", http_errors[res.status]);
+                copied += length;
+            } else {
+                length = http_response_body_length(&res);
+            }
+            int header_length = snprintf_header_block(&res, headers, sizeof(headers), length);
+            copied += header_length;
+            __asm__ volatile("" : : "r"(headers) : "memory");
+        }
+        report(canned ? "canned 404, snprintf" : "200, snprintf", &start, first, copied);
+
+        if (canned) {
+            http_response_error(&res, HTTP_404_NOT_FOUND);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        first = cycles();
+        copied = 0;
+        for (int i = 0; i < BENCH_RESPONSES; i++) {
+            int count = response_render(&res, iov, headers, sizeof(headers));
+            for (int j = 0; j < count; j++) {
+                if (iov[j].iov_base == headers) copied += iov[j].iov_len;
+            }
+            __asm__ volatile("" : : "r"(iov), "r"(headers) : "memory");
+        }
+        report(canned ? "canned 404, iovecs" : "200, iovecs", &start, first, copied);
+    }
+    arena_destroy(&arena);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench();
+        return 0;
+    }
+
+    rendering();
+    vary();
+    etag();
+
+    printf("[TEST] response: %s\n", failures ? "FAILED" : "ok");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
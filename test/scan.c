@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <scan.h>
+
+/**
+ * Checks that the scanner picked at startup agrees with the scalar versions.
+ * Inputs end right before an inaccessible page, so reading past the end faults.
+ * Run with "bench" to measure throughput instead.
+ */
+
+#define FUZZ_ROUNDS 200000
+#define FUZZ_MAX_LENGTH 300
+#define FUZZ_MAX_NEEDLE 12
+#define BENCH_SIZE (64 * 1024 * 1024)
+#define BENCH_ROUNDS 10
+
+static char *page_end = NULL; /* First byte of the guard page */
+static long page_size = 4096;
+
+static int failures = 0;
+
+/* RFC 7230 tchar, independent of the nibble tables */
+static int is_tchar(unsigned char c) {
+    if (c >= '0' && c <= '9') return 1;
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') return 1;
+    return c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+/* Mostly token bytes and the bytes the parser looks for, sometimes anything */
+static char random_byte(void) {
+    static const char common[] = "abcXYZ019-_.:; \t\r\n";
+    if (rand() % 8 == 0) {
+        return (char)(rand() % 256);
+    }
+    return common[rand() % (sizeof(common) - 1)];
+}
+
+/* Copy length bytes so they end at the guard page */
+static const char *place(const char *data, size_t length) {
+    char *start = page_end - length;
+    memcpy(start, data, length);
+    return start;
+}
+
+static void check_token(const char *data, size_t length) {
+    size_t expected = scan_token_scalar(data, length);
+    size_t got = scan.token(data, length);
+    if (got != expected) {
+        fprintf(stderr, "[FAIL] token: length %zu, %s returned %zu, scalar %zu\n", length, scan.name, got, expected);
+        failures++;
+    }
+
+    size_t reference = 0;
+    while (reference < length && is_tchar((unsigned char)data[reference])) reference++;
+    if (expected != reference) {
+        fprintf(stderr, "[FAIL] token: length %zu, scalar returned %zu, RFC 7230 %zu\n", length, expected, reference);
+        failures++;
+    }
+}
+
+static void check_find(const char *data, size_t length, const char *needle, size_t needle_length) {
+    const char *expected = scan_find_scalar(data, length, needle, needle_length);
+    const char *got = scan.find(data, length, needle, needle_length);
+    if (got != expected) {
+        fprintf(stderr, "[FAIL] find: length %zu, needle %zu, %s returned %td, scalar %td\n", length, needle_length,
+                scan.name, got ? got - data : -1, expected ? expected - data : -1);
+        failures++;
+    }
+
+    const char *reference = needle_length <= length ? memmem(data, length, needle, needle_length) : NULL;
+    if (needle_length > 0 && expected != reference) {
+        fprintf(stderr, "[FAIL] find: length %zu, needle %zu, scalar returned %td, memmem %td\n", length, needle_length,
+                expected ? expected - data : -1, reference ? reference - data : -1);
+        failures++;
+    }
+}
+
+static void fuzz(void) {
+    char buffer[FUZZ_MAX_LENGTH];
+    char needle[FUZZ_MAX_NEEDLE];
+
+    for (int round = 0; round < FUZZ_ROUNDS; round++) {
+        size_t length = rand() % FUZZ_MAX_LENGTH;
+        for (size_t i = 0; i < length; i++) {
+            buffer[i] = random_byte();
+        }
+
+        /* A run of token bytes first, so the first mismatch lands anywhere, including the tail */
+        size_t run = length ? rand() % length : 0;
+        for (size_t i = 0; i < run; i++) {
+            if (!is_tchar((unsigned char)buffer[i])) buffer[i] = 'a';
+        }
+
+        size_t needle_length = rand() % FUZZ_MAX_NEEDLE;
+        if (needle_length > 0 && length >= needle_length && rand() % 2) {
+            /* Planted, also right at the end */
+            size_t at = rand() % 4 == 0 ? length - needle_length : rand() % (length - needle_length + 1);
+            memcpy(needle, buffer + at, needle_length);
+        } else {
+            for (size_t i = 0; i < needle_length; i++) {
+                needle[i] = random_byte();
+            }
+        }
+
+        const char *data = place(buffer, length);
+        check_token(data, length);
+        check_find(data, length, needle, needle_length);
+    }
+}
+
+/* Every length up to a few vectors, all token bytes and a single bad byte at every position */
+static void edges(void) {
+    char buffer[FUZZ_MAX_LENGTH];
+    for (size_t length = 0; length <= 100; length++) {
+        memset(buffer, 't', length);
+        check_token(place(buffer, length), length);
+        check_find(place(buffer, length), length, "tt-", 3);
+
+        for (size_t bad = 0; bad < length; bad++) {
+            memset(buffer, 't', length);
+            buffer[bad] = ':';
+            check_token(place(buffer, length), length);
+
+            if (bad + 2 <= length) {
+                buffer[bad + 1] = '-';
+                check_find(place(buffer, length), length, ":-", 2);
+            }
+        }
+    }
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench(void) {
+    char *data = malloc(BENCH_SIZE);
+    if (data == NULL) {
+        perror("[ERROR] Error allocating benchmark buffer");
+        exit(EXIT_FAILURE);
+    }
+    memset(data, 'a', BENCH_SIZE);
+
+    struct {
+        const char *name;
+        size_t (*token)(const char *, size_t);
+        const char *(*find)(const char *, size_t, const char *, size_t);
+    } variants[] = {
+        { "scalar", scan_token_scalar, scan_find_scalar },
+        { scan.name, scan.token, scan.find },
+    };
+
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+        struct timespec start;
+        volatile size_t sink = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < BENCH_ROUNDS; i++) sink += variants[v].token(data, BENCH_SIZE);
+        double token = (double)BENCH_SIZE * BENCH_ROUNDS / seconds_since(&start) / 1e9;
+
+        /* A multipart boundary whose first byte is everywhere, the worst case for memchr */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < BENCH_ROUNDS; i++) sink += (size_t)variants[v].find(data, BENCH_SIZE, "a-boundary", 10);
+        double find = (double)BENCH_SIZE * BENCH_ROUNDS / seconds_since(&start) / 1e9;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < BENCH_ROUNDS; i++) sink += (size_t)variants[v].find(data, BENCH_SIZE, "--boundary", 10);
+        double find_rare = (double)BENCH_SIZE * BENCH_ROUNDS / seconds_since(&start) / 1e9;
+
+        printf("%-8s token %6.2f GB/s  find %6.2f GB/s  find (rare first byte) %6.2f GB/s\n",
+               variants[v].name, token, find, find_rare);
+        (void)sink;
+    }
+    free(data);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench();
+        return 0;
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+    char *pages = mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED || mprotect(pages + page_size, page_size, PROT_NONE) != 0) {
+        perror("[ERROR] Error mapping guard page");
+        return EXIT_FAILURE;
+    }
+    page_end = pages + page_size;
+
+    srand(1);
+    edges();
+    fuzz();
+
+    munmap(pages, 2 * page_size);
+    printf("[TEST] scan (%s): %s\n", scan.name, failures ? "FAILED" : "ok");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}